@@ -0,0 +1,2980 @@
+/*
+ *  PatchELF is a utility to modify properties of ELF executables and libraries
+ *  Copyright (C) 2004-2016  Eelco Dolstra <edolstra@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or (at
+ *  your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string>
+#include <vector>
+#include <set>
+#include <map>
+#include <algorithm>
+#include <memory>
+#include <sstream>
+#include <limits>
+#include <stdexcept>
+#include <atomic>
+#include <thread>
+#include <system_error>
+
+#include <cstdlib>
+#include <cstdio>
+#include <cstdarg>
+#include <cassert>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "elf.h"
+#include "patchelf.h"
+#include "util.h"
+
+
+namespace patchelf {
+
+
+#define ElfFileParams class Elf_Ehdr, class Elf_Phdr, class Elf_Shdr, class Elf_Addr, class Elf_Off, class Elf_Dyn, class Elf_Sym, class Elf_Verneed, class Elf_Rel, class Elf_Rela
+#define ElfFileParamNames Elf_Ehdr, Elf_Phdr, Elf_Shdr, Elf_Addr, Elf_Off, Elf_Dyn, Elf_Sym, Elf_Verneed, Elf_Rel, Elf_Rela
+
+
+static bool hasAllowedPrefix(const std::string & s, const std::vector<std::string> & allowedPrefixes)
+{
+    for (auto & i : allowedPrefixes)
+        if (!s.compare(0, i.size(), i)) return true;
+    return false;
+}
+
+
+template<ElfFileParams>
+class ElfFile
+{
+public:
+
+    const FileContents fileContents;
+
+private:
+
+    unsigned char * contents;
+
+    Elf_Ehdr * hdr;
+    std::vector<Elf_Phdr> phdrs;
+    std::vector<Elf_Shdr> shdrs;
+
+    bool littleEndian;
+
+    bool changed = false;
+
+    bool isExecutable = false;
+
+    size_t fileShift = 0;
+
+    /* From the Operations. */
+    unsigned int pageSize;
+    bool segmentAlign;
+    bool gc;
+    unsigned int threads;
+    bool forceRPath;
+    int logLevel;
+
+    Stats * stats;
+
+    typedef std::string SectionName;
+
+    /* The new contents of the replaced sections, by section index;
+       sortShdrs() renumbers them. */
+    typedef std::map<unsigned int, std::string> ReplacedSections;
+
+    ReplacedSections replacedSections;
+
+    std::string sectionNames; /* content of the .shstrtab section */
+
+    /* Align on 4 or 8 bytes boundaries on 32- or 64-bit platforms
+       respectively. */
+    size_t sectionAlignment = sizeof(Elf_Off);
+
+    std::vector<SectionName> sectionsByOldIndex;
+    std::vector<Elf_Addr> sectionAddrsByOldIndex;
+
+    /* Whether sections were added, so that the section header table
+       (and .shstrtab) no longer fit in their original location. */
+    bool sectionsAdded = false;
+
+    /* The edit plan for .dynamic.  Its entries are parsed once, when
+       first needed; the operations edit this list and add the strings
+       they need to 'newStrings', and commitDynamic() then writes
+       .dynamic and .dynstr once, however many operations there were.
+       Strings already in .dynstr are overwritten in place.  The
+       entries are indexed by tag, so that the operations look up the
+       ones they need rather than each scanning the list. */
+    struct DynamicPlan
+    {
+        bool loaded = false, changed = false;
+        std::vector<Elf_Dyn> entries; /* without the DT_NULL */
+        std::map<Elf64_Sxword, std::vector<size_t>> byTag; /* positions in 'entries' */
+        size_t oldCount = 0; /* entries in the file */
+        char * strTab = 0;
+        size_t strSize = 0; /* of .dynstr in the file */
+        std::string newStrings; /* to append to .dynstr */
+        std::map<std::string, Elf64_Xword> newStringOffsets;
+    };
+
+    DynamicPlan dynamicPlan;
+
+public:
+
+    /* What the print* operations found. */
+    Result result;
+
+    ElfFile(FileContents fileContents, const Operations & ops, Stats * stats);
+
+    bool isChanged()
+    {
+        return changed;
+    }
+
+    /* By how many bytes shiftFile() moved the original contents. */
+    size_t getFileShift()
+    {
+        return fileShift;
+    }
+
+private:
+
+    unsigned int getPageSize()
+    {
+        return pageSize;
+    }
+
+    struct CompPhdr
+    {
+        ElfFile * elfFile;
+        bool operator ()(const Elf_Phdr & x, const Elf_Phdr & y)
+        {
+            // A PHDR comes before everything else.
+            if (elfFile->rdi(y.p_type) == PT_PHDR) return false;
+            if (elfFile->rdi(x.p_type) == PT_PHDR) return true;
+
+            // Sort non-PHDRs by address.
+            return elfFile->rdi(x.p_paddr) < elfFile->rdi(y.p_paddr);
+        }
+    };
+
+    friend struct CompPhdr;
+
+    void sortPhdrs();
+
+    struct CompShdr
+    {
+        ElfFile * elfFile;
+        bool operator ()(const Elf_Shdr & x, const Elf_Shdr & y)
+        {
+            return elfFile->rdi(x.sh_offset) < elfFile->rdi(y.sh_offset);
+        }
+    };
+
+    friend struct CompShdr;
+
+    void sortShdrs();
+
+    void shiftFile(unsigned int extraPages, Elf_Addr startPage, unsigned int flags);
+
+    static bool compatibleFlags(unsigned int segFlags, unsigned int flags);
+
+    int findExtensibleSegment(unsigned int flags);
+
+    unsigned int segmentFlags(unsigned int sectionIndex);
+
+    unsigned int getSegmentAlignment();
+
+    DynamicPlan & loadDynamic();
+
+    /* The string at 'offset' in .dynstr, in the file or added. */
+    char * dynString(Elf64_Xword offset);
+
+    /* Add 's' to .dynstr, unless it was added before; returns its
+       offset. */
+    Elf64_Xword addDynString(const std::string & s);
+
+    void insertDynamic(size_t pos, Elf64_Xword tag, Elf64_Xword val);
+
+    /* Rebuild the tag index of the plan; needed after entries were
+       removed or their tags changed. */
+    void indexDynamic();
+
+    /* The positions of the entries with tag 'tag', in order. */
+    const std::vector<size_t> & dynPositions(Elf64_Sxword tag);
+
+    /* The last entry with tag 'tag', or null. */
+    Elf_Dyn * dynEntry(Elf64_Sxword tag);
+
+    void compactDynStr();
+
+    std::string getSectionName(const Elf_Shdr & shdr);
+
+    /* The contents of a section in the file; an error if they don't
+       lie within it. */
+    unsigned char * sectionContents(const Elf_Shdr & shdr);
+
+    Elf_Shdr & findSection(const SectionName & sectionName);
+
+    Elf_Shdr * findSection2(const SectionName & sectionName);
+
+    unsigned int findSection3(const SectionName & sectionName);
+
+    std::string & replaceSection(const SectionName & sectionName,
+        unsigned int size);
+
+    /* Replace the contents of a section by 'data' as a whole. */
+    void replaceSection(const SectionName & sectionName, std::string && data);
+
+    bool haveReplacedSection(const SectionName & sectionName);
+
+    void addSection(const SectionName & sectionName, unsigned int type,
+        unsigned int flags, unsigned int link);
+
+    void writeSectionHeaders();
+
+    void eraseOldCopies(int flags = -1);
+
+    void dropOldCopies();
+
+    void writeReplacedSection(unsigned int sectionIndex,
+        const std::string & data, Elf_Off offset, Elf_Addr addr);
+
+    void writeReplacedSections(Elf_Off & curOff,
+        Elf_Addr startAddr, Elf_Off startOffset, int flags = -1);
+
+    typedef std::vector<std::pair<size_t, size_t>> FileRanges;
+
+    FileRanges liveRanges(size_t phtEnd);
+
+    bool trimDeadTail();
+
+    void reuseDeadSpace(size_t phtEnd);
+
+    void rewriteHeaders(Elf_Addr phdrAddress);
+
+    std::vector<unsigned int> newSectionIndices();
+
+    void rewriteSymbols(Elf_Sym * syms, size_t begin, size_t end,
+        const std::vector<unsigned int> & newIndices, const std::vector<char> & newAddrs);
+
+    void rewriteSectionsLibrary();
+
+    void rewriteSectionsExecutable();
+
+public:
+
+    void commitDynamic(bool compact);
+
+    void rewriteSections();
+
+    std::string getInterpreter();
+
+    typedef enum { printSoname, replaceSoname } sonameMode;
+
+    void modifySoname(sonameMode op, const std::string & newSoname);
+
+    void setInterpreter(const std::string & newInterpreter);
+
+    typedef enum { rpPrint, rpShrink, rpSet, rpRemove } RPathOp;
+
+    void modifyRPath(RPathOp op, const std::vector<std::string> & allowedRpathPrefixes, std::string newRPath);
+
+    void addNeeded(const std::set<std::string> & libs);
+
+    void removeNeeded(const std::set<std::string> & libs);
+
+    void replaceNeeded(const std::map<std::string, std::string> & libs);
+
+    void printNeededLibs();
+
+    void modifyFlags(Elf64_Xword setFlags, Elf64_Xword clearFlags,
+        Elf64_Xword setFlags1, Elf64_Xword clearFlags1);
+
+    void addGnuHash();
+
+private:
+
+    /* Convert an integer in big or little endian representation (as
+       specified by the ELF header) to this platform's integer
+       representation. */
+    template<class I>
+    I rdi(I i);
+
+    /* Convert back to the ELF representation. */
+    template<class I>
+    I wri(I & t, unsigned long long i)
+    {
+        t = rdi((I) i);
+        return i;
+    }
+};
+
+
+/* !!! G++ creates broken code if this function is inlined, don't know
+   why... */
+template<ElfFileParams>
+template<class I>
+I ElfFile<ElfFileParamNames>::rdi(I i)
+{
+    I r = 0;
+    if (littleEndian) {
+        for (unsigned int n = 0; n < sizeof(I); ++n) {
+            r |= ((I) *(((unsigned char *) &i) + n)) << (n * 8);
+        }
+    } else {
+        for (unsigned int n = 0; n < sizeof(I); ++n) {
+            r |= ((I) *(((unsigned char *) &i) + n)) << ((sizeof(I) - n - 1) * 8);
+        }
+    }
+    return r;
+}
+
+
+/* Ugly: used to erase DT_RUNPATH when using --force-rpath. */
+#define DT_IGNORE       0x00726e67
+
+
+void debugPrint(const char * format, ...)
+{
+    va_list ap;
+    va_start(ap, format);
+    vfprintf(stderr, format, ap);
+    va_end(ap);
+}
+
+
+thread_local Phase * Phase::current = 0;
+
+
+Phase::Phase(Stats * stats, const char * name, const std::string & fileName)
+    : stats(stats), name(name), parent(current)
+{
+    if (!stats) return;
+    this->fileName = fileName;
+    if (fileName.empty())
+        stats->addPhase(name, 0, 0); /* keep the phases in order */
+    current = this;
+    wallStart = clockMs(CLOCK_MONOTONIC);
+    cpuStart = clockMs(CLOCK_THREAD_CPUTIME_ID);
+}
+
+
+Phase::~Phase()
+{
+    if (!stats) return;
+    double wallMs = clockMs(CLOCK_MONOTONIC) - wallStart;
+    double cpuMs = clockMs(CLOCK_THREAD_CPUTIME_ID) - cpuStart;
+    if (fileName.empty())
+        stats->addPhase(name, wallMs - childWallMs, cpuMs - childCpuMs);
+    if (stats->trace)
+        stats->trace(fileName.empty() ? name : fileName,
+            fileName.empty() ? "phase" : "file", wallStart, wallMs);
+    if (parent) {
+        parent->childWallMs += wallMs;
+        parent->childCpuMs += cpuMs;
+    }
+    current = parent;
+}
+
+
+static void growFile(FileContents contents, size_t newSize)
+{
+    if (newSize > contents->capacity()) error("maximum file size exceeded");
+    if (newSize <= contents->size()) return;
+    contents->resize(newSize, 0);
+}
+
+
+FileContents readFd(int fd, const std::string & fileName, size_t cutOff)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+        throw SysError(fmt("getting info about '", fileName, "'"));
+
+    if ((uint64_t) st.st_size > (uint64_t) std::numeric_limits<size_t>::max())
+        throw SysError(fmt("cannot read file of size ", st.st_size, " into memory"));
+
+    size_t size = std::min(cutOff, (size_t) st.st_size);
+
+    FileContents contents = std::make_shared<std::vector<unsigned char>>();
+    contents->reserve(size + 32 * 1024 * 1024);
+    contents->resize(size, 0);
+
+    size_t bytesRead = 0;
+    ssize_t portion;
+    while ((portion = pread(fd, contents->data() + bytesRead, size - bytesRead, bytesRead)) > 0)
+        bytesRead += portion;
+
+    if (bytesRead != size)
+        throw SysError(fmt("reading '", fileName, "'"));
+
+    return contents;
+}
+
+
+FileContents readFile(const std::string & fileName, size_t cutOff)
+{
+    int fd = open(fileName.c_str(), O_RDONLY);
+    if (fd == -1) throw SysError(fmt("opening '", fileName, "'"));
+
+    FileContents contents;
+    try {
+        contents = readFd(fd, fileName, cutOff);
+    } catch (...) {
+        close(fd);
+        throw;
+    }
+
+    close(fd);
+
+    return contents;
+}
+
+
+/* Read all of standard input, for use as a filter in a pipeline.  The
+   section headers are usually at the end of the file, so nothing can
+   be done before everything has been read. */
+FileContents readStdin()
+{
+    FileContents contents = std::make_shared<std::vector<unsigned char>>();
+
+    struct stat st;
+    if (fstat(0, &st) == 0 && S_ISREG(st.st_mode))
+        contents->resize(st.st_size + 1);
+
+    size_t bytesRead = 0;
+    while (true) {
+        if (bytesRead == contents->size())
+            contents->resize(std::max(2 * contents->size(), (size_t) 1 << 20));
+        ssize_t portion = read(0, contents->data() + bytesRead, contents->size() - bytesRead);
+        if (portion == 0) break;
+        if (portion == -1) {
+            if (errno == EINTR) continue;
+            throw SysError("reading standard input");
+        }
+        bytesRead += portion;
+    }
+
+    contents->resize(bytesRead);
+    contents->reserve(bytesRead + 32 * 1024 * 1024);
+
+    return contents;
+}
+
+
+struct ElfType
+{
+    bool is32Bit;
+    int machine; // one of EM_*
+};
+
+
+ElfType getElfType(const FileContents & fileContents)
+{
+    /* Check the ELF header for basic validity. */
+    if (fileContents->size() < (off_t) sizeof(Elf32_Ehdr)) error("missing ELF header");
+
+    auto contents = fileContents->data();
+
+    if (memcmp(contents, ELFMAG, SELFMAG) != 0)
+        error("not an ELF executable");
+
+    if (contents[EI_VERSION] != EV_CURRENT)
+        error("unsupported ELF version");
+
+    if (contents[EI_CLASS] != ELFCLASS32 && contents[EI_CLASS] != ELFCLASS64)
+        error("ELF executable is not 32 or 64 bit");
+
+    bool is32Bit = contents[EI_CLASS] == ELFCLASS32;
+
+    // FIXME: endianness
+    return ElfType{is32Bit, is32Bit ? ((Elf32_Ehdr *) contents)->e_machine : ((Elf64_Ehdr *) contents)->e_machine};
+}
+
+
+/* Call 'f(begin, end)' for chunks of [0, count), on up to 'threads'
+   threads (0 for one per CPU), if there is enough work to make that
+   worthwhile. */
+template<typename F>
+static void forEachChunk(size_t count, unsigned int threads, F f)
+{
+    const size_t minChunk = 1 << 18;
+    if (!threads) threads = std::max(1u, std::thread::hardware_concurrency());
+    size_t chunks = std::min((size_t) threads, count / minChunk);
+    if (chunks <= 1) {
+        f(0, count);
+        return;
+    }
+
+    size_t chunkSize = (count + chunks - 1) / chunks;
+    std::vector<std::thread> workers;
+    size_t c = 1;
+    try {
+        for ( ; c < chunks; ++c)
+            workers.emplace_back(f, c * chunkSize, std::min(count, (c + 1) * chunkSize));
+    } catch (std::system_error &) {
+        /* Do the chunks we couldn't start a thread for ourselves. */
+    }
+    for ( ; c < chunks; ++c)
+        f(c * chunkSize, std::min(count, (c + 1) * chunkSize));
+    f(0, chunkSize);
+    for (auto & worker : workers) worker.join();
+}
+
+
+/* Check that the 'size' bytes at 'p' are within the file: a truncated
+   or corrupt file can point anywhere. */
+static void checkPointer(const FileContents & contents, const void * p, size_t size)
+{
+    uintptr_t start = (uintptr_t) contents->data(), q = (uintptr_t) p;
+    if (q < start || q - start > contents->size() || size > contents->size() - (q - start))
+        error("data region extends past file end");
+}
+
+
+template<ElfFileParams>
+ElfFile<ElfFileParamNames>::ElfFile(FileContents fileContents, const Operations & ops, Stats * stats)
+    : fileContents(fileContents)
+    , contents(fileContents->data())
+    , pageSize(ops.pageSize ? ops.pageSize : PAGESIZE)
+    , segmentAlign(ops.segmentAlign)
+    , gc(ops.gc)
+    , threads(ops.threads)
+    , forceRPath(ops.forceRPath)
+    , logLevel(ops.logLevel)
+    , stats(stats)
+{
+    Phase phase(stats, "parse");
+
+    debug("Kernel page size is %u bytes\n", getPageSize());
+
+    /* Check the ELF header for basic validity. */
+    if (fileContents->size() < (off_t) sizeof(Elf_Ehdr)) error("missing ELF header");
+
+    hdr = (Elf_Ehdr *) fileContents->data();
+
+    if (memcmp(hdr->e_ident, ELFMAG, SELFMAG) != 0)
+        error("not an ELF executable");
+
+    littleEndian = hdr->e_ident[EI_DATA] == ELFDATA2LSB;
+
+    if (rdi(hdr->e_type) != ET_EXEC && rdi(hdr->e_type) != ET_DYN)
+        error("wrong ELF type");
+
+    if (rdi(hdr->e_phentsize) != sizeof(Elf_Phdr))
+        error("program headers have wrong size");
+
+    if (rdi(hdr->e_shentsize) != sizeof(Elf_Shdr))
+        error("section headers have wrong size");
+
+    size_t fileSize = fileContents->size();
+
+    if (rdi(hdr->e_phoff) > fileSize ||
+        (size_t) rdi(hdr->e_phnum) * sizeof(Elf_Phdr) > fileSize - rdi(hdr->e_phoff))
+        error("program header table out of bounds");
+
+    if (rdi(hdr->e_shnum) == 0)
+        error("no section headers. The input file is probably a statically linked, self-decompressing binary");
+
+    if (rdi(hdr->e_shoff) > fileSize ||
+        (size_t) rdi(hdr->e_shnum) * sizeof(Elf_Shdr) > fileSize - rdi(hdr->e_shoff))
+        error("section header table out of bounds");
+
+    /* Copy the program and section headers. */
+    for (int i = 0; i < rdi(hdr->e_phnum); ++i) {
+        phdrs.push_back(* ((Elf_Phdr *) (contents + rdi(hdr->e_phoff)) + i));
+        if (rdi(phdrs[i].p_type) == PT_INTERP) isExecutable = true;
+        if (rdi(phdrs[i].p_offset) > fileSize ||
+            rdi(phdrs[i].p_filesz) > fileSize - rdi(phdrs[i].p_offset))
+            error("segment data extends past file end");
+    }
+
+    for (int i = 0; i < rdi(hdr->e_shnum); ++i) {
+        shdrs.push_back(* ((Elf_Shdr *) (contents + rdi(hdr->e_shoff)) + i));
+        /* sortShdrs() and friends follow these without looking. */
+        if (rdi(shdrs[i].sh_link) >= rdi(hdr->e_shnum) ||
+            ((rdi(shdrs[i].sh_type) == SHT_REL || rdi(shdrs[i].sh_type) == SHT_RELA) &&
+             rdi(shdrs[i].sh_info) >= rdi(hdr->e_shnum)))
+            error("section link out of bounds");
+    }
+
+    /* Get the section header string table section (".shstrtab").  Its
+       index in the section header table is given by e_shstrndx field
+       of the ELF header. */
+    unsigned int shstrtabIndex = rdi(hdr->e_shstrndx);
+    if (shstrtabIndex >= shdrs.size())
+        error("string table index out of bounds");
+    size_t shstrtabSize = rdi(shdrs[shstrtabIndex].sh_size);
+    char * shstrtab = (char *) sectionContents(shdrs[shstrtabIndex]);
+
+    if (shstrtabSize == 0)
+        error("string table size is zero");
+    if (shstrtab[shstrtabSize - 1] != 0)
+        error("string table is not zero terminated");
+
+    sectionNames = std::string(shstrtab, shstrtabSize);
+
+    sectionsByOldIndex.resize(rdi(hdr->e_shnum));
+    sectionAddrsByOldIndex.resize(rdi(hdr->e_shnum));
+    for (unsigned int i = 1; i < rdi(hdr->e_shnum); ++i) {
+        sectionsByOldIndex[i] = getSectionName(shdrs[i]);
+        sectionAddrsByOldIndex[i] = rdi(shdrs[i].sh_addr);
+    }
+}
+
+
+template<ElfFileParams>
+void ElfFile<ElfFileParamNames>::sortPhdrs()
+{
+    /* Sort the segments by offset. */
+    CompPhdr comp;
+    comp.elfFile = this;
+    sort(phdrs.begin(), phdrs.end(), comp);
+}
+
+
+template<ElfFileParams>
+void ElfFile<ElfFileParamNames>::sortShdrs()
+{
+    /* Translate sh_link mappings to section names, since sorting the
+       sections will invalidate the sh_link fields. */
+    std::map<SectionName, SectionName> linkage;
+    for (unsigned int i = 1; i < rdi(hdr->e_shnum); ++i)
+        if (rdi(shdrs[i].sh_link) != 0)
+            linkage[getSectionName(shdrs[i])] = getSectionName(shdrs[rdi(shdrs[i].sh_link)]);
+
+    /* Idem for sh_info on certain sections. */
+    std::map<SectionName, SectionName> info;
+    for (unsigned int i = 1; i < rdi(hdr->e_shnum); ++i)
+        if (rdi(shdrs[i].sh_info) != 0 &&
+            (rdi(shdrs[i].sh_type) == SHT_REL || rdi(shdrs[i].sh_type) == SHT_RELA))
+            info[getSectionName(shdrs[i])] = getSectionName(shdrs[rdi(shdrs[i].sh_info)]);
+
+    /* Idem for the index of the .shstrtab section in the ELF header. */
+    SectionName shstrtabName = getSectionName(shdrs[rdi(hdr->e_shstrndx)]);
+
+    /* And for the replaced sections. */
+    std::map<SectionName, std::string> replaced;
+    for (auto & i : replacedSections)
+        replaced[getSectionName(shdrs[i.first])] = std::move(i.second);
+    replacedSections.clear();
+
+    /* Sort the sections by offset.  Keep sections at the same offset
+       (e.g. empty ones) in order, so that the indices don't change
+       needlessly. */
+    CompShdr comp;
+    comp.elfFile = this;
+    stable_sort(shdrs.begin(), shdrs.end(), comp);
+
+    /* Restore the sh_link mappings. */
+    for (unsigned int i = 1; i < rdi(hdr->e_shnum); ++i)
+        if (rdi(shdrs[i].sh_link) != 0)
+            wri(shdrs[i].sh_link,
+                findSection3(linkage[getSectionName(shdrs[i])]));
+
+    /* And the st_info mappings. */
+    for (unsigned int i = 1; i < rdi(hdr->e_shnum); ++i)
+        if (rdi(shdrs[i].sh_info) != 0 &&
+            (rdi(shdrs[i].sh_type) == SHT_REL || rdi(shdrs[i].sh_type) == SHT_RELA))
+            wri(shdrs[i].sh_info,
+                findSection3(info[getSectionName(shdrs[i])]));
+
+    /* And the .shstrtab index. */
+    wri(hdr->e_shstrndx, findSection3(shstrtabName));
+
+    for (auto & i : replaced)
+        replacedSections[findSection3(i.first)] = std::move(i.second);
+}
+
+
+static void writeContents(int fd, FileContents contents, Stats * stats)
+{
+    size_t bytesWritten = 0;
+    ssize_t portion;
+    while ((portion = write(fd, contents->data() + bytesWritten, contents->size() - bytesWritten)) > 0)
+        bytesWritten += portion;
+
+    if (bytesWritten != contents->size())
+        error("write");
+
+    if (stats) stats->bytesWritten += bytesWritten;
+}
+
+
+void writeFile(const std::string & fileName, FileContents contents, Stats * stats)
+{
+    Phase phase(stats, "write");
+
+    int fd = open(fileName.c_str(), O_TRUNC | O_WRONLY);
+    if (fd == -1)
+        error("open");
+
+    writeContents(fd, contents, stats);
+
+    if (close(fd) != 0)
+        error("close");
+}
+
+
+void writeStdout(FileContents contents, Stats * stats)
+{
+    Phase phase(stats, "write");
+    writeContents(1, contents, stats);
+}
+
+
+/* Copy a range of the input file to the output file without going
+   through user space, if the system supports it.  Returns the number
+   of bytes copied, which may be less than requested. */
+static size_t copyRange(int inFd, off_t inOffset, int outFd, off_t outOffset, size_t size)
+{
+    size_t copied = 0;
+#ifdef HAVE_COPY_FILE_RANGE
+    static std::atomic<bool> unsupported{false};
+    while (!unsupported && copied < size) {
+        loff_t in = inOffset + copied, out = outOffset + copied;
+        ssize_t n = copy_file_range(inFd, &in, outFd, &out, size - copied, 0);
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP))
+            unsupported = true;
+        if (n <= 0) break;
+        copied += n;
+    }
+#endif
+    return copied;
+}
+
+
+static void pwriteAll(int fd, const unsigned char * data, size_t size, off_t offset)
+{
+    while (size > 0) {
+        ssize_t n = pwrite(fd, data, size, offset);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) error("write");
+        data += n;
+        size -= n;
+        offset += n;
+    }
+}
+
+
+void writeFd(int fd, FileContents contents, Stats * stats)
+{
+    Phase phase(stats, "write");
+
+    pwriteAll(fd, contents->data(), contents->size(), 0);
+    if (ftruncate(fd, contents->size()) != 0)
+        error("truncating");
+
+    if (stats) stats->bytesWritten += contents->size();
+}
+
+
+/* Write the result to a file other than the input.  Runs of blocks
+   that are unchanged from the input, either at the same offset or
+   moved by 'shift' bytes (see shiftFile()), are copied from the input
+   file with copy_file_range(), which file systems can do without
+   copying the data (e.g. with reflinks).  Only the rest is written. */
+void writeOutputFile(const std::string & fileName, FileContents contents,
+    const std::string & inputFileName, size_t shift, Stats * stats)
+{
+    Phase phase(stats, "write");
+
+    int inFd = -1;
+    const unsigned char * in = 0;
+    size_t inSize = 0;
+    mode_t mode = 0666;
+
+    if (!inputFileName.empty()) {
+        inFd = open(inputFileName.c_str(), O_RDONLY);
+        struct stat st, st2;
+        if (inFd == -1 || fstat(inFd, &st) != 0)
+            throw SysError(fmt("opening '", inputFileName, "'"));
+        mode = st.st_mode & 07777;
+        inSize = st.st_size;
+
+        /* The output is the input: nothing can be copied. */
+        if (stat(fileName.c_str(), &st2) == 0 && st.st_dev == st2.st_dev && st.st_ino == st2.st_ino) {
+            close(inFd);
+            inFd = -1;
+            inSize = 0;
+        }
+
+        if (inSize) {
+            void * p = mmap(0, inSize, PROT_READ, MAP_PRIVATE, inFd, 0);
+            if (p != MAP_FAILED) in = (const unsigned char *) p;
+        }
+    }
+
+    int fd = open(fileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, mode);
+    if (fd == -1) throw SysError(fmt("opening '", fileName, "'"));
+
+    const size_t blockSize = 64 * 1024;
+    const unsigned char * data = contents->data();
+    size_t size = contents->size();
+
+    /* The pending run of unchanged blocks. */
+    off_t runStart = 0, runFrom = -1;
+    size_t runSize = 0;
+
+    auto flushRun = [&]() {
+        if (!runSize) return;
+        size_t copied = copyRange(inFd, runFrom, fd, runStart, runSize);
+        if (stats) stats->bytesCopied += copied;
+        pwriteAll(fd, data + runStart + copied, runSize - copied, runStart + copied);
+        runSize = 0;
+    };
+
+    for (size_t offset = 0; offset < size; offset += blockSize) {
+        size_t len = std::min(blockSize, size - offset);
+        off_t from = -1;
+        if (in) {
+            if (offset + len <= inSize && memcmp(data + offset, in + offset, len) == 0)
+                from = offset;
+            else if (shift && offset >= shift && offset - shift + len <= inSize &&
+                memcmp(data + offset, in + offset - shift, len) == 0)
+                from = offset - shift;
+        }
+
+        if (from != -1 && runSize && runFrom + (off_t) runSize == from && runStart + (off_t) runSize == (off_t) offset) {
+            runSize += len;
+            continue;
+        }
+
+        flushRun();
+
+        if (from != -1) {
+            runStart = offset;
+            runFrom = from;
+            runSize = len;
+        } else
+            pwriteAll(fd, data + offset, len, offset);
+    }
+
+    flushRun();
+
+    if (in) munmap((void *) in, inSize);
+    if (inFd != -1) close(inFd);
+
+    if (close(fd) != 0)
+        error("close");
+
+    if (stats) stats->bytesWritten += size;
+}
+
+
+template<ElfFileParams>
+void ElfFile<ElfFileParamNames>::shiftFile(unsigned int extraPages, Elf_Addr startPage,
+    unsigned int flags)
+{
+    /* Move the entire contents of the file 'extraPages' pages
+       further. */
+    unsigned int oldSize = fileContents->size();
+    unsigned int shift = extraPages * getPageSize();
+    growFile(fileContents, fileContents->size() + extraPages * getPageSize());
+    memmove(contents + extraPages * getPageSize(), contents, oldSize);
+    fileShift += shift;
+    memset(contents + sizeof(Elf_Ehdr), 0, shift - sizeof(Elf_Ehdr));
+
+    /* Adjust the ELF header. */
+    wri(hdr->e_phoff, sizeof(Elf_Ehdr));
+    wri(hdr->e_shoff, rdi(hdr->e_shoff) + shift);
+
+    /* Update the offsets in the section headers. */
+    for (int i = 1; i < rdi(hdr->e_shnum); ++i)
+        wri(shdrs[i].sh_offset, rdi(shdrs[i].sh_offset) + shift);
+
+    /* Update the offsets in the program headers. */
+    for (int i = 0; i < rdi(hdr->e_phnum); ++i) {
+        wri(phdrs[i].p_offset, rdi(phdrs[i].p_offset) + shift);
+        if (rdi(phdrs[i].p_align) != 0 &&
+            (rdi(phdrs[i].p_vaddr) - rdi(phdrs[i].p_offset)) % rdi(phdrs[i].p_align) != 0) {
+            debug("changing alignment of program header %d from %d to %d\n", i,
+                rdi(phdrs[i].p_align), getPageSize());
+            wri(phdrs[i].p_align, getPageSize());
+        }
+    }
+
+    /* If the segment that used to start at the beginning of the file
+       is directly adjacent to the new pages, both in the file and in
+       memory, just grow it downwards instead of adding a segment. */
+    for (int i = 0; i < rdi(hdr->e_phnum); ++i) {
+        Elf_Phdr & phdr = phdrs[i];
+        if (rdi(phdr.p_type) != PT_LOAD || rdi(phdr.p_offset) != shift ||
+            rdi(phdr.p_vaddr) != startPage + shift ||
+            !compatibleFlags(rdi(phdr.p_flags), flags))
+            continue;
+        debug("extending segment %d to cover the first %d bytes\n", i, shift);
+        wri(phdr.p_offset, 0);
+        wri(phdr.p_vaddr, wri(phdr.p_paddr, startPage));
+        wri(phdr.p_filesz, rdi(phdr.p_filesz) + shift);
+        wri(phdr.p_memsz, rdi(phdr.p_memsz) + shift);
+        if (rdi(phdr.p_align) != 0 && startPage % rdi(phdr.p_align) != 0)
+            wri(phdr.p_align, getPageSize());
+        return;
+    }
+
+    /* Add a segment that maps the new program/section headers and
+       PT_INTERP segment into memory.  Otherwise glibc will choke. */
+    phdrs.resize(rdi(hdr->e_phnum) + 1);
+    wri(hdr->e_phnum, rdi(hdr->e_phnum) + 1);
+    Elf_Phdr & phdr = phdrs[rdi(hdr->e_phnum) - 1];
+    wri(phdr.p_type, PT_LOAD);
+    wri(phdr.p_offset, 0);
+    wri(phdr.p_vaddr, wri(phdr.p_paddr, startPage));
+    wri(phdr.p_filesz, wri(phdr.p_memsz, shift));
+    wri(phdr.p_flags, flags);
+    wri(phdr.p_align, getSegmentAlignment());
+}
+
+
+template<ElfFileParams>
+std::string ElfFile<ElfFileParamNames>::getSectionName(const Elf_Shdr & shdr)
+{
+    if (rdi(shdr.sh_name) >= sectionNames.size())
+        error("section name offset out of bounds");
+    return std::string(sectionNames.c_str() + rdi(shdr.sh_name));
+}
+
+
+template<ElfFileParams>
+unsigned char * ElfFile<ElfFileParamNames>::sectionContents(const Elf_Shdr & shdr)
+{
+    if (rdi(shdr.sh_offset) > fileContents->size())
+        error("section data extends past file end");
+    unsigned char * p = contents + rdi(shdr.sh_offset);
+    checkPointer(fileContents, p, rdi(shdr.sh_size));
+    return p;
+}
+
+
+template<ElfFileParams>
+Elf_Shdr & ElfFile<ElfFileParamNames>::findSection(const SectionName & sectionName)
+{
+    Elf_Shdr * shdr = findSection2(sectionName);
+    if (!shdr) {
+        std::string extraMsg = "";
+        if (sectionName == ".interp" || sectionName == ".dynamic" || sectionName == ".dynstr")
+            extraMsg = ". The input file is most likely statically linked";
+        error("cannot find section '" + sectionName + "'" + extraMsg);
+    }
+    return *shdr;
+}
+
+
+template<ElfFileParams>
+Elf_Shdr * ElfFile<ElfFileParamNames>::findSection2(const SectionName & sectionName)
+{
+    unsigned int i = findSection3(sectionName);
+    return i ? &shdrs[i] : 0;
+}
+
+
+template<ElfFileParams>
+unsigned int ElfFile<ElfFileParamNames>::findSection3(const SectionName & sectionName)
+{
+    for (unsigned int i = 1; i < rdi(hdr->e_shnum); ++i)
+        if (getSectionName(shdrs[i]) == sectionName) return i;
+    verbose("section '%s' not found\n", sectionName.c_str());
+    return 0;
+}
+
+template<ElfFileParams>
+bool ElfFile<ElfFileParamNames>::haveReplacedSection(const SectionName & sectionName)
+{
+    unsigned int i = findSection3(sectionName);
+    return i && replacedSections.count(i);
+}
+
+template<ElfFileParams>
+void ElfFile<ElfFileParamNames>::addSection(const SectionName & sectionName,
+    unsigned int type, unsigned int flags, unsigned int link)
+{
+    /* Add an empty section header; the caller should give it its
+       contents through replaceSection(), so that it is placed
+       wherever the replaced sections go.  This is only supported for
+       ET_DYN files, since rewriteSectionsExecutable() places sections
+       according to their current file offset. */
+    if (rdi(hdr->e_type) != ET_DYN)
+        error("adding section '" + sectionName + "' is only supported for dynamic libraries");
+
+    Elf_Shdr shdr;
+    memset(&shdr, 0, sizeof(shdr));
+    wri(shdr.sh_name, sectionNames.size());
+    wri(shdr.sh_type, type);
+    wri(shdr.sh_flags, flags);
+    wri(shdr.sh_link, link);
+    wri(shdr.sh_addralign, sectionAlignment);
+    sectionNames += sectionName + '\0';
+
+    shdrs.push_back(shdr);
+    wri(hdr->e_shnum, shdrs.size());
+    sectionsAdded = true;
+}
+
+
+template<ElfFileParams>
+void ElfFile<ElfFileParamNames>::writeSectionHeaders()
+{
+    /* If sections were added, the section header table and .shstrtab
+       have outgrown their original location, so put them at the end
+       of the file (outside of any segment). */
+    if (!sectionsAdded) return;
+
+    Elf_Shdr & shdrShstrtab = shdrs[rdi(hdr->e_shstrndx)];
+    size_t shstrtabOffset = fileContents->size();
+    growFile(fileContents, shstrtabOffset + sectionNames.size());
+    memcpy(contents + shstrtabOffset, sectionNames.c_str(), sectionNames.size());
+    wri(shdrShstrtab.sh_offset, shstrtabOffset);
+    wri(shdrShstrtab.sh_size, sectionNames.size());
+
+    size_t shoff = roundUp(fileContents->size(), sectionAlignment);
+    growFile(fileContents, shoff + shdrs.size() * sizeof(Elf_Shdr));
+    wri(hdr->e_shoff, shoff);
+
+    debug("moved section header table to offset 0x%x\n", shoff);
+
+    sectionsAdded = false;
+}
+
+
+template<ElfFileParams>
+std::string & ElfFile<ElfFileParamNames>::replaceSection(const SectionName & sectionName,
+    unsigned int size)
+{
+    /* Start from the current contents: those of an earlier
+       replacement, or else those in the file. */
+    unsigned int index = findSection3(sectionName);
+    if (!index) findSection(sectionName); /* throws */
+
+    auto i = replacedSections.find(index);
+    if (i == replacedSections.end()) {
+        Elf_Shdr & shdr = shdrs[index];
+        char * data = (char *) sectionContents(shdr);
+        std::string & s = replacedSections[index];
+        s.reserve(std::max((size_t) size, (size_t) rdi(shdr.sh_size)));
+        s.assign(data, rdi(shdr.sh_size));
+        s.resize(size);
+        return s;
+    }
+
+    i->second.resize(size);
+    return i->second;
+}
+
+
+template<ElfFileParams>
+void ElfFile<ElfFileParamNames>::replaceSection(const SectionName & sectionName,
+    std::string && data)
+{
+    unsigned int index = findSection3(sectionName);
+    if (!index) findSection(sectionName); /* throws */
+    replacedSections[index] = std::move(data);
+}
+
+
+template<ElfFileParams>
+void ElfFile<ElfFileParamNames>::eraseOldCopies(int flags)
+{
+    /* Fill the old contents of the replaced sections (or those needing
+       the segment permissions 'flags') with 'X's, which marks them as
+       dead for --gc. */
+    for (auto & i : replacedSections) {
+        if (flags != -1 && segmentFlags(i.first) != (unsigned int) flags) continue;
+        Elf_Shdr & shdr = shdrs[i.first];
+        /* Old copies forgotten by dropOldCopies() may lie past the
+           end of the file now. */
+        if (rdi(shdr.sh_type) == SHT_NOBITS || rdi(shdr.sh_size) == 0) continue;
+        memset(sectionContents(shdr), 'X', rdi(shdr.sh_size));
+    }
+}
+
+
+template<ElfFileParams>
+void ElfFile<ElfFileParamNames>::dropOldCopies()
+{
+    /* For --gc: erase the old copies now and forget where they were,
+       since their space may be cut off or reused before the sections
+       are written, and mustn't be erased again then. */
+    eraseOldCopies();
+    for (auto & i : replacedSections)
+        wri(shdrs[i.first].sh_size, 0);
+}
+
+
+template<ElfFileParams>
+void ElfFile<ElfFileParamNames>::writeReplacedSection(unsigned int sectionIndex,
+    const std::string & data, Elf_Off offset, Elf_Addr addr)
+{
+    Elf_Shdr & shdr = shdrs[sectionIndex];
+    SectionName sectionName = getSectionName(shdr);
+    debug("rewriting section '%s' from offset 0x%x (size %d) to offset 0x%x (size %d)\n",
+        sectionName.c_str(), rdi(shdr.sh_offset), rdi(shdr.sh_size), offset, data.size());
+
+    memcpy(contents + offset, (unsigned char *) data.c_str(), data.size());
+
+    /* Update the section header for this section. */
+    wri(shdr.sh_offset, offset);
+    wri(shdr.sh_addr, addr);
+    wri(shdr.sh_size, data.size());
+    wri(shdr.sh_addralign, sectionAlignment);
+
+    /* If this is the .interp section, then the PT_INTERP segment
+       must be sync'ed with it. */
+    if (sectionName == ".interp") {
+        for (unsigned int j = 0; j < phdrs.size(); ++j)
+            if (rdi(phdrs[j].p_type) == PT_INTERP) {
+                phdrs[j].p_offset = shdr.sh_offset;
+                phdrs[j].p_vaddr = phdrs[j].p_paddr = shdr.sh_addr;
+                phdrs[j].p_filesz = phdrs[j].p_memsz = shdr.sh_size;
+            }
+    }
+
+    /* If this is the .dynamic section, then the PT_DYNAMIC segment
+       must be sync'ed with it. */
+    if (sectionName == ".dynamic") {
+        for (unsigned int j = 0; j < phdrs.size(); ++j)
+            if (rdi(phdrs[j].p_type) == PT_DYNAMIC) {
+                phdrs[j].p_offset = shdr.sh_offset;
+                phdrs[j].p_vaddr = phdrs[j].p_paddr = shdr.sh_addr;
+                phdrs[j].p_filesz = phdrs[j].p_memsz = shdr.sh_size;
+            }
+    }
+}
+
+
+template<ElfFileParams>
+void ElfFile<ElfFileParamNames>::writeReplacedSections(Elf_Off & curOff,
+    Elf_Addr startAddr, Elf_Off startOffset, int flags)
+{
+    /* Overwrite the old section contents with 'X's.  Do this
+       *before* writing the new section contents (below) to prevent
+       clobbering previously written new section contents.  If
+       'flags' is given, only the sections needing exactly those
+       segment permissions are written; the caller must then make
+       sure the remaining ones can't clobber them. */
+    eraseOldCopies(flags);
+
+    for (auto & i : replacedSections) {
+        if (flags != -1 && segmentFlags(i.first) != (unsigned int) flags) continue;
+        writeReplacedSection(i.first, i.second, curOff, startAddr + (curOff - startOffset));
+        curOff += roundUp(i.second.size(), sectionAlignment);
+    }
+
+    for (auto i = replacedSections.begin(); i != replacedSections.end(); )
+        if (flags == -1 || segmentFlags(i->first) == (unsigned int) flags)
+            i = replacedSections.erase(i);
+        else
+            ++i;
+}
+
+
+template<ElfFileParams>
+typename ElfFile<ElfFileParamNames>::FileRanges ElfFile<ElfFileParamNames>::liveRanges(size_t phtEnd)
+{
+    /* The parts of the file that are still referred to, sorted and
+       merged: the ELF header and the program header table (up to
+       'phtEnd', leaving room for the segments about to be added), the
+       section header table, the sections that are not being replaced,
+       and the segments other than those that only cover sections. */
+    FileRanges ranges;
+    ranges.emplace_back(0, std::max(phtEnd, sizeof(Elf_Ehdr)));
+    ranges.emplace_back(rdi(hdr->e_shoff), rdi(hdr->e_shoff) + shdrs.size() * sizeof(Elf_Shdr));
+
+    for (unsigned int i = 1; i < shdrs.size(); ++i)
+        if (rdi(shdrs[i].sh_type) != SHT_NOBITS && !replacedSections.count(i))
+            ranges.emplace_back(rdi(shdrs[i].sh_offset), rdi(shdrs[i].sh_offset) + rdi(shdrs[i].sh_size));
+
+    for (auto & phdr : phdrs) {
+        unsigned int type = rdi(phdr.p_type);
+        if (type == PT_LOAD || type == PT_PHDR || type == PT_INTERP ||
+            type == PT_DYNAMIC || type == PT_GNU_RELRO) continue;
+        ranges.emplace_back(rdi(phdr.p_offset), rdi(phdr.p_offset) + rdi(phdr.p_filesz));
+    }
+
+    sort(ranges.begin(), ranges.end());
+
+    FileRanges merged;
+    for (auto & r : ranges) {
+        if (r.first == r.second) continue;
+        if (!merged.empty() && r.first <= merged.back().second)
+            merged.back().second = std::max(merged.back().second, r.second);
+        else
+            merged.push_back(r);
+    }
+    return merged;
+}
+
+
+template<ElfFileParams>
+bool ElfFile<ElfFileParamNames>::trimDeadTail()
+{
+    /* For --gc: cut off the end of the file if nothing refers to it
+       any more and it only holds old copies of sections ('X's) and
+       padding, as left by earlier runs that appended the replaced
+       sections, and shrink or remove the segments that mapped it.
+       The sections replaced now then take its place. */
+    dropOldCopies();
+
+    size_t liveEnd = 0;
+    FileRanges live = liveRanges(rdi(hdr->e_phoff) + phdrs.size() * sizeof(Elf_Phdr));
+    if (!live.empty()) liveEnd = live.back().second;
+
+    /* Keep segments with a .bss; the zeroes before it may be data. */
+    for (auto & phdr : phdrs)
+        if (rdi(phdr.p_type) == PT_LOAD && rdi(phdr.p_filesz) != rdi(phdr.p_memsz))
+            liveEnd = std::max(liveEnd, (size_t) (rdi(phdr.p_offset) + rdi(phdr.p_filesz)));
+
+    size_t end = fileContents->size();
+    while (end > liveEnd && (contents[end - 1] == 'X' || contents[end - 1] == 0)) --end;
+    end = std::min((size_t) roundUp(end, sectionAlignment), fileContents->size());
+    if (end == fileContents->size()) return false;
+
+    debug("dropping %d dead bytes at the end of the file\n", fileContents->size() - end);
+
+    for (unsigned int i = phdrs.size(); i-- > 0; ) {
+        Elf_Phdr & phdr = phdrs[i];
+        if (rdi(phdr.p_type) != PT_LOAD || rdi(phdr.p_offset) + rdi(phdr.p_filesz) <= end) continue;
+        if (rdi(phdr.p_offset) >= end) {
+            debug("removing segment %d, which only mapped dead space\n", i);
+            phdrs.erase(phdrs.begin() + i);
+        } else
+            wri(phdr.p_filesz, wri(phdr.p_memsz, end - rdi(phdr.p_offset)));
+    }
+
+    if (phdrs.size() != rdi(hdr->e_phnum)) {
+        memset(contents + rdi(hdr->e_phoff) + phdrs.size() * sizeof(Elf_Phdr), 0,
+            (rdi(hdr->e_phnum) - phdrs.size()) * sizeof(Elf_Phdr));
+        wri(hdr->e_phnum, phdrs.size());
+    }
+
+    fileContents->resize(end);
+    changed = true;
+    return true;
+}
+
+
+template<ElfFileParams>
+void ElfFile<ElfFileParamNames>::reuseDeadSpace(size_t phtEnd)
+{
+    /* For --gc: put the replaced sections into holes inside the
+       existing segments where they fit, rather than at the end of the
+       file.  A hole is a run of old copies of sections ('X's) and
+       padding that nothing refers to any more, in a segment whose
+       permissions suit the section.  The largest sections go first,
+       each into the smallest hole that fits it. */
+    dropOldCopies();
+
+    struct Hole
+    {
+        size_t start, end;
+        unsigned int segment;
+    };
+    std::vector<Hole> holes;
+
+    auto addHoles = [&](size_t from, size_t to, unsigned int segment) {
+        while (from < to) {
+            size_t start = from;
+            bool dead = false;
+            for ( ; from < to && (contents[from] == 'X' || contents[from] == 0); ++from)
+                if (contents[from] == 'X') dead = true;
+            start = roundUp(start, sectionAlignment);
+            if (dead && start < from) holes.push_back({start, from, segment});
+            while (from < to && contents[from] != 'X' && contents[from] != 0) ++from;
+        }
+    };
+
+    FileRanges live = liveRanges(phtEnd);
+    for (unsigned int i = 0; i < phdrs.size(); ++i) {
+        if (rdi(phdrs[i].p_type) != PT_LOAD) continue;
+        size_t pos = rdi(phdrs[i].p_offset);
+        size_t end = std::min((size_t) (pos + rdi(phdrs[i].p_filesz)), fileContents->size());
+        for (auto & r : live) {
+            if (r.second <= pos) continue;
+            if (r.first >= end) break;
+            if (r.first > pos) addHoles(pos, r.first, i);
+            pos = r.second;
+        }
+        if (pos < end) addHoles(pos, end, i);
+    }
+
+    if (holes.empty()) return;
+
+    std::vector<unsigned int> indices;
+    for (auto & i : replacedSections) indices.push_back(i.first);
+    std::stable_sort(indices.begin(), indices.end(), [&](unsigned int x, unsigned int y) {
+        return replacedSections[x].size() > replacedSections[y].size();
+    });
+
+    for (auto index : indices) {
+        const std::string & data = replacedSections[index];
+        unsigned int flags = segmentFlags(index);
+        Hole * best = 0;
+        for (auto & hole : holes)
+            if (hole.end - hole.start >= data.size() &&
+                compatibleFlags(rdi(phdrs[hole.segment].p_flags), flags) &&
+                (!best || hole.end - hole.start < best->end - best->start))
+                best = &hole;
+        if (!best) continue;
+
+        Elf_Phdr & phdr = phdrs[best->segment];
+        debug("reusing dead space at offset 0x%x in segment %d\n", best->start, best->segment);
+        writeReplacedSection(index, data, best->start, rdi(phdr.p_vaddr) + (best->start - rdi(phdr.p_offset)));
+        best->start = std::min((size_t) roundUp(best->start + data.size(), sectionAlignment), best->end);
+        replacedSections.erase(index);
+    }
+}
+
+
+template<ElfFileParams>
+bool ElfFile<ElfFileParamNames>::compatibleFlags(unsigned int segFlags, unsigned int flags)
+{
+    /* A segment can hold sections needing 'flags' if it grants at
+       least those permissions, but it mustn't make read-only data
+       writable (or the other way around), since writable pages can't
+       be shared between processes. */
+    return (segFlags & flags) == flags && (segFlags & PF_W) == (flags & PF_W);
+}
+
+
+template<ElfFileParams>
+int ElfFile<ElfFileParamNames>::findExtensibleSegment(unsigned int flags)
+{
+    /* The replaced sections can be appended to the segment with the
+       highest virtual address, rather than getting a PT_LOAD of their
+       own, if that segment has no .bss (which we would clobber), has
+       compatible permissions, and the only data between its end and
+       the end of the file is on its last page (otherwise we'd be
+       mapping lots of non-allocated sections as well). */
+    int last = -1;
+    Elf_Addr lastEnd = 0;
+    for (unsigned int i = 0; i < phdrs.size(); ++i) {
+        if (rdi(phdrs[i].p_type) != PT_LOAD) continue;
+        Elf_Addr end = rdi(phdrs[i].p_vaddr) + rdi(phdrs[i].p_memsz);
+        if (end > lastEnd) { lastEnd = end; last = i; }
+    }
+
+    if (last == -1) return -1;
+
+    Elf_Phdr & phdr = phdrs[last];
+    if (rdi(phdr.p_filesz) != rdi(phdr.p_memsz) ||
+        !compatibleFlags(rdi(phdr.p_flags), flags) ||
+        roundUp(rdi(phdr.p_offset) + rdi(phdr.p_filesz), getPageSize()) < fileContents->size())
+        return -1;
+
+    return last;
+}
+
+
+template<ElfFileParams>
+unsigned int ElfFile<ElfFileParamNames>::getSegmentAlignment()
+{
+    /* Normally new segments only need to be page-aligned.  With
+       --segment-align, keep file offsets and virtual addresses
+       congruent modulo the largest alignment of the existing PT_LOAD
+       segments (e.g. 2 MiB), so that the file can still be mapped
+       with huge pages. */
+    unsigned int align = getPageSize();
+    if (!segmentAlign) return align;
+    for (auto & phdr : phdrs)
+        if (rdi(phdr.p_type) == PT_LOAD && rdi(phdr.p_align) > align)
+            align = rdi(phdr.p_align);
+    return align;
+}
+
+
+template<ElfFileParams>
+unsigned int ElfFile<ElfFileParamNames>::segmentFlags(unsigned int sectionIndex)
+{
+    unsigned int shFlags = rdi(shdrs[sectionIndex].sh_flags);
+    return PF_R
+        | (shFlags & SHF_WRITE ? PF_W : 0)
+        | (shFlags & SHF_EXECINSTR ? PF_X : 0);
+}
+
+
+template<ElfFileParams>
+void ElfFile<ElfFileParamNames>::rewriteSectionsLibrary()
+{
+    /* For dynamic libraries, we just place the replacement sections
+       at the end of the file.  They're mapped into memory by PT_LOAD
+       segments located directly after the last virtual address page
+       of other segments, or by extending the last segment if it
+       already ends at the end of the file (e.g. because we added it
+       in a previous run).
+
+       Sections are grouped by the permissions they need, so that
+       e.g. a relocated .dynstr stays in a read-only (and therefore
+       shared and clean) mapping and only .dynamic ends up in a
+       writable one.  Writable groups go first, so that the read-only
+       group, which is the one that grows on every --set-rpath, tends
+       to be last and can be extended the next time around. */
+    std::vector<unsigned int> groups;
+    int extend = -1;
+    unsigned int newSegments = 0;
+
+    auto planGroups = [&]() {
+        std::set<unsigned int> flagSet;
+        for (auto & i : replacedSections)
+            flagSet.insert(segmentFlags(i.first));
+        groups.assign(flagSet.begin(), flagSet.end());
+        std::stable_sort(groups.begin(), groups.end(),
+            [](unsigned int x, unsigned int y) { return (x & PF_W) > (y & PF_W); });
+
+        extend = -1;
+        for (unsigned int i = 0; i < groups.size(); ++i)
+            if ((extend = findExtensibleSegment(groups[i])) != -1) {
+                std::rotate(groups.begin(), groups.begin() + i, groups.begin() + i + 1);
+                break;
+            }
+
+        newSegments = groups.size() - (extend != -1);
+    };
+
+    /* With --gc, first drop the dead end of the file, so that the
+       last segment can be extended from where its live part ends. */
+    bool trimmed = gc && trimDeadTail();
+    if (replacedSections.empty()) {
+        if (trimmed) rewriteHeaders(rdi(hdr->e_phoff));
+        return;
+    }
+
+    while (true) {
+        planGroups();
+
+        /* Because we're adding new program headers, we're necessarily
+           increasing the size of the program header table.  This can
+           cause the first section to overlap the program header table
+           in memory; we need to shift the first few sections to
+           someplace else.  That may require yet another segment, so
+           repeat until nothing changes. */
+        /* Some sections may already be replaced so account for that */
+        if (newSegments == 0) break;
+
+        bool replacedMore = false;
+        Elf_Addr pht_size = sizeof(Elf_Ehdr) + (phdrs.size() + newSegments) * sizeof(Elf_Phdr);
+        /* The section headers of libraries aren't kept sorted by
+           address (see rewriteHeaders()), so look at all of them. */
+        for (unsigned int i = 1; i < rdi(hdr->e_shnum); ++i) {
+            if (!(rdi(shdrs[i].sh_flags) & SHF_ALLOC) || rdi(shdrs[i].sh_addr) > pht_size) continue;
+            if (!replacedSections.count(i)) {
+                replaceSection(getSectionName(shdrs[i]), rdi(shdrs[i].sh_size));
+                replacedMore = true;
+            }
+        }
+        if (!replacedMore) break;
+    }
+
+    /* Then fill the holes; this can only leave fewer groups needing a
+       new segment, so the program header table still fits. */
+    if (gc) {
+        reuseDeadSpace(rdi(hdr->e_phoff) + (phdrs.size() + newSegments) * sizeof(Elf_Phdr));
+        planGroups();
+    }
+
+    for (unsigned int g = 0; g < groups.size(); ++g) {
+        unsigned int flags = groups[g];
+
+        /* Compute the total space needed for the sections in this group. */
+        off_t neededSpace = 0;
+        for (auto & i : replacedSections)
+            if (segmentFlags(i.first) == flags)
+                neededSpace += roundUp(i.second.size(), sectionAlignment);
+        debug("needed space for segment with flags 0x%x is %d\n", flags, neededSpace);
+
+        if (g == 0 && extend != -1) {
+            Elf_Phdr & phdr = phdrs[extend];
+            size_t startOffset = roundUp(fileContents->size(), sectionAlignment);
+            Elf_Addr startAddr = rdi(phdr.p_vaddr) + (startOffset - rdi(phdr.p_offset));
+
+            debug("extending segment %d to map the replaced sections at 0x%llx\n",
+                extend, (unsigned long long) startAddr);
+
+            growFile(fileContents, startOffset + neededSpace);
+
+            wri(phdr.p_filesz, wri(phdr.p_memsz, startOffset + neededSpace - rdi(phdr.p_offset)));
+
+            Elf_Off curOff = startOffset;
+            writeReplacedSections(curOff, startAddr, startOffset, flags);
+            assert(curOff == startOffset + neededSpace);
+            continue;
+        }
+
+        Elf_Addr startPage = 0;
+        for (unsigned int i = 0; i < phdrs.size(); ++i) {
+            Elf_Addr thisPage = roundUp(rdi(phdrs[i].p_vaddr) + rdi(phdrs[i].p_memsz), getPageSize());
+            if (thisPage > startPage) startPage = thisPage;
+        }
+
+        debug("last page is 0x%llx\n", (unsigned long long) startPage);
+
+        size_t startOffset = roundUp(fileContents->size(), getPageSize());
+
+        growFile(fileContents, startOffset + neededSpace);
+
+        /* Even though this file is of type ET_DYN, it could actually be
+           an executable.  For instance, Gold produces executables marked
+           ET_DYN as does LD when linking with pie. If we move PT_PHDR, it
+           has to stay in the first PT_LOAD segment or any subsequent ones
+           if they're continuous in memory due to linux kernel constraints
+           (see BUGS). Since the end of the file would be after bss, we can't 
+           move PHDR there, we therefore choose to leave PT_PHDR where it is but
+           move enough following sections such that we can add the extra PT_LOAD
+           section to it. This PT_LOAD segment ensures the sections at the end of
+           the file are mapped into memory for ld.so to process.
+           We can't use the approach in rewriteSectionsExecutable()
+           since DYN executables tend to start at virtual address 0, so
+           rewriteSectionsExecutable() won't work because it doesn't have
+           any virtual address space to grow downwards into.  Only move
+           the segment up, though: moving it down would make it overlap
+           the segments before it. */
+        if (isExecutable && startOffset > startPage) {
+            debug("shifting new PT_LOAD segment by %d bytes to work around a Linux kernel bug\n", startOffset - startPage);
+            startPage = startOffset;
+        }
+
+        unsigned int align = getSegmentAlignment();
+        if ((startPage - startOffset) % align != 0) {
+            startPage += (startOffset % align + align - startPage % align) % align;
+            debug("moving new PT_LOAD segment to 0x%llx for alignment 0x%x\n",
+                (unsigned long long) startPage, align);
+        }
+
+        /* Add a segment that maps the replaced sections into memory. */
+        phdrs.resize(rdi(hdr->e_phnum) + 1);
+        wri(hdr->e_phnum, rdi(hdr->e_phnum) + 1);
+        Elf_Phdr & phdr = phdrs[rdi(hdr->e_phnum) - 1];
+        wri(phdr.p_type, PT_LOAD);
+        wri(phdr.p_offset, startOffset);
+        wri(phdr.p_vaddr, wri(phdr.p_paddr, startPage));
+        wri(phdr.p_filesz, wri(phdr.p_memsz, neededSpace));
+        wri(phdr.p_flags, flags);
+        wri(phdr.p_align, align);
+
+
+        /* Write out the replaced sections. */
+        Elf_Off curOff = startOffset;
+        writeReplacedSections(curOff, startPage, startOffset, flags);
+        assert(curOff == startOffset + neededSpace);
+    }
+
+    assert(replacedSections.empty());
+
+    writeSectionHeaders();
+
+    /* Write out the updated program and section headers */
+    rewriteHeaders(rdi(hdr->e_phoff));
+}
+
+
+template<ElfFileParams>
+void ElfFile<ElfFileParamNames>::rewriteSectionsExecutable()
+{
+    /* Sort the sections by offset, otherwise we won't correctly find
+       all the sections before the last replaced section. */
+    sortShdrs();
+
+
+    /* What is the index of the last replaced section? */
+    unsigned int lastReplaced = 0;
+    for (unsigned int i = 1; i < rdi(hdr->e_shnum); ++i)
+        if (replacedSections.count(i)) {
+            verbose("using replaced section '%s'\n", getSectionName(shdrs[i]).c_str());
+            lastReplaced = i;
+        }
+
+    assert(lastReplaced != 0);
+
+    debug("last replaced is %d\n", lastReplaced);
+
+    /* Try to replace all sections before that, as far as possible.
+       Stop when we reach an irreplacable section (such as one of type
+       SHT_PROGBITS).  These cannot be moved in virtual address space
+       since that would invalidate absolute references to them. */
+    if (lastReplaced + 1 >= shdrs.size()) /* !!! I'm lazy. */
+        error("cannot replace the last section of an executable");
+    size_t startOffset = rdi(shdrs[lastReplaced + 1].sh_offset);
+    Elf_Addr startAddr = rdi(shdrs[lastReplaced + 1].sh_addr);
+    std::string prevSection;
+    for (unsigned int i = 1; i <= lastReplaced; ++i) {
+        Elf_Shdr & shdr(shdrs[i]);
+        std::string sectionName = getSectionName(shdr);
+        verbose("looking at section '%s'\n", sectionName.c_str());
+        /* !!! Why do we stop after a .dynstr section? I can't
+           remember! */
+        if ((rdi(shdr.sh_type) == SHT_PROGBITS && sectionName != ".interp")
+            || prevSection == ".dynstr")
+        {
+            startOffset = rdi(shdr.sh_offset);
+            startAddr = rdi(shdr.sh_addr);
+            lastReplaced = i - 1;
+            break;
+        } else {
+            if (!replacedSections.count(i)) {
+                debug("replacing section '%s' which is in the way\n", sectionName.c_str());
+                replaceSection(sectionName, rdi(shdr.sh_size));
+            }
+        }
+        prevSection = sectionName;
+    }
+
+    debug("first reserved offset/addr is 0x%x/0x%llx\n",
+        startOffset, (unsigned long long) startAddr);
+
+    if (startAddr % getPageSize() != startOffset % getPageSize())
+        error("section address and file offset are not congruent modulo the page size");
+    Elf_Addr firstPage = startAddr - startOffset;
+    debug("first page is 0x%llx\n", (unsigned long long) firstPage);
+
+    if (rdi(hdr->e_shoff) < startOffset) {
+        /* The section headers occur too early in the file and would be
+           overwritten by the replaced sections. Move them to the end of the file
+           before proceeding. */
+        off_t shoffNew = fileContents->size();
+        off_t shSize = rdi(hdr->e_shoff) + rdi(hdr->e_shnum) * rdi(hdr->e_shentsize);
+        growFile(fileContents, fileContents->size() + shSize);
+        wri(hdr->e_shoff, shoffNew);
+
+        /* Rewrite the section header table.  For neatness, keep the
+           sections sorted. */
+        assert(rdi(hdr->e_shnum) == shdrs.size());
+        sortShdrs();
+        for (unsigned int i = 1; i < rdi(hdr->e_shnum); ++i)
+            * ((Elf_Shdr *) (contents + rdi(hdr->e_shoff)) + i) = shdrs[i];
+    }
+
+
+    /* Compute the total space needed for the replaced sections, the
+       ELF header, and the program headers. */
+    size_t neededSpace = sizeof(Elf_Ehdr) + phdrs.size() * sizeof(Elf_Phdr);
+    for (auto & i : replacedSections)
+        neededSpace += roundUp(i.second.size(), sectionAlignment);
+
+    debug("needed space is %d\n", neededSpace);
+
+    unsigned int flags = PF_R;
+    for (auto & i : replacedSections)
+        flags |= segmentFlags(i.first);
+
+    /* The replaced sections can't go into an executable segment that
+       doesn't grant what they need (usually a text segment starting
+       at the beginning of the file, as with -z noseparate-code):
+       making it writable would give a W+X segment.  So only the space
+       below such a segment is free for them. */
+    size_t freeEnd = startOffset;
+    size_t headersEnd = sizeof(Elf_Ehdr) + phdrs.size() * sizeof(Elf_Phdr);
+    for (auto & phdr : phdrs)
+        if (rdi(phdr.p_type) == PT_LOAD && (rdi(phdr.p_flags) & PF_X) &&
+            (rdi(phdr.p_flags) & flags) != flags &&
+            rdi(phdr.p_offset) < freeEnd &&
+            rdi(phdr.p_offset) + rdi(phdr.p_filesz) > headersEnd)
+            freeEnd = rdi(phdr.p_offset);
+    if (freeEnd != startOffset)
+        debug("executable segment at offset 0x%x is in the way\n", freeEnd);
+
+    /* If we need more space at the start of the file, then grow the
+       file by the minimum number of pages and adjust internal
+       offsets. */
+    if (neededSpace > freeEnd) {
+
+        /* We also need an additional program header, so adjust for that. */
+        neededSpace += sizeof(Elf_Phdr);
+        debug("needed space is %d\n", neededSpace);
+
+        unsigned int neededPages = roundUp(neededSpace - freeEnd, getSegmentAlignment()) / getPageSize();
+        debug("needed pages is %d\n", neededPages);
+        if (neededPages * getPageSize() > firstPage)
+            error("virtual address space underrun!");
+
+        firstPage -= neededPages * getPageSize();
+        startOffset += neededPages * getPageSize();
+
+        /* The new pages hold the headers and the replaced sections,
+           so only make them writable if one of those needs it. */
+        unsigned int oldPhnum = phdrs.size();
+        shiftFile(neededPages, firstPage, flags);
+
+        /* shiftFile() may have been able to grow an existing segment
+           rather than add one. */
+        if (phdrs.size() == oldPhnum)
+            neededSpace -= sizeof(Elf_Phdr);
+    }
+
+
+    /* Clear out the free space. */
+    Elf_Off curOff = sizeof(Elf_Ehdr) + phdrs.size() * sizeof(Elf_Phdr);
+    debug("clearing first %d bytes\n", startOffset - curOff);
+    memset(contents + curOff, 0, startOffset - curOff);
+
+
+    /* The replaced sections may also land in space that was already
+       there, e.g. added by an earlier run, or in the part of the old
+       first segment before 'startOffset'; make sure the segments
+       mapping it grant what they need (a writable .dynamic in a
+       read-only segment makes ld.so crash).  Executable segments were
+       kept out of the way above. */
+    for (unsigned int i = 0; i < phdrs.size(); ++i) {
+        Elf_Phdr & phdr = phdrs[i];
+        if (rdi(phdr.p_type) != PT_LOAD || (rdi(phdr.p_flags) & PF_X) ||
+            rdi(phdr.p_offset) >= neededSpace ||
+            rdi(phdr.p_offset) + rdi(phdr.p_filesz) <= curOff ||
+            (rdi(phdr.p_flags) & flags) == flags)
+            continue;
+        debug("adding flags 0x%x to segment %d\n", flags, i);
+        wri(phdr.p_flags, rdi(phdr.p_flags) | flags);
+    }
+
+
+    /* Write out the replaced sections. */
+    writeReplacedSections(curOff, firstPage, 0);
+    assert(curOff == neededSpace);
+
+
+    rewriteHeaders(firstPage + rdi(hdr->e_phoff));
+}
+
+
+template<ElfFileParams>
+void ElfFile<ElfFileParamNames>::rewriteSections()
+{
+    /* With --gc, a library may shrink even if nothing was replaced. */
+    if (replacedSections.empty() && !(gc && rdi(hdr->e_type) == ET_DYN)) return;
+
+    Phase phase(stats, "layout");
+
+    for (auto & i : replacedSections)
+        debug("replacing section '%s' with size %d\n",
+            getSectionName(shdrs[i.first]).c_str(), i.second.size());
+
+    if (stats) stats->sectionsReplaced += replacedSections.size();
+    size_t oldPhnum = phdrs.size();
+
+    if (rdi(hdr->e_type) == ET_DYN) {
+        debug("this is a dynamic library\n");
+        rewriteSectionsLibrary();
+    } else if (rdi(hdr->e_type) == ET_EXEC) {
+        debug("this is an executable\n");
+        rewriteSectionsExecutable();
+    } else error("unknown ELF type");
+
+    if (stats && phdrs.size() > oldPhnum) stats->segmentsAdded += phdrs.size() - oldPhnum;
+}
+
+
+template<ElfFileParams>
+void ElfFile<ElfFileParamNames>::rewriteHeaders(Elf_Addr phdrAddress)
+{
+    Phase phase(stats, "rewrite-headers");
+
+    /* Rewrite the program header table. */
+
+    /* If there is a segment for the program header table, update it.
+       (According to the ELF spec, there can only be one.) */
+    for (unsigned int i = 0; i < phdrs.size(); ++i) {
+        if (rdi(phdrs[i].p_type) == PT_PHDR) {
+            phdrs[i].p_offset = hdr->e_phoff;
+            wri(phdrs[i].p_vaddr, wri(phdrs[i].p_paddr, phdrAddress));
+            wri(phdrs[i].p_filesz, wri(phdrs[i].p_memsz, phdrs.size() * sizeof(Elf_Phdr)));
+            break;
+        }
+    }
+
+    sortPhdrs();
+
+    for (unsigned int i = 0; i < phdrs.size(); ++i)
+        * ((Elf_Phdr *) (contents + rdi(hdr->e_phoff)) + i) = phdrs[i];
+
+
+    /* Rewrite the section header table.  For neatness, keep the
+       sections of executables sorted.  Those of libraries keep their
+       order, even though the replaced ones are now at the end of the
+       file, so that the section indices in the symbol tables stay
+       valid (see below). */
+    assert(rdi(hdr->e_shnum) == shdrs.size());
+    if (rdi(hdr->e_type) != ET_DYN) sortShdrs();
+    for (unsigned int i = 1; i < rdi(hdr->e_shnum); ++i)
+        * ((Elf_Shdr *) (contents + rdi(hdr->e_shoff)) + i) = shdrs[i];
+
+
+    /* Update all those nasty virtual addresses in the .dynamic
+       section.  Note that not all executables have .dynamic sections
+       (e.g., those produced by klibc's klcc). */
+    Elf_Shdr * shdrDynamic = findSection2(".dynamic");
+    if (shdrDynamic) {
+        /* Look up the sections by name in one pass over the section
+           headers, rather than once for every entry; like
+           findSection2(), the first one of a name wins. */
+        std::map<SectionName, Elf_Shdr *> byName;
+        for (unsigned int i = 1; i < rdi(hdr->e_shnum); ++i)
+            byName.emplace(getSectionName(shdrs[i]), &shdrs[i]);
+        auto section2 = [&](const SectionName & name) -> Elf_Shdr * {
+            auto i = byName.find(name);
+            return i == byName.end() ? 0 : i->second;
+        };
+        auto section = [&](const SectionName & name) -> Elf_Shdr & {
+            Elf_Shdr * shdr = section2(name);
+            return shdr ? *shdr : findSection(name);
+        };
+
+        Elf_Dyn * dyn = (Elf_Dyn *) sectionContents(*shdrDynamic);
+        Elf_Dyn * dynEnd = dyn + rdi(shdrDynamic->sh_size) / sizeof(Elf_Dyn);
+        unsigned int d_tag;
+        for ( ; dyn < dynEnd && (d_tag = rdi(dyn->d_tag)) != DT_NULL; dyn++)
+            if (d_tag == DT_STRTAB)
+                dyn->d_un.d_ptr = section(".dynstr").sh_addr;
+            else if (d_tag == DT_STRSZ)
+                dyn->d_un.d_val = section(".dynstr").sh_size;
+            else if (d_tag == DT_SYMTAB)
+                dyn->d_un.d_ptr = section(".dynsym").sh_addr;
+            else if (d_tag == DT_HASH)
+                dyn->d_un.d_ptr = section(".hash").sh_addr;
+            else if (d_tag == DT_GNU_HASH)
+                dyn->d_un.d_ptr = section(".gnu.hash").sh_addr;
+            else if (d_tag == DT_JMPREL) {
+                Elf_Shdr * shdr = section2(".rel.plt");
+                if (!shdr) shdr = section2(".rela.plt"); /* 64-bit Linux, x86-64 */
+                if (!shdr) shdr = section2(".rela.IA_64.pltoff"); /* 64-bit Linux, IA-64 */
+                if (!shdr) error("cannot find section corresponding to DT_JMPREL");
+                dyn->d_un.d_ptr = shdr->sh_addr;
+            }
+            else if (d_tag == DT_REL) { /* !!! hack! */
+                Elf_Shdr * shdr = section2(".rel.dyn");
+                /* no idea if this makes sense, but it was needed for some
+                   program */
+                if (!shdr) shdr = section2(".rel.got");
+                /* some programs have neither section, but this doesn't seem
+                   to be a problem */
+                if (!shdr) continue;
+                dyn->d_un.d_ptr = shdr->sh_addr;
+            }
+            else if (d_tag == DT_RELA) {
+                Elf_Shdr * shdr = section2(".rela.dyn");
+                /* some programs lack this section, but it doesn't seem to
+                   be a problem */
+                if (!shdr) continue;
+                dyn->d_un.d_ptr = shdr->sh_addr;
+            }
+            else if (d_tag == DT_VERNEED)
+                dyn->d_un.d_ptr = section(".gnu.version_r").sh_addr;
+            else if (d_tag == DT_VERSYM)
+                dyn->d_un.d_ptr = section(".gnu.version").sh_addr;
+    }
+
+
+    /* Rewrite the .dynsym section.  It contains the indices of the
+       sections in which symbols appear, so these need to be
+       remapped, and the addresses of the sections, for STT_SECTION
+       symbols.  If no section changed its index, only the latter can
+       change, and only for the sections that moved; and since
+       STT_SECTION symbols are local, only the local symbols at the
+       start of the table (up to sh_info) need to be looked at, if
+       any.  Large tables (e.g. the .symtab of a debug build) are
+       split between threads, unless the symbols are logged. */
+    std::vector<unsigned int> newIndices = newSectionIndices();
+    bool identity = true;
+    for (unsigned int i = 1; i < newIndices.size(); ++i)
+        if (newIndices[i] != i) identity = false;
+
+    std::vector<char> newAddrs(newIndices.size(), !identity);
+    bool moved = !identity;
+    if (identity)
+        for (unsigned int i = 1; i < newIndices.size(); ++i)
+            if (rdi(shdrs[i].sh_addr) != sectionAddrsByOldIndex[i])
+                newAddrs[i] = moved = true;
+
+    for (unsigned int i = 1; i < rdi(hdr->e_shnum); ++i) {
+        if (rdi(shdrs[i].sh_type) != SHT_SYMTAB && rdi(shdrs[i].sh_type) != SHT_DYNSYM) continue;
+        if (!moved) {
+            debug("symbol table section %d needs no changes\n", i);
+            continue;
+        }
+        debug("rewriting symbol table section %d\n", i);
+        Elf_Sym * syms = (Elf_Sym *) sectionContents(shdrs[i]);
+        size_t count = rdi(shdrs[i].sh_size) / sizeof(Elf_Sym);
+        if (identity) count = std::min(count, (size_t) rdi(shdrs[i].sh_info));
+        forEachChunk(count, logLevel >= logVerbose ? 1 : threads, [&](size_t begin, size_t end) {
+            rewriteSymbols(syms, begin, end, newIndices, newAddrs);
+        });
+    }
+}
+
+
+template<ElfFileParams>
+std::vector<unsigned int> ElfFile<ElfFileParamNames>::newSectionIndices()
+{
+    /* The current index of every section by its index in the file as
+       read (0 if it's gone), found by name like findSection3(). */
+    std::map<SectionName, unsigned int> byName;
+    for (unsigned int i = shdrs.size(); i-- > 1; )
+        byName[getSectionName(shdrs[i])] = i;
+
+    std::vector<unsigned int> newIndices(sectionsByOldIndex.size(), 0);
+    for (unsigned int i = 1; i < sectionsByOldIndex.size(); ++i) {
+        auto j = byName.find(sectionsByOldIndex[i]);
+        if (j != byName.end()) newIndices[i] = j->second;
+    }
+    return newIndices;
+}
+
+
+template<ElfFileParams>
+void ElfFile<ElfFileParamNames>::rewriteSymbols(Elf_Sym * syms, size_t begin, size_t end,
+    const std::vector<unsigned int> & newIndices, const std::vector<char> & newAddrs)
+{
+    /* 'newAddrs' says for which (old) sections STT_SECTION symbols
+       need their value updated. */
+    for (size_t entry = begin; entry < end; entry++) {
+        Elf_Sym * sym = syms + entry;
+        unsigned int shndx = rdi(sym->st_shndx);
+        if (shndx != SHN_UNDEF && shndx < SHN_LORESERVE) {
+            if (shndx >= newIndices.size()) {
+                fprintf(stderr, "warning: entry %d in symbol table refers to a non-existent section, skipping\n", shndx);
+                continue;
+            }
+            unsigned int newIndex = newIndices[shndx];
+            verbose("rewriting symbol %d: index = %d (%s) -> %d\n", entry, shndx, sectionsByOldIndex[shndx].c_str(), newIndex);
+            wri(sym->st_shndx, newIndex);
+            /* Rewrite st_value.  FIXME: we should do this for all
+               types, but most don't actually change. */
+            if (ELF32_ST_TYPE(rdi(sym->st_info)) == STT_SECTION && newAddrs[shndx])
+                wri(sym->st_value, rdi(shdrs[newIndex].sh_addr));
+        }
+    }
+}
+
+
+
+static void setSubstr(std::string & s, unsigned int pos, const std::string & t)
+{
+    assert(pos + t.size() <= s.size());
+    copy(t.begin(), t.end(), s.begin() + pos);
+}
+
+
+template<ElfFileParams>
+typename ElfFile<ElfFileParamNames>::DynamicPlan & ElfFile<ElfFileParamNames>::loadDynamic()
+{
+    DynamicPlan & plan = dynamicPlan;
+    if (plan.loaded) return plan;
+
+    Elf_Shdr & shdrDynamic = findSection(".dynamic");
+    Elf_Shdr & shdrDynStr = findSection(".dynstr");
+
+    size_t count = rdi(shdrDynamic.sh_size) / sizeof(Elf_Dyn);
+    Elf_Dyn * dyn = (Elf_Dyn *) sectionContents(shdrDynamic);
+    for (size_t i = 0; i < count && rdi(dyn[i].d_tag) != DT_NULL; ++i)
+        plan.entries.push_back(dyn[i]);
+    plan.oldCount = plan.entries.size();
+    indexDynamic();
+
+    plan.strTab = (char *) sectionContents(shdrDynStr);
+    plan.strSize = rdi(shdrDynStr.sh_size);
+    if (plan.strSize && plan.strTab[plan.strSize - 1] != 0)
+        error("dynamic string table is not zero terminated");
+
+    plan.loaded = true;
+    return plan;
+}
+
+
+template<ElfFileParams>
+char * ElfFile<ElfFileParamNames>::dynString(Elf64_Xword offset)
+{
+    DynamicPlan & plan = dynamicPlan;
+    if (offset < plan.strSize) return plan.strTab + offset;
+    if (offset - plan.strSize < plan.newStrings.size()) return &plan.newStrings[offset - plan.strSize];
+    error(fmt("string offset ", offset, " in .dynamic is out of range"));
+}
+
+
+template<ElfFileParams>
+Elf64_Xword ElfFile<ElfFileParamNames>::addDynString(const std::string & s)
+{
+    DynamicPlan & plan = dynamicPlan;
+    auto i = plan.newStringOffsets.find(s);
+    if (i != plan.newStringOffsets.end()) return i->second;
+    Elf64_Xword offset = plan.strSize + plan.newStrings.size();
+    plan.newStrings += s + '\0';
+    plan.newStringOffsets[s] = offset;
+    return offset;
+}
+
+
+template<ElfFileParams>
+void ElfFile<ElfFileParamNames>::insertDynamic(size_t pos, Elf64_Xword tag, Elf64_Xword val)
+{
+    Elf_Dyn dyn;
+    wri(dyn.d_tag, tag);
+    wri(dyn.d_un.d_val, val);
+    dynamicPlan.entries.insert(dynamicPlan.entries.begin() + pos, dyn);
+    dynamicPlan.changed = true;
+    indexDynamic();
+}
+
+
+template<ElfFileParams>
+void ElfFile<ElfFileParamNames>::indexDynamic()
+{
+    DynamicPlan & plan = dynamicPlan;
+    plan.byTag.clear();
+    for (size_t i = 0; i < plan.entries.size(); ++i)
+        plan.byTag[rdi(plan.entries[i].d_tag)].push_back(i);
+}
+
+
+template<ElfFileParams>
+const std::vector<size_t> & ElfFile<ElfFileParamNames>::dynPositions(Elf64_Sxword tag)
+{
+    static const std::vector<size_t> none;
+    auto i = dynamicPlan.byTag.find(tag);
+    return i == dynamicPlan.byTag.end() ? none : i->second;
+}
+
+
+template<ElfFileParams>
+Elf_Dyn * ElfFile<ElfFileParamNames>::dynEntry(Elf64_Sxword tag)
+{
+    auto & positions = dynPositions(tag);
+    return positions.empty() ? 0 : &dynamicPlan.entries[positions.back()];
+}
+
+
+/* Write the edited .dynamic, and .dynstr if strings were added or it
+   is to be compacted.  If .dynamic has to grow, the DT_NULL padding
+   at its end is kept. */
+template<ElfFileParams>
+void ElfFile<ElfFileParamNames>::commitDynamic(bool compact)
+{
+    DynamicPlan & plan = dynamicPlan;
+    if (compact)
+        compactDynStr();
+    else if (!plan.loaded)
+        return;
+
+    if (!plan.newStrings.empty()) {
+        std::string & newDynStr = replaceSection(".dynstr", plan.strSize + plan.newStrings.size());
+        setSubstr(newDynStr, plan.strSize, plan.newStrings);
+        changed = true;
+    }
+
+    if (!plan.changed) return;
+
+    Elf_Shdr & shdrDynamic = findSection(".dynamic");
+    size_t oldSize = rdi(shdrDynamic.sh_size);
+    size_t size = oldSize;
+    if (plan.entries.size() > plan.oldCount)
+        size += (plan.entries.size() - plan.oldCount) * sizeof(Elf_Dyn);
+
+    std::string data((char *) plan.entries.data(), plan.entries.size() * sizeof(Elf_Dyn));
+    data.resize(size, 0);
+
+    if (size > oldSize)
+        replaceSection(".dynamic", std::move(data));
+    else
+        memcpy(contents + rdi(shdrDynamic.sh_offset), data.data(), size);
+
+    changed = true;
+}
+
+
+static bool isStringTag(Elf64_Sxword tag)
+{
+    return tag == DT_NEEDED || tag == DT_SONAME || tag == DT_RPATH || tag == DT_RUNPATH
+        || tag == DT_AUXILIARY || tag == DT_FILTER || tag == DT_CONFIG
+        || tag == DT_DEPAUDIT || tag == DT_AUDIT;
+}
+
+
+/* Rebuild .dynstr from the strings that are still referred to, and
+   share common suffixes like the linker does, so that the strings
+   replaced by earlier edits go away.  The references are in .dynamic
+   (through the plan), .dynsym and the symbol version sections; if any
+   other section links to .dynstr, it's not safe. */
+template<ElfFileParams>
+void ElfFile<ElfFileParamNames>::compactDynStr()
+{
+    Phase phase(stats, "compact-dynstr");
+
+    if (rdi(hdr->e_machine) == EM_MIPS)
+        error("cannot compact the dynamic string table of MIPS objects");
+
+    DynamicPlan & plan = loadDynamic();
+    unsigned int dynStrIndex = findSection3(".dynstr");
+
+    /* The references, and the strings they refer to now.  The version
+       structures have the same layout in both ELF classes. */
+    std::vector<Elf_Dyn *> dynRefs;
+    std::vector<uint32_t *> refs;
+    std::vector<std::string> strings;
+
+    for (auto & dyn : plan.entries)
+        if (isStringTag(rdi(dyn.d_tag))) {
+            dynRefs.push_back(&dyn);
+            strings.push_back(dynString(rdi(dyn.d_un.d_val)));
+        }
+
+    auto addRef = [&](uint32_t * ref) {
+        checkPointer(fileContents, ref, sizeof(*ref));
+        refs.push_back(ref);
+        strings.push_back(dynString(rdi(*ref)));
+    };
+
+    for (unsigned int i = 1; i < shdrs.size(); ++i) {
+        Elf_Shdr & shdr = shdrs[i];
+        if (rdi(shdr.sh_link) != dynStrIndex || rdi(shdr.sh_type) == SHT_DYNAMIC) continue;
+        unsigned char * data = sectionContents(shdr);
+
+        if (rdi(shdr.sh_type) == SHT_DYNSYM) {
+            for (size_t n = 0; (n + 1) * sizeof(Elf_Sym) <= rdi(shdr.sh_size); ++n)
+                addRef((uint32_t *) &((Elf_Sym *) data)[n].st_name);
+        }
+
+        else if (rdi(shdr.sh_type) == SHT_GNU_verneed) {
+            unsigned char * need = data;
+            for (unsigned int n = rdi(shdr.sh_info); n > 0; --n) {
+                Elf32_Verneed * vn = (Elf32_Verneed *) need;
+                checkPointer(fileContents, vn, sizeof(*vn));
+                addRef(&vn->vn_file);
+                unsigned char * aux = need + rdi(vn->vn_aux);
+                for (unsigned int a = rdi(vn->vn_cnt); a > 0; --a) {
+                    Elf32_Vernaux * vna = (Elf32_Vernaux *) aux;
+                    checkPointer(fileContents, vna, sizeof(*vna));
+                    addRef(&vna->vna_name);
+                    aux += rdi(vna->vna_next);
+                }
+                need += rdi(vn->vn_next);
+            }
+        }
+
+        else if (rdi(shdr.sh_type) == SHT_GNU_verdef) {
+            unsigned char * def = data;
+            for (unsigned int n = rdi(shdr.sh_info); n > 0; --n) {
+                Elf32_Verdef * vd = (Elf32_Verdef *) def;
+                checkPointer(fileContents, vd, sizeof(*vd));
+                unsigned char * aux = def + rdi(vd->vd_aux);
+                for (unsigned int a = rdi(vd->vd_cnt); a > 0; --a) {
+                    Elf32_Verdaux * vda = (Elf32_Verdaux *) aux;
+                    checkPointer(fileContents, vda, sizeof(*vda));
+                    addRef(&vda->vda_name);
+                    aux += rdi(vda->vda_next);
+                }
+                def += rdi(vd->vd_next);
+            }
+        }
+
+        else
+            error(fmt("cannot compact .dynstr: section '", getSectionName(shdr), "' refers to it"));
+    }
+
+    /* Sort the strings by their reversal, backwards: a string that is
+       a suffix of another then comes right after it (or after another
+       string it's a suffix of), and can point into it. */
+    std::vector<std::string> reversed;
+    for (auto & str : std::set<std::string>(strings.begin(), strings.end()))
+        if (!str.empty()) reversed.push_back(std::string(str.rbegin(), str.rend()));
+    std::sort(reversed.begin(), reversed.end(), std::greater<std::string>());
+
+    std::string table(1, '\0');
+    std::map<std::string, Elf64_Xword> offsets;
+    offsets[""] = 0;
+    std::string prev;
+    Elf64_Xword prevOffset = 0;
+    for (auto & r : reversed) {
+        std::string str(r.rbegin(), r.rend());
+        if (prev.size() > str.size() && prev.compare(prev.size() - str.size(), str.size(), str) == 0)
+            offsets[str] = prevOffset + prev.size() - str.size();
+        else {
+            prev = str;
+            prevOffset = offsets[str] = table.size();
+            table += str + '\0';
+        }
+    }
+
+    debug("compacting .dynstr from %d to %d bytes\n",
+        plan.strSize + plan.newStrings.size(), table.size());
+
+    for (size_t i = 0; i < dynRefs.size(); ++i)
+        wri(dynRefs[i]->d_un.d_val, offsets[strings[i]]);
+    for (size_t i = 0; i < refs.size(); ++i)
+        wri(*refs[i], offsets[strings[dynRefs.size() + i]]);
+    plan.newStrings.clear();
+    plan.newStringOffsets.clear();
+    plan.changed = changed = true;
+
+    if (table.size() > plan.strSize) {
+        replaceSection(".dynstr", std::move(table));
+        return;
+    }
+
+    /* It fits in place; clear the rest, and shrink the section. */
+    memcpy(plan.strTab, table.data(), table.size());
+    memset(plan.strTab + table.size(), 0, plan.strSize - table.size());
+
+    Elf_Shdr & shdrDynStr = shdrs[dynStrIndex];
+    wri(shdrDynStr.sh_size, table.size());
+    * ((Elf_Shdr *) (contents + rdi(hdr->e_shoff)) + dynStrIndex) = shdrDynStr;
+
+    for (auto & dyn : plan.entries)
+        if (rdi(dyn.d_tag) == DT_STRSZ) wri(dyn.d_un.d_val, table.size());
+}
+
+
+template<ElfFileParams>
+std::string ElfFile<ElfFileParamNames>::getInterpreter()
+{
+    Phase phase(stats, "print-interpreter");
+    Elf_Shdr & shdr = findSection(".interp");
+    return std::string((char *) sectionContents(shdr), rdi(shdr.sh_size));
+}
+
+template<ElfFileParams>
+void ElfFile<ElfFileParamNames>::modifySoname(sonameMode op, const std::string & newSoname)
+{
+    Phase phase(stats, op == printSoname ? "print-soname" : "set-soname");
+
+    if (rdi(hdr->e_type) != ET_DYN) {
+        debug("this is not a dynamic library\n");
+        return;
+    }
+
+    DynamicPlan & plan = loadDynamic();
+
+    Elf_Dyn * dynSoname = dynEntry(DT_SONAME);
+    char * soname = dynSoname ? dynString(rdi(dynSoname->d_un.d_val)) : 0;
+
+    if (op == printSoname) {
+        if (soname) {
+            if (std::string(soname ? soname : "") == "")
+                debug("DT_SONAME is empty\n");
+            else
+                result.soname = soname;
+        } else {
+            debug("no DT_SONAME found\n");
+        }
+        return;
+    }
+
+    if (std::string(soname ? soname : "") == newSoname) {
+        debug("current and proposed new SONAMEs are equal keeping DT_SONAME entry\n");
+        return;
+    }
+
+    /* Zero out the previous SONAME */
+    if (soname) memset(soname, 'X', strlen(soname));
+
+    debug("new SONAME is '%s'\n", newSoname.c_str());
+
+    Elf64_Xword offset = addDynString(newSoname);
+
+    /* Update the DT_SONAME entry, or add one at the top. */
+    if (dynSoname) {
+        wri(dynSoname->d_un.d_val, offset);
+        plan.changed = true;
+    } else
+        insertDynamic(0, DT_SONAME, offset);
+
+    changed = true;
+}
+
+template<ElfFileParams>
+void ElfFile<ElfFileParamNames>::setInterpreter(const std::string & newInterpreter)
+{
+    Phase phase(stats, "set-interpreter");
+    std::string & section = replaceSection(".interp", newInterpreter.size() + 1);
+    setSubstr(section, 0, newInterpreter + '\0');
+    changed = true;
+}
+
+
+static void concatToRPath(std::string & rpath, const std::string & path)
+{
+    if (!rpath.empty()) rpath += ":";
+    rpath += path;
+}
+
+
+template<ElfFileParams>
+void ElfFile<ElfFileParamNames>::modifyRPath(RPathOp op,
+    const std::vector<std::string> & allowedRpathPrefixes, std::string newRPath)
+{
+    static const char * phaseNames[] = {"print-rpath", "shrink-rpath", "set-rpath", "remove-rpath"};
+    Phase phase(stats, phaseNames[op]);
+
+    /* !!! We assume that the virtual address in the DT_STRTAB entry
+       of the dynamic section corresponds to the .dynstr section. */
+    DynamicPlan & plan = loadDynamic();
+
+
+    /* Walk through the dynamic section, look for the RPATH/RUNPATH
+       entry.
+
+       According to the ld.so docs, DT_RPATH is obsolete, we should
+       use DT_RUNPATH.  DT_RUNPATH has two advantages: it can be
+       overriden by LD_LIBRARY_PATH, and it's scoped (the DT_RUNPATH
+       for an executable or library doesn't affect the search path for
+       libraries used by it).  DT_RPATH is ignored if DT_RUNPATH is
+       present.  The binutils 'ld' still generates only DT_RPATH,
+       unless you use its '--enable-new-dtag' option, in which case it
+       generates a DT_RPATH and DT_RUNPATH pointing at the same
+       string. */
+    Elf_Dyn * dynRPath = dynEntry(DT_RPATH), * dynRunPath = dynEntry(DT_RUNPATH);
+    /* Only use DT_RPATH if there is no DT_RUNPATH. */
+    char * rpath = dynRunPath ? dynString(rdi(dynRunPath->d_un.d_val))
+        : dynRPath ? dynString(rdi(dynRPath->d_un.d_val)) : 0;
+
+    if (op == rpPrint) {
+        result.rpath = rpath ? rpath : "";
+        return;
+    }
+
+    if (op == rpShrink && !rpath) {
+        debug("no RPATH to shrink\n");
+        return;
+    }
+
+
+    /* For each directory in the RPATH, check if it contains any
+       needed library. */
+    if (op == rpShrink) {
+        std::vector<std::string> neededLibs;
+        for (size_t i : dynPositions(DT_NEEDED))
+            neededLibs.push_back(dynString(rdi(plan.entries[i].d_un.d_val)));
+        std::vector<bool> neededLibFound(neededLibs.size(), false);
+
+        newRPath = "";
+
+        for (auto & dirName : splitColonDelimitedString(rpath)) {
+
+            /* Non-absolute entries are allowed (e.g., the special
+               "$ORIGIN" hack). */
+            if (dirName[0] != '/') {
+                concatToRPath(newRPath, dirName);
+                continue;
+            }
+
+            /* If --allowed-rpath-prefixes was given, reject directories
+               not starting with any of the (colon-delimited) prefixes. */
+            if (!allowedRpathPrefixes.empty() && !hasAllowedPrefix(dirName, allowedRpathPrefixes)) {
+                debug("removing directory '%s' from RPATH because of non-allowed prefix\n", dirName.c_str());
+                continue;
+            }
+
+            /* For each library that we haven't found yet, see if it
+               exists in this directory. */
+            bool libFound = false;
+            for (unsigned int j = 0; j < neededLibs.size(); ++j)
+                if (!neededLibFound[j]) {
+                    std::string libName = dirName + "/" + neededLibs[j];
+                    try {
+                        if (getElfType(readFile(libName, sizeof(Elf32_Ehdr))).machine == rdi(hdr->e_machine)) {
+                            neededLibFound[j] = true;
+                            libFound = true;
+                        } else
+                            debug("ignoring library '%s' because its machine type differs\n", libName.c_str());
+                    } catch (SysError & e) {
+                        if (e.errNo != ENOENT) throw;
+                    }
+                }
+
+            if (!libFound)
+                debug("removing directory '%s' from RPATH\n", dirName.c_str());
+            else
+                concatToRPath(newRPath, dirName);
+        }
+    }
+
+    if (op == rpRemove) {
+        if (!rpath) {
+            debug("no RPATH to delete\n");
+            return;
+        }
+
+        std::vector<Elf_Dyn> kept;
+        for (auto & dyn : plan.entries) {
+            if (rdi(dyn.d_tag) == DT_RPATH)
+                debug("removing DT_RPATH entry\n");
+            else if (rdi(dyn.d_tag) == DT_RUNPATH)
+                debug("removing DT_RUNPATH entry\n");
+            else
+                kept.push_back(dyn);
+        }
+        plan.entries = kept;
+        plan.changed = changed = true;
+        indexDynamic();
+        return;
+    }
+
+
+    if (std::string(rpath ? rpath : "") == newRPath) return;
+
+    changed = true;
+
+    /* Zero out the previous rpath to prevent retained dependencies in
+       Nix. */
+    unsigned int rpathSize = 0;
+    if (rpath) {
+        rpathSize = strlen(rpath);
+        memset(rpath, 'X', rpathSize);
+    }
+
+    debug("new rpath is '%s'\n", newRPath.c_str());
+
+    if (!forceRPath && dynRPath && !dynRunPath) { /* convert DT_RPATH to DT_RUNPATH */
+        wri(dynRPath->d_tag, DT_RUNPATH);
+        dynRunPath = dynRPath;
+        dynRPath = 0;
+        plan.changed = true;
+        indexDynamic();
+    }
+
+    if (forceRPath && dynRPath && dynRunPath) { /* convert DT_RUNPATH to DT_RPATH */
+        wri(dynRunPath->d_tag, DT_IGNORE);
+        plan.changed = true;
+        indexDynamic();
+    }
+
+    if (newRPath.size() <= rpathSize) {
+        strcpy(rpath, newRPath.c_str());
+        return;
+    }
+
+    /* Add the new RPATH to .dynstr. */
+    debug("rpath is too long, resizing...\n");
+
+    Elf64_Xword offset = addDynString(newRPath);
+
+    /* Update the DT_RUNPATH and DT_RPATH entries, or add one at the
+       top. */
+    if (dynRunPath || dynRPath) {
+        if (dynRunPath) wri(dynRunPath->d_un.d_val, offset);
+        if (dynRPath) wri(dynRPath->d_un.d_val, offset);
+        plan.changed = true;
+    } else
+        insertDynamic(0, forceRPath ? DT_RPATH : DT_RUNPATH, offset);
+}
+
+
+template<ElfFileParams>
+void ElfFile<ElfFileParamNames>::removeNeeded(const std::set<std::string> & libs)
+{
+    if (libs.empty()) return;
+
+    Phase phase(stats, "remove-needed");
+
+    DynamicPlan & plan = loadDynamic();
+
+    std::vector<bool> remove(plan.entries.size(), false);
+    bool removed = false;
+    for (size_t i : dynPositions(DT_NEEDED)) {
+        char * name = dynString(rdi(plan.entries[i].d_un.d_val));
+        if (libs.find(name) != libs.end()) {
+            debug("removing DT_NEEDED entry '%s'\n", name);
+            remove[i] = removed = true;
+        } else
+            verbose("keeping DT_NEEDED entry '%s'\n", name);
+    }
+    if (!removed) return;
+
+    std::vector<Elf_Dyn> kept;
+    for (size_t i = 0; i < plan.entries.size(); ++i)
+        if (!remove[i]) kept.push_back(plan.entries[i]);
+    plan.entries = kept;
+    plan.changed = changed = true;
+    indexDynamic();
+}
+
+template<ElfFileParams>
+void ElfFile<ElfFileParamNames>::replaceNeeded(const std::map<std::string, std::string> & libs)
+{
+    if (libs.empty()) return;
+
+    Phase phase(stats, "replace-needed");
+
+    DynamicPlan & plan = loadDynamic();
+
+    for (size_t pos : dynPositions(DT_NEEDED)) {
+        Elf_Dyn & dyn = plan.entries[pos];
+        char * name = dynString(rdi(dyn.d_un.d_val));
+        auto i = libs.find(name);
+        if (i != libs.end()) {
+            auto replacement = i->second;
+
+            debug("replacing DT_NEEDED entry '%s' with '%s'\n", name, replacement.c_str());
+
+            // technically, the string referred by d_val could be used otherwise, too (although unlikely)
+            // we'll therefore add a new string
+            wri(dyn.d_un.d_val, addDynString(replacement));
+
+            plan.changed = changed = true;
+        } else {
+            verbose("keeping DT_NEEDED entry '%s'\n", name);
+        }
+    }
+
+    Elf_Dyn * dynVerNeedNum = dynEntry(DT_VERNEEDNUM);
+    unsigned int verNeedNum = dynVerNeedNum ? rdi(dynVerNeedNum->d_un.d_val) : 0;
+
+    // If a replaced library uses symbol versions, then there will also be
+    // references to it in the "version needed" table, and these also need to
+    // be replaced.
+
+    if (verNeedNum) {
+        Elf_Shdr & shdrVersionR = findSection(".gnu.version_r");
+        // The filename strings in the .gnu.version_r are different from the
+        // ones in .dynamic: instead of being in .dynstr, they're in some
+        // arbitrary section and we have to look in ->sh_link to figure out
+        // which one.
+        Elf_Shdr & shdrVersionRStrings = shdrs[rdi(shdrVersionR.sh_link)];
+        // this is where we find the actual filename strings
+        char * verStrTab = (char *) sectionContents(shdrVersionRStrings);
+        size_t verStrSize = rdi(shdrVersionRStrings.sh_size);
+        if (verStrSize == 0 || verStrTab[verStrSize - 1] != 0)
+            error("version string table is not zero terminated");
+        // and we also need the name of the section containing the strings, so
+        // that we can pass it to replaceSection
+        std::string versionRStringsSName = getSectionName(shdrVersionRStrings);
+
+        debug("found .gnu.version_r with %i entries, strings in %s\n", verNeedNum, versionRStringsSName.c_str());
+
+        /* Usually that's .dynstr, which is in the plan. */
+        bool inDynStr = versionRStringsSName == ".dynstr";
+
+        unsigned int verStrAddedBytes = 0;
+
+        Elf_Verneed * need = (Elf_Verneed *) sectionContents(shdrVersionR);
+        while (verNeedNum > 0) {
+            checkPointer(fileContents, need, sizeof(*need));
+            if (!inDynStr && rdi(need->vn_file) >= verStrSize)
+                error("version string offset out of bounds");
+            char * file = inDynStr ? dynString(rdi(need->vn_file)) : verStrTab + rdi(need->vn_file);
+            auto i = libs.find(file);
+            if (i != libs.end()) {
+                auto replacement = i->second;
+
+                debug("replacing .gnu.version_r entry '%s' with '%s'\n", file, replacement.c_str());
+
+                if (inDynStr)
+                    wri(need->vn_file, addDynString(replacement));
+                else {
+                    debug("resizing string section %s ...\n", versionRStringsSName.c_str());
+
+                    std::string & newVerDynStr = replaceSection(versionRStringsSName,
+                        rdi(shdrVersionRStrings.sh_size) + replacement.size() + 1 + verStrAddedBytes);
+                    setSubstr(newVerDynStr, rdi(shdrVersionRStrings.sh_size) + verStrAddedBytes, replacement + '\0');
+
+                    wri(need->vn_file, rdi(shdrVersionRStrings.sh_size) + verStrAddedBytes);
+
+                    verStrAddedBytes += replacement.size() + 1;
+                }
+
+                changed = true;
+            } else {
+                verbose("keeping .gnu.version_r entry '%s'\n", file);
+            }
+            // the Elf_Verneed structures form a linked list, so jump to next entry
+            need = (Elf_Verneed *) (((char *) need) + rdi(need->vn_next));
+            --verNeedNum;
+        }
+    }
+}
+
+template<ElfFileParams>
+void ElfFile<ElfFileParamNames>::addNeeded(const std::set<std::string> & libs)
+{
+    if (libs.empty()) return;
+
+    Phase phase(stats, "add-needed");
+
+    loadDynamic();
+
+    /* Add the DT_NEEDED entries at the top. */
+    unsigned int i = 0;
+    for (auto & lib : libs) {
+        debug("adding DT_NEEDED entry '%s'\n", lib.c_str());
+        insertDynamic(i++, DT_NEEDED, addDynString(lib));
+    }
+
+    changed = true;
+}
+
+template<ElfFileParams>
+void ElfFile<ElfFileParamNames>::printNeededLibs()
+{
+    Phase phase(stats, "print-needed");
+
+    DynamicPlan & plan = loadDynamic();
+    for (size_t i : dynPositions(DT_NEEDED))
+        result.needed.push_back(dynString(rdi(plan.entries[i].d_un.d_val)));
+}
+
+
+template<ElfFileParams>
+void ElfFile<ElfFileParamNames>::modifyFlags(Elf64_Xword setFlags, Elf64_Xword clearFlags,
+    Elf64_Xword setFlags1, Elf64_Xword clearFlags1)
+{
+    Phase phase(stats, "set-flags");
+
+    DynamicPlan & plan = loadDynamic();
+
+    Elf_Dyn * dynFlags = dynEntry(DT_FLAGS), * dynFlags1 = dynEntry(DT_FLAGS_1);
+
+    /* Update the existing entries in place. */
+    if (dynFlags) {
+        Elf64_Xword flags = (rdi(dynFlags->d_un.d_val) | setFlags) & ~clearFlags;
+        if (flags != rdi(dynFlags->d_un.d_val)) {
+            debug("changing DT_FLAGS from 0x%llx to 0x%llx\n",
+                (unsigned long long) rdi(dynFlags->d_un.d_val), (unsigned long long) flags);
+            wri(dynFlags->d_un.d_val, flags);
+            plan.changed = changed = true;
+        }
+    }
+
+    if (dynFlags1) {
+        Elf64_Xword flags = (rdi(dynFlags1->d_un.d_val) | setFlags1) & ~clearFlags1;
+        if (flags != rdi(dynFlags1->d_un.d_val)) {
+            debug("changing DT_FLAGS_1 from 0x%llx to 0x%llx\n",
+                (unsigned long long) rdi(dynFlags1->d_un.d_val), (unsigned long long) flags);
+            wri(dynFlags1->d_un.d_val, flags);
+            plan.changed = changed = true;
+        }
+    }
+
+    /* Add the missing entries at the top. */
+    unsigned int pos = 0;
+    if (!dynFlags && (setFlags & ~clearFlags)) {
+        insertDynamic(pos++, DT_FLAGS, setFlags & ~clearFlags);
+        changed = true;
+    }
+    if (!dynFlags1 && (setFlags1 & ~clearFlags1)) {
+        insertDynamic(pos++, DT_FLAGS_1, setFlags1 & ~clearFlags1);
+        changed = true;
+    }
+}
+
+
+static uint32_t gnuHash(const char * name)
+{
+    uint32_t h = 5381;
+    for (; *name; name++)
+        h = (h << 5) + h + (unsigned char) *name;
+    return h;
+}
+
+
+static uint32_t sysvHash(const char * name)
+{
+    uint32_t h = 0, g;
+    for (; *name; name++) {
+        h = (h << 4) + (unsigned char) *name;
+        if ((g = h & 0xf0000000)) h ^= g >> 24;
+        h &= ~g;
+    }
+    return h;
+}
+
+
+/* Pick the number of hash buckets like GNU ld does. */
+static unsigned int hashBucketCount(unsigned int nsyms)
+{
+    static const unsigned int buckets[] = {
+        1, 3, 17, 37, 67, 97, 131, 197, 263, 521, 1031, 2053, 4099, 8209,
+        16411, 32771, 65537, 131101, 262147, 0
+    };
+    unsigned int best = 1;
+    for (unsigned int i = 0; buckets[i]; i++) {
+        best = buckets[i];
+        if (nsyms < buckets[i + 1]) break;
+    }
+    return best;
+}
+
+
+template<ElfFileParams>
+void ElfFile<ElfFileParamNames>::addGnuHash()
+{
+    Phase phase(stats, "add-gnu-hash");
+
+    if (rdi(hdr->e_machine) == EM_MIPS)
+        error("cannot reorder the dynamic symbol table of MIPS objects");
+
+    unsigned int dynsymIndex = findSection3(".dynsym");
+    if (!dynsymIndex) error("cannot find section '.dynsym'");
+    assert(!haveReplacedSection(".dynsym"));
+
+    Elf_Shdr & shdrDynsym = shdrs[dynsymIndex];
+    Elf_Shdr & shdrDynStr = shdrs[rdi(shdrDynsym.sh_link)];
+    Elf_Sym * syms = (Elf_Sym *) sectionContents(shdrDynsym);
+    char * strTab = (char *) sectionContents(shdrDynStr);
+    size_t strSize = rdi(shdrDynStr.sh_size);
+    if (strSize == 0 || strTab[strSize - 1] != 0)
+        error("dynamic string table is not zero terminated");
+    unsigned int nsyms = rdi(shdrDynsym.sh_size) / sizeof(Elf_Sym);
+    if (nsyms == 0) error("empty dynamic symbol table");
+    for (unsigned int i = 0; i < nsyms; ++i)
+        if (rdi(syms[i].st_name) >= strSize)
+            error("symbol name offset out of bounds");
+
+    /* Defined global symbols go into the hash table, and must come
+       after all other symbols, sorted by bucket.  Local and undefined
+       symbols stay in front, in their original order. */
+    std::vector<unsigned int> unhashed, hashed;
+    for (unsigned int i = 1; i < nsyms; ++i)
+        if (rdi(syms[i].st_shndx) == SHN_UNDEF || ELF32_ST_BIND(rdi(syms[i].st_info)) == STB_LOCAL)
+            unhashed.push_back(i);
+        else
+            hashed.push_back(i);
+
+    unsigned int nbuckets = hashBucketCount(hashed.size());
+    std::vector<uint32_t> hashes(nsyms);
+    for (auto i : hashed)
+        hashes[i] = gnuHash(strTab + rdi(syms[i].st_name));
+    std::stable_sort(hashed.begin(), hashed.end(),
+        [&](unsigned int x, unsigned int y) { return hashes[x] % nbuckets < hashes[y] % nbuckets; });
+
+    std::vector<unsigned int> newToOld(1, 0);
+    newToOld.insert(newToOld.end(), unhashed.begin(), unhashed.end());
+    newToOld.insert(newToOld.end(), hashed.begin(), hashed.end());
+    std::vector<unsigned int> oldToNew(nsyms);
+    bool identity = true;
+    for (unsigned int i = 0; i < nsyms; ++i) {
+        oldToNew[newToOld[i]] = i;
+        if (newToOld[i] != i) identity = false;
+    }
+    unsigned int symOffset = 1 + unhashed.size();
+
+    /* Reorder .dynsym, and everything that refers to symbols by
+       index: the symbol version table, the relocations and the SysV
+       hash table. */
+    if (!identity) {
+        debug("reordering dynamic symbol table\n");
+
+        std::vector<Elf_Sym> oldSyms(syms, syms + nsyms);
+        for (unsigned int i = 0; i < nsyms; ++i)
+            syms[i] = oldSyms[newToOld[i]];
+
+        for (unsigned int i = 1; i < rdi(hdr->e_shnum); ++i) {
+            Elf_Shdr & shdr = shdrs[i];
+            if (rdi(shdr.sh_link) != dynsymIndex) continue;
+            unsigned int type = rdi(shdr.sh_type);
+            unsigned char * data = sectionContents(shdr);
+            if (haveReplacedSection(getSectionName(shdr)))
+                error("cannot reorder symbols referenced by replaced section '" + getSectionName(shdr) + "'");
+
+            if (type == SHT_GNU_versym) {
+                uint16_t * versyms = (uint16_t *) data;
+                if ((size_t) nsyms * 2 > rdi(shdr.sh_size))
+                    error("malformed .gnu.version section");
+                std::vector<uint16_t> oldVersyms(versyms, versyms + nsyms);
+                for (unsigned int j = 0; j < nsyms; ++j)
+                    versyms[j] = oldVersyms[newToOld[j]];
+            }
+
+            else if (type == SHT_REL || type == SHT_RELA) {
+                size_t entSize = type == SHT_REL ? sizeof(Elf_Rel) : sizeof(Elf_Rela);
+                unsigned int symShift = sizeof(Elf_Addr) == 4 ? 8 : 32;
+                for (size_t off = 0; off + entSize <= rdi(shdr.sh_size); off += entSize) {
+                    Elf_Rel * rel = (Elf_Rel *) (data + off);
+                    unsigned long long info = rdi(rel->r_info);
+                    unsigned long long sym = info >> symShift;
+                    if (sym >= nsyms) error("relocation refers to a non-existent symbol");
+                    info = ((unsigned long long) oldToNew[sym] << symShift) | (info & ((1ULL << symShift) - 1));
+                    wri(rel->r_info, info);
+                }
+            }
+
+            else if (type == SHT_HASH) {
+                if (rdi(shdr.sh_entsize) != 4)
+                    error("unsupported .hash entry size");
+                uint32_t * words = (uint32_t *) data;
+                if (rdi(shdr.sh_size) < 8)
+                    error("malformed .hash section");
+                unsigned int nbucket = rdi(words[0]);
+                uint32_t * bucket = words + 2, * chain = bucket + nbucket;
+                if (nbucket == 0 || rdi(words[1]) != nsyms ||
+                    (2 + (size_t) nbucket + nsyms) * 4 > rdi(shdr.sh_size))
+                    error("malformed .hash section");
+                memset(bucket, 0, (nbucket + nsyms) * 4);
+                for (unsigned int j = 1; j < nsyms; ++j) {
+                    unsigned int b = sysvHash(strTab + rdi(syms[j].st_name)) % nbucket;
+                    chain[j] = bucket[b];
+                    wri(bucket[b], j);
+                }
+            }
+
+            else if (type != SHT_GNU_HASH)
+                error("cannot reorder symbols referenced by section '" + getSectionName(shdr) + "'");
+        }
+    }
+
+    /* Build the bloom filter parameters like GNU ld does. */
+    unsigned int wordBitsLog2 = sizeof(Elf_Addr) == 8 ? 6 : 5;
+    unsigned int maskBitsLog2 = 0;
+    while ((1U << maskBitsLog2) < hashed.size()) maskBitsLog2++;
+    maskBitsLog2++;
+    if (maskBitsLog2 < 3) maskBitsLog2 = 5;
+    else if ((1U << (maskBitsLog2 - 2)) & hashed.size()) maskBitsLog2 += 3;
+    else maskBitsLog2 += 2;
+    if (maskBitsLog2 < wordBitsLog2) maskBitsLog2 = wordBitsLog2;
+    unsigned int bloomSize = 1U << (maskBitsLog2 - wordBitsLog2);
+
+    size_t size = 4 * 4 + bloomSize * sizeof(Elf_Addr) + nbuckets * 4 + hashed.size() * 4;
+
+    if (!findSection3(".gnu.hash"))
+        addSection(".gnu.hash", SHT_GNU_HASH, SHF_ALLOC, dynsymIndex);
+    std::string & newGnuHash = replaceSection(".gnu.hash", size);
+    memset(&newGnuHash[0], 0, size);
+
+    uint32_t * header = (uint32_t *) &newGnuHash[0];
+    wri(header[0], nbuckets);
+    wri(header[1], symOffset);
+    wri(header[2], bloomSize);
+    wri(header[3], maskBitsLog2);
+
+    Elf_Addr * bloom = (Elf_Addr *) (header + 4);
+    uint32_t * buckets = (uint32_t *) (bloom + bloomSize);
+    uint32_t * chain = buckets + nbuckets;
+    unsigned int wordBits = 8 * sizeof(Elf_Addr);
+
+    for (unsigned int i = symOffset; i < nsyms; ++i) {
+        uint32_t h = hashes[newToOld[i]];
+        unsigned int b = h % nbuckets;
+
+        Elf_Addr & word = bloom[(h / wordBits) % bloomSize];
+        wri(word, rdi(word)
+            | ((Elf_Addr) 1 << (h % wordBits))
+            | ((Elf_Addr) 1 << ((h >> maskBitsLog2) % wordBits)));
+
+        if (rdi(buckets[b]) == 0) wri(buckets[b], i);
+
+        /* The lowest bit marks the end of a chain. */
+        bool last = i + 1 == nsyms || hashes[newToOld[i + 1]] % nbuckets != b;
+        wri(chain[i - symOffset], (h & ~1U) | (last ? 1 : 0));
+    }
+
+    /* Make sure there is a DT_GNU_HASH entry; rewriteHeaders() will
+       fill in its address. */
+    loadDynamic();
+    if (!dynEntry(DT_GNU_HASH))
+        insertDynamic(0, DT_GNU_HASH, 0);
+
+    changed = true;
+}
+
+
+/* Apply the operations in the order in which Operations lists them. */
+template<class ElfFile>
+static Result patchElf2(ElfFile && elfFile, const Operations & ops)
+{
+    /* Do this first: it reorders .dynsym and the sections referring
+       to it in place, which mustn't have been replaced yet. */
+    if (ops.addGnuHash)
+        elfFile.addGnuHash();
+
+    if (ops.printInterpreter)
+        elfFile.result.interpreter = elfFile.getInterpreter();
+
+    if (ops.printSoname)
+        elfFile.modifySoname(elfFile.printSoname, "");
+
+    if (ops.setSoname)
+        elfFile.modifySoname(elfFile.replaceSoname, ops.newSoname);
+
+    if (ops.newInterpreter != "")
+        elfFile.setInterpreter(ops.newInterpreter);
+
+    if (ops.printRPath)
+        elfFile.modifyRPath(elfFile.rpPrint, {}, "");
+
+    if (ops.shrinkRPath)
+        elfFile.modifyRPath(elfFile.rpShrink, ops.allowedRpathPrefixes, "");
+    else if (ops.removeRPath)
+        elfFile.modifyRPath(elfFile.rpRemove, {}, "");
+    else if (ops.setRPath)
+        elfFile.modifyRPath(elfFile.rpSet, {}, ops.newRPath);
+
+    if (ops.printNeeded) elfFile.printNeededLibs();
+
+    elfFile.removeNeeded(ops.neededLibsToRemove);
+    elfFile.replaceNeeded(ops.neededLibsToReplace);
+    elfFile.addNeeded(ops.neededLibsToAdd);
+
+    if (ops.flagsToSet || ops.flagsToClear || ops.flags1ToSet || ops.flags1ToClear)
+        elfFile.modifyFlags(ops.flagsToSet, ops.flagsToClear, ops.flags1ToSet, ops.flags1ToClear);
+
+    /* All the edits of .dynamic and .dynstr were made to the plan;
+       write them out at once, compacting .dynstr first if asked. */
+    elfFile.commitDynamic(ops.compactDynStr);
+
+    if (elfFile.isChanged() || ops.gc)
+        elfFile.rewriteSections();
+
+    if (elfFile.isChanged()) {
+        elfFile.result.changed = true;
+        elfFile.result.fileShift = elfFile.getFileShift();
+    }
+
+    return elfFile.result;
+}
+
+
+Result patchElfContents(FileContents contents, const Operations & ops, Stats * stats)
+{
+    if (getElfType(contents).is32Bit)
+        return patchElf2(ElfFile<Elf32_Ehdr, Elf32_Phdr, Elf32_Shdr, Elf32_Addr, Elf32_Off, Elf32_Dyn, Elf32_Sym, Elf32_Verneed, Elf32_Rel, Elf32_Rela>(contents, ops, stats), ops);
+    else
+        return patchElf2(ElfFile<Elf64_Ehdr, Elf64_Phdr, Elf64_Shdr, Elf64_Addr, Elf64_Off, Elf64_Dyn, Elf64_Sym, Elf64_Verneed, Elf64_Rel, Elf64_Rela>(contents, ops, stats), ops);
+}
+
+
+FileContents patchElfBuffer(const unsigned char * data, size_t size, const Operations & ops,
+    Result * result, Stats * stats)
+{
+    FileContents contents = std::make_shared<std::vector<unsigned char>>();
+    contents->reserve(size + 32 * 1024 * 1024);
+    contents->assign(data, data + size);
+
+    Result res = patchElfContents(contents, ops, stats);
+    if (result) *result = res;
+
+    return contents;
+}
+
+
+Result patchElfFd(int fd, const Operations & ops, Stats * stats)
+{
+    FileContents contents;
+    {
+        Phase phase(stats, "read");
+        contents = readFd(fd, fmt("file descriptor ", fd));
+    }
+    if (stats) stats->bytesRead += contents->size();
+
+    Result result = patchElfContents(contents, ops, stats);
+
+    if (result.changed)
+        writeFd(fd, contents, stats);
+
+    return result;
+}
+
+}
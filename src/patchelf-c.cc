@@ -0,0 +1,298 @@
+/*
+ *  The C interface of libpatchelf: a handle around the contents of a
+ *  file and an Operations, and exceptions turned into status codes.
+ */
+
+#include <string>
+#include <vector>
+#include <new>
+
+#include "patchelf.h"
+#include "patchelf-c.h"
+#include "util.h"
+
+using namespace patchelf;
+
+
+struct patchelf_handle
+{
+    FileContents contents;
+    Operations ops;
+
+    /* What the last query returned. */
+    Result result;
+    std::vector<const char *> needed;
+};
+
+
+static thread_local std::string lastError;
+
+
+static patchelf_status fail(patchelf_status status, const std::string & msg)
+{
+    lastError = msg;
+    return status;
+}
+
+
+/* Run 'f', turning the exceptions of libpatchelf into a status.
+   error() throws a SysError if errno is set, so clear what an earlier
+   call left there. */
+template<typename F>
+static patchelf_status guard(F f)
+{
+    errno = 0;
+    try {
+        f();
+        return PATCHELF_OK;
+    } catch (SysError & e) {
+        return fail(PATCHELF_ERR_IO, e.what());
+    } catch (std::bad_alloc & e) {
+        return fail(PATCHELF_ERR_NO_MEMORY, "out of memory");
+    } catch (std::runtime_error & e) {
+        return fail(PATCHELF_ERR_FORMAT, e.what());
+    } catch (std::exception & e) {
+        return fail(PATCHELF_ERR_INTERNAL, e.what());
+    } catch (...) {
+        return fail(PATCHELF_ERR_INTERNAL, "unknown error");
+    }
+}
+
+
+#define CHECK_ARG(cond) \
+    do { if (!(cond)) return fail(PATCHELF_ERR_INVALID_ARGUMENT, "invalid argument: " #cond); } while (0)
+
+
+/* Check that the contents are an ELF file patchelf can handle. */
+static patchelf_status openContents(FileContents contents, patchelf_handle ** handle)
+{
+    patchelf_handle * h = nullptr;
+    patchelf_status status = guard([&]() {
+        patchElfContents(contents, Operations());
+        h = new patchelf_handle;
+        h->contents = contents;
+    });
+    if (status == PATCHELF_OK) *handle = h;
+    return status;
+}
+
+
+patchelf_status patchelf_open_mem(const void * data, size_t size, patchelf_handle ** handle)
+{
+    CHECK_ARG(data || !size);
+    CHECK_ARG(handle);
+    FileContents contents;
+    patchelf_status status = guard([&]() {
+        contents = std::make_shared<std::vector<unsigned char>>();
+        contents->reserve(size + 32 * 1024 * 1024);
+        contents->assign((const unsigned char *) data, (const unsigned char *) data + size);
+    });
+    return status == PATCHELF_OK ? openContents(contents, handle) : status;
+}
+
+
+patchelf_status patchelf_open_fd(int fd, patchelf_handle ** handle)
+{
+    CHECK_ARG(fd >= 0);
+    CHECK_ARG(handle);
+    FileContents contents;
+    patchelf_status status = guard([&]() {
+        contents = readFd(fd, fmt("file descriptor ", fd));
+    });
+    return status == PATCHELF_OK ? openContents(contents, handle) : status;
+}
+
+
+void patchelf_close(patchelf_handle * handle)
+{
+    delete handle;
+}
+
+
+patchelf_status patchelf_set_interpreter(patchelf_handle * handle, const char * interpreter)
+{
+    CHECK_ARG(handle);
+    CHECK_ARG(interpreter && *interpreter);
+    return guard([&]() { handle->ops.newInterpreter = interpreter; });
+}
+
+
+patchelf_status patchelf_set_soname(patchelf_handle * handle, const char * soname)
+{
+    CHECK_ARG(handle);
+    CHECK_ARG(soname);
+    return guard([&]() {
+        handle->ops.setSoname = true;
+        handle->ops.newSoname = soname;
+    });
+}
+
+
+patchelf_status patchelf_set_rpath(patchelf_handle * handle, const char * rpath)
+{
+    CHECK_ARG(handle);
+    CHECK_ARG(rpath);
+    return guard([&]() {
+        handle->ops.removeRPath = false;
+        handle->ops.setRPath = true;
+        handle->ops.newRPath = rpath;
+    });
+}
+
+
+patchelf_status patchelf_remove_rpath(patchelf_handle * handle)
+{
+    CHECK_ARG(handle);
+    handle->ops.setRPath = false;
+    handle->ops.removeRPath = true;
+    return PATCHELF_OK;
+}
+
+
+patchelf_status patchelf_force_rpath(patchelf_handle * handle, int force)
+{
+    CHECK_ARG(handle);
+    handle->ops.forceRPath = force != 0;
+    return PATCHELF_OK;
+}
+
+
+patchelf_status patchelf_add_needed(patchelf_handle * handle, const char * name)
+{
+    CHECK_ARG(handle);
+    CHECK_ARG(name && *name);
+    return guard([&]() { handle->ops.neededLibsToAdd.insert(name); });
+}
+
+
+patchelf_status patchelf_remove_needed(patchelf_handle * handle, const char * name)
+{
+    CHECK_ARG(handle);
+    CHECK_ARG(name && *name);
+    return guard([&]() { handle->ops.neededLibsToRemove.insert(name); });
+}
+
+
+patchelf_status patchelf_replace_needed(patchelf_handle * handle, const char * oldName, const char * newName)
+{
+    CHECK_ARG(handle);
+    CHECK_ARG(oldName && *oldName);
+    CHECK_ARG(newName && *newName);
+    return guard([&]() { handle->ops.neededLibsToReplace[oldName] = newName; });
+}
+
+
+/* Run the print operation that 'set' selects on the contents. */
+template<typename F>
+static patchelf_status query(patchelf_handle * handle, F set)
+{
+    return guard([&]() {
+        Operations ops;
+        set(ops);
+        handle->result = patchElfContents(handle->contents, ops);
+    });
+}
+
+
+patchelf_status patchelf_get_interpreter(patchelf_handle * handle, const char ** interpreter)
+{
+    CHECK_ARG(handle);
+    CHECK_ARG(interpreter);
+    patchelf_status status = query(handle, [](Operations & ops) { ops.printInterpreter = true; });
+    if (status == PATCHELF_OK) *interpreter = handle->result.interpreter.c_str();
+    return status;
+}
+
+
+patchelf_status patchelf_get_soname(patchelf_handle * handle, const char ** soname)
+{
+    CHECK_ARG(handle);
+    CHECK_ARG(soname);
+    patchelf_status status = query(handle, [](Operations & ops) { ops.printSoname = true; });
+    if (status == PATCHELF_OK) *soname = handle->result.soname.c_str();
+    return status;
+}
+
+
+patchelf_status patchelf_get_rpath(patchelf_handle * handle, const char ** rpath)
+{
+    CHECK_ARG(handle);
+    CHECK_ARG(rpath);
+    patchelf_status status = query(handle, [](Operations & ops) { ops.printRPath = true; });
+    if (status == PATCHELF_OK) *rpath = handle->result.rpath.c_str();
+    return status;
+}
+
+
+patchelf_status patchelf_get_needed(patchelf_handle * handle, const char * const ** names, size_t * count)
+{
+    CHECK_ARG(handle);
+    CHECK_ARG(names);
+    CHECK_ARG(count);
+    patchelf_status status = query(handle, [](Operations & ops) { ops.printNeeded = true; });
+    if (status != PATCHELF_OK) return status;
+    status = guard([&]() {
+        handle->needed.clear();
+        for (auto & i : handle->result.needed)
+            handle->needed.push_back(i.c_str());
+    });
+    if (status != PATCHELF_OK) return status;
+    *names = handle->needed.data();
+    *count = handle->needed.size();
+    return PATCHELF_OK;
+}
+
+
+patchelf_status patchelf_commit(patchelf_handle * handle)
+{
+    CHECK_ARG(handle);
+
+    /* Patch a copy, so that a failure leaves the contents alone. */
+    Operations ops = std::move(handle->ops);
+    handle->ops = Operations();
+    return guard([&]() {
+        auto & old = *handle->contents;
+        handle->contents = patchElfBuffer(old.data(), old.size(), ops);
+    });
+}
+
+
+patchelf_status patchelf_get_data(patchelf_handle * handle, const void ** data, size_t * size)
+{
+    CHECK_ARG(handle);
+    CHECK_ARG(data);
+    CHECK_ARG(size);
+    *data = handle->contents->data();
+    *size = handle->contents->size();
+    return PATCHELF_OK;
+}
+
+
+patchelf_status patchelf_commit_to_fd(patchelf_handle * handle, int fd)
+{
+    CHECK_ARG(handle);
+    CHECK_ARG(fd >= 0);
+    patchelf_status status = patchelf_commit(handle);
+    if (status != PATCHELF_OK) return status;
+    return guard([&]() { writeFd(fd, handle->contents); });
+}
+
+
+const char * patchelf_error_message(void)
+{
+    return lastError.c_str();
+}
+
+
+const char * patchelf_strerror(patchelf_status status)
+{
+    switch (status) {
+        case PATCHELF_OK: return "success";
+        case PATCHELF_ERR_INVALID_ARGUMENT: return "invalid argument";
+        case PATCHELF_ERR_FORMAT: return "invalid or unsupported ELF file";
+        case PATCHELF_ERR_IO: return "input/output error";
+        case PATCHELF_ERR_NO_MEMORY: return "out of memory";
+        case PATCHELF_ERR_INTERNAL: return "internal error";
+    }
+    return "unknown status";
+}
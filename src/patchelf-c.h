@@ -0,0 +1,112 @@
+/*
+ *  The C interface of libpatchelf, for programs in other languages
+ *  that call it through a foreign function interface.
+ *  Copyright (C) 2004-2016  Eelco Dolstra <edolstra@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or (at
+ *  your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PATCHELF_C_H
+#define PATCHELF_C_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/* A file being patched: its contents, and the edits not yet
+   committed.
+
+   Thread safety: the functions use no global state, so different
+   handles can be used from different threads at the same time.  A
+   single handle must not be used by two threads at once without
+   locking.  The error message (see patchelf_error_message()) is kept
+   per thread. */
+typedef struct patchelf_handle patchelf_handle;
+
+
+/* Every function that can fail returns one of these.  No exception
+   ever escapes. */
+typedef enum
+{
+    PATCHELF_OK = 0,
+    PATCHELF_ERR_INVALID_ARGUMENT, /* e.g. a null pointer */
+    PATCHELF_ERR_FORMAT,           /* not a valid ELF file, or an edit it doesn't allow */
+    PATCHELF_ERR_IO,               /* a system call failed */
+    PATCHELF_ERR_NO_MEMORY,
+    PATCHELF_ERR_INTERNAL
+} patchelf_status;
+
+
+/* Open a copy of the 'size' bytes at 'data'; they're not used after
+   the call returns. */
+patchelf_status patchelf_open_mem(const void * data, size_t size, patchelf_handle ** handle);
+
+/* Open the file open for reading on 'fd', reading it from the start.
+   The descriptor is not kept. */
+patchelf_status patchelf_open_fd(int fd, patchelf_handle ** handle);
+
+/* Free a handle and everything returned for it.  Null is allowed. */
+void patchelf_close(patchelf_handle * handle);
+
+
+/* Queue an edit.  Edits are applied together by patchelf_commit(), in
+   the order of patchelf's command line options, not of the calls. */
+patchelf_status patchelf_set_interpreter(patchelf_handle * handle, const char * interpreter);
+patchelf_status patchelf_set_soname(patchelf_handle * handle, const char * soname);
+patchelf_status patchelf_set_rpath(patchelf_handle * handle, const char * rpath);
+patchelf_status patchelf_remove_rpath(patchelf_handle * handle);
+/* Set DT_RPATH rather than DT_RUNPATH, like --force-rpath. */
+patchelf_status patchelf_force_rpath(patchelf_handle * handle, int force);
+patchelf_status patchelf_add_needed(patchelf_handle * handle, const char * name);
+patchelf_status patchelf_remove_needed(patchelf_handle * handle, const char * name);
+patchelf_status patchelf_replace_needed(patchelf_handle * handle, const char * oldName, const char * newName);
+
+
+/* Query the contents as of the last commit.  The strings stay valid
+   until the next call on the handle.  A file without DT_SONAME or
+   RPATH gives an empty string. */
+patchelf_status patchelf_get_interpreter(patchelf_handle * handle, const char ** interpreter);
+patchelf_status patchelf_get_soname(patchelf_handle * handle, const char ** soname);
+patchelf_status patchelf_get_rpath(patchelf_handle * handle, const char ** rpath);
+patchelf_status patchelf_get_needed(patchelf_handle * handle, const char * const ** names, size_t * count);
+
+
+/* Apply the queued edits.  If that fails, the contents are left as
+   they were; the queued edits are dropped either way. */
+patchelf_status patchelf_commit(patchelf_handle * handle);
+
+/* The current contents, valid until the next call on the handle. */
+patchelf_status patchelf_get_data(patchelf_handle * handle, const void ** data, size_t * size);
+
+/* Commit, then overwrite the file open for writing on 'fd' with the
+   contents from the start, and truncate it. */
+patchelf_status patchelf_commit_to_fd(patchelf_handle * handle, int fd);
+
+
+/* The message of the last error in the calling thread, or an empty
+   string. */
+const char * patchelf_error_message(void);
+
+/* A description of 'status'. */
+const char * patchelf_strerror(patchelf_status status);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -15,7 +15,6 @@
  *  You should have received a copy of the GNU General Public License
  *  along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
-
 #include <string>
 #include <vector>
 #include <set>
@@ -25,6 +24,10 @@
 #include <sstream>
 #include <limits>
 #include <stdexcept>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
 
 #include <cstdlib>
 #include <cstdio>
@@ -32,1594 +35,1459 @@
 #include <cassert>
 #include <cstring>
 #include <cerrno>
+#include <ctime>
+#include <cinttypes>
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <dirent.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
 
 #include "elf.h"
 
+#include "patchelf.h"
+#include "util.h"
 
-static bool debugMode = false;
+using namespace patchelf;
 
-static bool forceRPath = false;
 
+/* How much debug output to print (see debug() in util.h). */
+static int logLevel = logNone;
 static std::vector<std::string> fileNames;
-static int pageSize = PAGESIZE;
-
-typedef std::shared_ptr<std::vector<unsigned char>> FileContents;
-
 
-#define ElfFileParams class Elf_Ehdr, class Elf_Phdr, class Elf_Shdr, class Elf_Addr, class Elf_Off, class Elf_Dyn, class Elf_Sym, class Elf_Verneed
-#define ElfFileParamNames Elf_Ehdr, Elf_Phdr, Elf_Shdr, Elf_Addr, Elf_Off, Elf_Dyn, Elf_Sym, Elf_Verneed
 
-
-static std::vector<std::string> splitColonDelimitedString(const char * s)
+static std::string jsonString(const std::string & s)
 {
-    std::vector<std::string> parts;
-    const char * pos = s;
-    while (*pos) {
-        const char * end = strchr(pos, ':');
-        if (!end) end = strchr(pos, 0);
-
-        parts.push_back(std::string(pos, end - pos));
-        if (*end == ':') ++end;
-        pos = end;
+    std::string res = "\"";
+    for (char c : s) {
+        if (c == '"' || c == '\\') res += '\\';
+        if ((unsigned char) c < 0x20)
+            res += fmt("\\u00", "0123456789abcdef"[c >> 4], "0123456789abcdef"[c & 15]);
+        else
+            res += c;
     }
-
-    return parts;
+    return res + '"';
 }
 
-static bool hasAllowedPrefix(const std::string & s, const std::vector<std::string> & allowedPrefixes)
-{
-    for (auto & i : allowedPrefixes)
-        if (!s.compare(0, i.size(), i)) return true;
-    return false;
-}
 
+static enum { statsNone, statsText, statsJson } statsMode = statsNone;
 
-static unsigned int getPageSize()
-{
-    return pageSize;
-}
+/* With --recursive, files are patched in several threads; each has
+   its own fileStats, which are added to totalStats when done. */
+static thread_local Stats fileStats;
+static Stats totalStats;
+static std::mutex totalStatsMutex;
 
 
-template<ElfFileParams>
-class ElfFile
+/* The --trace output: Chrome trace-event JSON, which can be loaded
+   into chrome://tracing or Perfetto.  Events are written as they
+   complete; the closing bracket is written at exit. */
+static struct TraceFile
 {
-public:
-
-    const FileContents fileContents;
-
-private:
-
-    unsigned char * contents;
-
-    Elf_Ehdr * hdr;
-    std::vector<Elf_Phdr> phdrs;
-    std::vector<Elf_Shdr> shdrs;
-
-    bool littleEndian;
-
-    bool changed = false;
-
-    bool isExecutable = false;
-
-    typedef std::string SectionName;
-    typedef std::map<SectionName, std::string> ReplacedSections;
-
-    ReplacedSections replacedSections;
-
-    std::string sectionNames; /* content of the .shstrtab section */
-
-    /* Align on 4 or 8 bytes boundaries on 32- or 64-bit platforms
-       respectively. */
-    size_t sectionAlignment = sizeof(Elf_Off);
+    FILE * file = 0;
+    bool first = true;
+    std::mutex mutex;
 
-    std::vector<SectionName> sectionsByOldIndex;
-
-public:
-
-    ElfFile(FileContents fileContents);
-
-    bool isChanged()
+    void open(const std::string & fileName)
     {
-        return changed;
+        file = fopen(fileName.c_str(), "w");
+        if (!file) throw SysError(fmt("opening '", fileName, "'"));
+        fputs("{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n", file);
     }
 
-private:
-
-    struct CompPhdr
+    /* Write a complete ('X') event; times are in milliseconds. */
+    void event(const std::string & name, const char * category, double startMs, double durationMs)
     {
-        ElfFile * elfFile;
-        bool operator ()(const Elf_Phdr & x, const Elf_Phdr & y)
-        {
-            // A PHDR comes before everything else.
-            if (y.p_type == PT_PHDR) return false;
-            if (x.p_type == PT_PHDR) return true;
-
-            // Sort non-PHDRs by address.
-            return elfFile->rdi(x.p_paddr) < elfFile->rdi(y.p_paddr);
-        }
-    };
-
-    friend struct CompPhdr;
-
-    void sortPhdrs();
+        std::lock_guard<std::mutex> lock(mutex);
+        fputs(fmt(first ? "" : ",\n", "{\"name\": ", jsonString(name),
+            ", \"cat\": \"", category, "\", \"ph\": \"X\", \"ts\": ", (long long) (startMs * 1e3),
+            ", \"dur\": ", (long long) (durationMs * 1e3), ", \"pid\": ", getpid(),
+            ", \"tid\": ", syscall(SYS_gettid), "}").c_str(), file);
+        first = false;
+    }
 
-    struct CompShdr
+    ~TraceFile()
     {
-        ElfFile * elfFile;
-        bool operator ()(const Elf_Shdr & x, const Elf_Shdr & y)
-        {
-            return elfFile->rdi(x.sh_offset) < elfFile->rdi(y.sh_offset);
+        if (file) {
+            fputs("\n]}\n", file);
+            fclose(file);
         }
-    };
-
-    friend struct CompShdr;
-
-    void sortShdrs();
-
-    void shiftFile(unsigned int extraPages, Elf_Addr startPage);
-
-    std::string getSectionName(const Elf_Shdr & shdr);
-
-    Elf_Shdr & findSection(const SectionName & sectionName);
-
-    Elf_Shdr * findSection2(const SectionName & sectionName);
-
-    unsigned int findSection3(const SectionName & sectionName);
-
-    std::string & replaceSection(const SectionName & sectionName,
-        unsigned int size);
-
-    bool haveReplacedSection(const SectionName & sectionName);
-
-    void writeReplacedSections(Elf_Off & curOff,
-        Elf_Addr startAddr, Elf_Off startOffset);
-
-    void rewriteHeaders(Elf_Addr phdrAddress);
-
-    void rewriteSectionsLibrary();
-
-    void rewriteSectionsExecutable();
-
-public:
-
-    void rewriteSections();
-
-    std::string getInterpreter();
-
-    typedef enum { printSoname, replaceSoname } sonameMode;
-
-    void modifySoname(sonameMode op, const std::string & newSoname);
-
-    void setInterpreter(const std::string & newInterpreter);
-
-    typedef enum { rpPrint, rpShrink, rpSet, rpRemove } RPathOp;
-
-    void modifyRPath(RPathOp op, const std::vector<std::string> & allowedRpathPrefixes, std::string newRPath);
-
-    void addNeeded(const std::set<std::string> & libs);
-
-    void removeNeeded(const std::set<std::string> & libs);
-
-    void replaceNeeded(const std::map<std::string, std::string> & libs);
-
-    void printNeededLibs();
+    }
+} traceFile;
 
-    void noDefaultLib();
 
-private:
+static void traceEvent(const std::string & name, const char * category, double startMs, double durationMs)
+{
+    traceFile.event(name, category, startMs, durationMs);
+}
 
-    /* Convert an integer in big or little endian representation (as
-       specified by the ELF header) to this platform's integer
-       representation. */
-    template<class I>
-    I rdi(I i);
 
-    /* Convert back to the ELF representation. */
-    template<class I>
-    I wri(I & t, unsigned long long i)
-    {
-        t = rdi((I) i);
-        return i;
-    }
-};
+/* The statistics to collect for the current file, if any. */
+static Stats * currentStats()
+{
+    if (statsMode == statsNone && !traceFile.file) return 0;
+    if (traceFile.file) fileStats.trace = traceEvent;
+    return &fileStats;
+}
 
 
-/* !!! G++ creates broken code if this function is inlined, don't know
-   why... */
-template<ElfFileParams>
-template<class I>
-I ElfFile<ElfFileParamNames>::rdi(I i)
+/* Print the statistics for one file, or if fileName is empty, the
+   total for 'files' files. */
+static void printStats(const std::string & fileName, unsigned int files, const Stats & stats)
 {
-    I r = 0;
-    if (littleEndian) {
-        for (unsigned int n = 0; n < sizeof(I); ++n) {
-            r |= ((I) *(((unsigned char *) &i) + n)) << (n * 8);
-        }
-    } else {
-        for (unsigned int n = 0; n < sizeof(I); ++n) {
-            r |= ((I) *(((unsigned char *) &i) + n)) << ((sizeof(I) - n - 1) * 8);
-        }
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    if (statsMode == statsJson) {
+        std::string s = fileName.empty()
+            ? fmt("{\"files\": ", files)
+            : "{\"file\": " + jsonString(fileName);
+        s += ", \"phases\": {";
+        for (auto & i : stats.phases)
+            s += fmt(&i == &stats.phases[0] ? "" : ", ", jsonString(i.name),
+                ": {\"wall_ms\": ", i.wallMs, ", \"cpu_ms\": ", i.cpuMs, "}");
+        s += fmt("}, \"bytes_read\": ", stats.bytesRead,
+            ", \"bytes_written\": ", stats.bytesWritten,
+            ", \"bytes_copied\": ", stats.bytesCopied,
+            ", \"bytes_grown\": ", stats.bytesGrown,
+            ", \"sections_replaced\": ", stats.sectionsReplaced,
+            ", \"segments_added\": ", stats.segmentsAdded,
+            ", \"peak_rss_kb\": ", usage.ru_maxrss, "}\n");
+        fputs(s.c_str(), stderr);
+        return;
     }
-    return r;
+
+    if (fileName.empty())
+        fprintf(stderr, "patchelf: statistics for %u files:\n", files);
+    else
+        fprintf(stderr, "patchelf: statistics for '%s':\n", fileName.c_str());
+    fprintf(stderr, "  %-20s %12s %12s\n", "phase", "wall ms", "cpu ms");
+    for (auto & i : stats.phases)
+        fprintf(stderr, "  %-20s %12.3f %12.3f\n", i.name.c_str(), i.wallMs, i.cpuMs);
+    fprintf(stderr, "  bytes read %llu, written %llu (%llu of them copied), grown %lld\n",
+        (unsigned long long) stats.bytesRead, (unsigned long long) stats.bytesWritten,
+        (unsigned long long) stats.bytesCopied, (long long) stats.bytesGrown);
+    fprintf(stderr, "  sections replaced %u, segments added %u\n",
+        stats.sectionsReplaced, stats.segmentsAdded);
+    fprintf(stderr, "  peak RSS %ld KiB\n", usage.ru_maxrss);
 }
 
 
-/* Ugly: used to erase DT_RUNPATH when using --force-rpath. */
-#define DT_IGNORE       0x00726e67
+/* The operations to apply, from the command line. */
+static Operations ops;
 
+static bool fromStdin = false;
+static std::string outputFileName; /* "-" for standard output */
+static bool tarMode = false;
+static bool zipMode = false;
+static std::vector<std::string> recursiveDirs;
+static unsigned int jobs = 0; /* 0 means one per CPU */
 
-static void debug(const char * format, ...)
+static void endFileStats(const std::string & fileName)
 {
-    if (debugMode) {
-        va_list ap;
-        va_start(ap, format);
-        vfprintf(stderr, format, ap);
-        va_end(ap);
+    if (fileStats.bytesWritten)
+        fileStats.bytesGrown = fileStats.bytesWritten - fileStats.bytesRead;
+
+    if (statsMode != statsNone) {
+        std::lock_guard<std::mutex> lock(totalStatsMutex);
+        printStats(fileName, 0, fileStats);
+        totalStats.add(fileStats);
+        fileStats.clear();
     }
 }
 
 
-void fmt2(std::ostringstream & out)
-{
-}
+/* --incremental: a state file that records, for every file that was
+   patched, its metadata afterwards and a hash of the operations.  A
+   rerun with the same operations then skips the file after a stat()
+   if its device, inode, size, mtime and ctime are unchanged.
 
+   An entry is ambiguous ("racy") if the file's ctime is within one
+   tick of the kernel's timestamp clock of when the entry was
+   recorded: the file may have been modified again without its
+   timestamps changing.  That is the case for every file just written,
+   so before saving, the state waits for the clock to tick (a few
+   milliseconds) and checks those files once more; the rest are
+   processed again, or with --incremental-verify, skipped if their
+   first block still has the recorded hash. */
 
-template<typename T, typename... Args>
-void fmt2(std::ostringstream & out, T x, Args... args)
+static uint64_t fnv1a(const void * data, size_t size, uint64_t hash = 0xcbf29ce484222325ULL)
 {
-    out << x;
-    fmt2(out, args...);
+    for (size_t i = 0; i < size; ++i)
+        hash = (hash ^ ((const unsigned char *) data)[i]) * 0x100000001b3ULL;
+    return hash;
 }
 
 
-template<typename... Args>
-std::string fmt(Args... args)
+/* A hash of everything that determines what patchFile() does. */
+static uint64_t hashOperations()
 {
     std::ostringstream out;
-    fmt2(out, args...);
-    return out.str();
+    out << "interpreter " << ops.newInterpreter << '\0'
+        << "soname " << ops.setSoname << ops.newSoname << '\0'
+        << "rpath " << ops.shrinkRPath << ops.removeRPath << ops.setRPath << ops.forceRPath << ops.newRPath << '\0';
+    for (auto & i : ops.allowedRpathPrefixes) out << "allowed " << i << '\0';
+    for (auto & i : ops.neededLibsToRemove) out << "remove-needed " << i << '\0';
+    for (auto & i : ops.neededLibsToReplace) out << "replace-needed " << i.first << '\0' << i.second << '\0';
+    for (auto & i : ops.neededLibsToAdd) out << "add-needed " << i << '\0';
+    out << "flags " << ops.flagsToSet << ' ' << ops.flagsToClear << ' ' << ops.flags1ToSet << ' ' << ops.flags1ToClear << '\0'
+        << "gnu-hash " << ops.addGnuHash << '\0'
+        << "compact-dynstr " << ops.compactDynStr << '\0'
+        << "layout " << ops.pageSize << ' ' << ops.segmentAlign << ' ' << ops.gc << '\0';
+    std::string s = out.str();
+    return fnv1a(s.data(), s.size());
 }
 
 
-struct SysError : std::runtime_error
-{
-    int errNo;
-    SysError(const std::string & msg)
-        : std::runtime_error(fmt(msg + ": " + strerror(errno)))
-        , errNo(errno)
-    { }
-};
+static const size_t headerHashSize = 4096;
 
 
-__attribute__((noreturn)) static void error(std::string msg)
+static uint64_t nanoseconds(const struct timespec & ts)
 {
-    if (errno)
-        throw SysError(msg);
-    else
-        throw std::runtime_error(msg);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
 
-static void growFile(FileContents contents, size_t newSize)
+/* How much later than a change to a file another change must be for
+   the file's ctime to tell them apart: a tick of the clock the kernel
+   stamps files with, with some margin, or 2 seconds if 'timeNs' has no
+   sub-second part, as on file systems like FAT. */
+static uint64_t timestampGranularity(uint64_t timeNs)
 {
-    if (newSize > contents->capacity()) error("maximum file size exceeded");
-    if (newSize <= contents->size()) return;
-    contents->resize(newSize, 0);
+    if (timeNs % 1000000000 == 0) return 2000000000;
+#ifdef CLOCK_REALTIME_COARSE
+    struct timespec res;
+    if (clock_getres(CLOCK_REALTIME_COARSE, &res) == 0 && nanoseconds(res) < 500000000)
+        return 2 * nanoseconds(res);
+#endif
+    return 1000000000;
 }
 
 
-static FileContents readFile(std::string fileName,
-    size_t cutOff = std::numeric_limits<size_t>::max())
+static class IncrementalState
 {
-    struct stat st;
-    if (stat(fileName.c_str(), &st) != 0)
-        throw SysError(fmt("getting info about '", fileName, "'"));
-
-    if ((uint64_t) st.st_size > (uint64_t) std::numeric_limits<size_t>::max())
-        throw SysError(fmt("cannot read file of size ", st.st_size, " into memory"));
-
-    size_t size = std::min(cutOff, (size_t) st.st_size);
-
-    FileContents contents = std::make_shared<std::vector<unsigned char>>();
-    contents->reserve(size + 32 * 1024 * 1024);
-    contents->resize(size, 0);
-
-    int fd = open(fileName.c_str(), O_RDONLY);
-    if (fd == -1) throw SysError(fmt("opening '", fileName, "'"));
-
-    size_t bytesRead = 0;
-    ssize_t portion;
-    while ((portion = read(fd, contents->data() + bytesRead, size - bytesRead)) > 0)
-        bytesRead += portion;
+    struct Entry
+    {
+        uint64_t size, mtimeNs, ctimeNs, recordedNs, opsHash, headerHash;
+        std::string result; /* "patched" or "unchanged" */
+        std::string path; /* if recorded by this run; not saved */
+    };
 
-    if (bytesRead != size)
-        throw SysError(fmt("reading '", fileName, "'"));
+    static bool ambiguous(const Entry & e)
+    {
+        return e.ctimeNs + timestampGranularity(e.ctimeNs) > e.recordedNs;
+    }
 
-    close(fd);
+    static bool sameFile(const Entry & e, const struct stat & st)
+    {
+        return e.size == (uint64_t) st.st_size &&
+            e.mtimeNs == nanoseconds(st.st_mtim) && e.ctimeNs == nanoseconds(st.st_ctim);
+    }
 
-    return contents;
-}
+    std::string fileName;
+    uint64_t opsHash = 0;
+    std::map<std::pair<dev_t, ino_t>, Entry> entries;
+    std::mutex mutex;
 
+public:
 
-struct ElfType
-{
-    bool is32Bit;
-    int machine; // one of EM_*
-};
+    bool verify = false;
 
+    bool enabled() const
+    {
+        return !fileName.empty();
+    }
 
-ElfType getElfType(const FileContents & fileContents)
-{
-    /* Check the ELF header for basic validity. */
-    if (fileContents->size() < (off_t) sizeof(Elf32_Ehdr)) error("missing ELF header");
+    void load(const std::string & fileName)
+    {
+        this->fileName = fileName;
+        opsHash = hashOperations();
 
-    auto contents = fileContents->data();
+        FILE * file = fopen(fileName.c_str(), "r");
+        if (!file) {
+            if (errno == ENOENT) return;
+            throw SysError(fmt("opening '", fileName, "'"));
+        }
 
-    if (memcmp(contents, ELFMAG, SELFMAG) != 0)
-        error("not an ELF executable");
+        int version = 0;
+        if (fscanf(file, "patchelf-incremental %d\n", &version) != 1 || version != 1) {
+            fclose(file);
+            errno = 0;
+            error(fmt("'", fileName, "' is not a patchelf state file"));
+        }
 
-    if (contents[EI_VERSION] != EV_CURRENT)
-        error("unsupported ELF version");
+        unsigned long long dev, ino;
+        Entry e;
+        char result[16];
+        while (fscanf(file, "%llu %llu %" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNx64 " %" SCNx64 " %15s\n",
+                &dev, &ino, &e.size, &e.mtimeNs, &e.ctimeNs, &e.recordedNs, &e.opsHash, &e.headerHash, result) == 9)
+        {
+            e.result = result;
+            entries[{dev, ino}] = e;
+        }
 
-    if (contents[EI_CLASS] != ELFCLASS32 && contents[EI_CLASS] != ELFCLASS64)
-        error("ELF executable is not 32 or 64 bit");
+        fclose(file);
+    }
 
-    bool is32Bit = contents[EI_CLASS] == ELFCLASS32;
+    /* Whether 'path' is known to need no patching. */
+    bool upToDate(const std::string & path)
+    {
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0) return false;
 
-    // FIXME: endianness
-    return ElfType{is32Bit, is32Bit ? ((Elf32_Ehdr *) contents)->e_machine : ((Elf64_Ehdr *) contents)->e_machine};
-}
+        Entry e;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto i = entries.find({st.st_dev, st.st_ino});
+            if (i == entries.end()) return false;
+            e = i->second;
+        }
 
+        if (e.opsHash != opsHash || !sameFile(e, st))
+            return false;
 
-static void checkPointer(const FileContents & contents, void * p, unsigned int size)
-{
-    unsigned char * q = (unsigned char *) p;
-    assert(q >= contents->data() && q + size <= contents->data() + contents->size());
-}
+        if (ambiguous(e)) {
+            if (!verify) {
+                debug("'%s' may have changed since it was %s, patching it again\n", path.c_str(), e.result.c_str());
+                return false;
+            }
+            struct timespec now;
+            clock_gettime(CLOCK_REALTIME, &now);
+            FileContents header = readFile(path, headerHashSize);
+            if (fnv1a(header->data(), header->size()) != e.headerHash) return false;
+
+            /* Verified now, so it's no longer ambiguous. */
+            std::lock_guard<std::mutex> lock(mutex);
+            entries[{st.st_dev, st.st_ino}].recordedNs = nanoseconds(now);
+        }
 
+        debug("skipping '%s', %s before\n", path.c_str(), e.result.c_str());
+        return true;
+    }
 
-template<ElfFileParams>
-ElfFile<ElfFileParamNames>::ElfFile(FileContents fileContents)
-    : fileContents(fileContents)
-    , contents(fileContents->data())
-{
-    /* Check the ELF header for basic validity. */
-    if (fileContents->size() < (off_t) sizeof(Elf_Ehdr)) error("missing ELF header");
+    /* Record the state of 'path' after patching it to 'contents'. */
+    void record(const std::string & path, const FileContents & contents, bool changed)
+    {
+        /* The time goes first: a change after it that the stat()
+           doesn't see gets a later ctime, unless the entry is
+           ambiguous. */
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0) return;
+
+        Entry e;
+        e.size = st.st_size;
+        e.mtimeNs = nanoseconds(st.st_mtim);
+        e.ctimeNs = nanoseconds(st.st_ctim);
+        e.recordedNs = nanoseconds(now);
+        e.opsHash = opsHash;
+        e.headerHash = fnv1a(contents->data(), std::min(contents->size(), headerHashSize));
+        e.result = changed ? "patched" : "unchanged";
+        e.path = path;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        entries[{st.st_dev, st.st_ino}] = e;
+    }
 
-    hdr = (Elf_Ehdr *) fileContents->data();
+    /* Make the entries recorded by this run that are ambiguous, since
+       the files were just written, unambiguous if they can be: wait
+       until the timestamp clock has ticked past them, and then check
+       that each file is still as recorded. */
+    void settle()
+    {
+        uint64_t until = 0;
+        for (auto & i : entries) {
+            auto & e = i.second;
+            if (!e.path.empty() && ambiguous(e) && timestampGranularity(e.ctimeNs) < 1000000000)
+                until = std::max(until, e.ctimeNs + timestampGranularity(e.ctimeNs));
+        }
+        if (!until) return;
+
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        if (nanoseconds(now) < until) {
+            struct timespec delay;
+            delay.tv_sec = (until - nanoseconds(now)) / 1000000000;
+            delay.tv_nsec = (until - nanoseconds(now)) % 1000000000;
+            nanosleep(&delay, 0);
+        }
 
-    if (memcmp(hdr->e_ident, ELFMAG, SELFMAG) != 0)
-        error("not an ELF executable");
+        for (auto & i : entries) {
+            auto & e = i.second;
+            if (e.path.empty() || !ambiguous(e)) continue;
+            clock_gettime(CLOCK_REALTIME, &now);
+            struct stat st;
+            if (stat(e.path.c_str(), &st) != 0 || st.st_dev != i.first.first ||
+                st.st_ino != i.first.second || !sameFile(e, st))
+                continue;
+            try {
+                FileContents header = readFile(e.path, headerHashSize);
+                if (fnv1a(header->data(), header->size()) != e.headerHash) continue;
+            } catch (SysError &) {
+                continue;
+            }
+            e.recordedNs = nanoseconds(now);
+        }
+    }
 
-    littleEndian = hdr->e_ident[EI_DATA] == ELFDATA2LSB;
+    /* Write the state file, atomically replacing the old one. */
+    void save()
+    {
+        settle();
+
+        std::string tmpName = fileName + ".tmp";
+        FILE * file = fopen(tmpName.c_str(), "w");
+        if (!file) throw SysError(fmt("creating '", tmpName, "'"));
+
+        fprintf(file, "patchelf-incremental 1\n");
+        for (auto & i : entries) {
+            auto & e = i.second;
+            fprintf(file, "%llu %llu %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 " %016" PRIx64 " %016" PRIx64 " %s\n",
+                (unsigned long long) i.first.first, (unsigned long long) i.first.second,
+                e.size, e.mtimeNs, e.ctimeNs, e.recordedNs, e.opsHash, e.headerHash, e.result.c_str());
+        }
 
-    if (rdi(hdr->e_type) != ET_EXEC && rdi(hdr->e_type) != ET_DYN)
-        error("wrong ELF type");
+        if (fclose(file) != 0 || rename(tmpName.c_str(), fileName.c_str()) != 0)
+            throw SysError(fmt("writing '", fileName, "'"));
+    }
+} incrementalState;
 
-    if ((size_t) (rdi(hdr->e_phoff) + rdi(hdr->e_phnum) * rdi(hdr->e_phentsize)) > fileContents->size())
-        error("program header table out of bounds");
 
-    if (rdi(hdr->e_shnum) == 0)
-        error("no section headers. The input file is probably a statically linked, self-decompressing binary");
+static void patchFile(const std::string & fileName)
+{
+    Phase fileSpan(currentStats(), "file", fileName);
 
-    if ((size_t) (rdi(hdr->e_shoff) + rdi(hdr->e_shnum) * rdi(hdr->e_shentsize)) > fileContents->size())
-        error("section header table out of bounds");
+    if (incrementalState.enabled() && incrementalState.upToDate(fileName))
+        return;
 
-    if (rdi(hdr->e_phentsize) != sizeof(Elf_Phdr))
-        error("program headers have wrong size");
+    if (!ops.printInterpreter && !ops.printRPath && !ops.printSoname && !ops.printNeeded)
+        debug("patching ELF file '%s'\n", fileName.c_str());
 
-    /* Copy the program and section headers. */
-    for (int i = 0; i < rdi(hdr->e_phnum); ++i) {
-        phdrs.push_back(* ((Elf_Phdr *) (contents + rdi(hdr->e_phoff)) + i));
-        if (rdi(phdrs[i].p_type) == PT_INTERP) isExecutable = true;
+    FileContents fileContents;
+    {
+        Phase phase(currentStats(), "read");
+        fileContents = fromStdin ? readStdin() : readFile(fileName);
+    }
+    fileStats.bytesRead = fileContents->size();
+
+    Result result = patchElfContents(fileContents, ops, currentStats());
+
+    if (ops.printInterpreter)
+        printf("%s\n", result.interpreter.c_str());
+    if (ops.printSoname && !result.soname.empty())
+        printf("%s\n", result.soname.c_str());
+    if (ops.printRPath)
+        printf("%s\n", result.rpath.c_str());
+    for (auto & i : result.needed)
+        printf("%s\n", i.c_str());
+
+    if (result.changed && outputFileName.empty()) {
+        if (fromStdin) error("nowhere to write the result to, use --stdout or --output");
+        writeFile(fileName, fileContents, currentStats());
     }
 
-    for (int i = 0; i < rdi(hdr->e_shnum); ++i)
-        shdrs.push_back(* ((Elf_Shdr *) (contents + rdi(hdr->e_shoff)) + i));
+    if (incrementalState.enabled())
+        incrementalState.record(fileName, fileContents, result.changed);
 
-    /* Get the section header string table section (".shstrtab").  Its
-       index in the section header table is given by e_shstrndx field
-       of the ELF header. */
-    unsigned int shstrtabIndex = rdi(hdr->e_shstrndx);
-    assert(shstrtabIndex < shdrs.size());
-    unsigned int shstrtabSize = rdi(shdrs[shstrtabIndex].sh_size);
-    char * shstrtab = (char * ) contents + rdi(shdrs[shstrtabIndex].sh_offset);
-    checkPointer(fileContents, shstrtab, shstrtabSize);
+    /* With an explicit output, always write it, even if nothing
+       changed: that's a copy, or a filter passing the file through. */
+    if (outputFileName == "-")
+        writeStdout(fileContents, currentStats());
+    else if (!outputFileName.empty())
+        writeOutputFile(outputFileName, fileContents, fromStdin ? "" : fileName,
+            result.fileShift, currentStats());
 
-    assert(shstrtabSize > 0);
-    assert(shstrtab[shstrtabSize - 1] == 0);
+    endFileStats(fileName);
+}
 
-    sectionNames = std::string(shstrtab, shstrtabSize);
 
-    sectionsByOldIndex.resize(hdr->e_shnum);
-    for (unsigned int i = 1; i < rdi(hdr->e_shnum); ++i)
-        sectionsByOldIndex[i] = getSectionName(shdrs[i]);
-}
+/* --tar: patch the ELF members of a tar archive (ustar, pax or GNU)
+   read from standard input, and write the archive to standard output
+   in a single pass.  Only ELF members are read into memory; the rest
+   of the archive is copied through, without going through user space
+   if one side is a pipe. */
+
+static const size_t tarBlockSize = 512;
 
 
-template<ElfFileParams>
-void ElfFile<ElfFileParamNames>::sortPhdrs()
+/* Read up to 'size' bytes from 'fd'; less only at the end of the file. */
+static size_t readFull(int fd, unsigned char * data, size_t size)
 {
-    /* Sort the segments by offset. */
-    CompPhdr comp;
-    comp.elfFile = this;
-    sort(phdrs.begin(), phdrs.end(), comp);
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = read(fd, data + done, size - done);
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1) throw SysError("reading standard input");
+        if (n == 0) break;
+        done += n;
+    }
+    return done;
 }
 
 
-template<ElfFileParams>
-void ElfFile<ElfFileParamNames>::sortShdrs()
+static void writeAll(int fd, const unsigned char * data, size_t size)
 {
-    /* Translate sh_link mappings to section names, since sorting the
-       sections will invalidate the sh_link fields. */
-    std::map<SectionName, SectionName> linkage;
-    for (unsigned int i = 1; i < rdi(hdr->e_shnum); ++i)
-        if (rdi(shdrs[i].sh_link) != 0)
-            linkage[getSectionName(shdrs[i])] = getSectionName(shdrs[rdi(shdrs[i].sh_link)]);
-
-    /* Idem for sh_info on certain sections. */
-    std::map<SectionName, SectionName> info;
-    for (unsigned int i = 1; i < rdi(hdr->e_shnum); ++i)
-        if (rdi(shdrs[i].sh_info) != 0 &&
-            (rdi(shdrs[i].sh_type) == SHT_REL || rdi(shdrs[i].sh_type) == SHT_RELA))
-            info[getSectionName(shdrs[i])] = getSectionName(shdrs[rdi(shdrs[i].sh_info)]);
-
-    /* Idem for the index of the .shstrtab section in the ELF header. */
-    SectionName shstrtabName = getSectionName(shdrs[rdi(hdr->e_shstrndx)]);
-
-    /* Sort the sections by offset. */
-    CompShdr comp;
-    comp.elfFile = this;
-    sort(shdrs.begin(), shdrs.end(), comp);
-
-    /* Restore the sh_link mappings. */
-    for (unsigned int i = 1; i < rdi(hdr->e_shnum); ++i)
-        if (rdi(shdrs[i].sh_link) != 0)
-            wri(shdrs[i].sh_link,
-                findSection3(linkage[getSectionName(shdrs[i])]));
-
-    /* And the st_info mappings. */
-    for (unsigned int i = 1; i < rdi(hdr->e_shnum); ++i)
-        if (rdi(shdrs[i].sh_info) != 0 &&
-            (rdi(shdrs[i].sh_type) == SHT_REL || rdi(shdrs[i].sh_type) == SHT_RELA))
-            wri(shdrs[i].sh_info,
-                findSection3(info[getSectionName(shdrs[i])]));
-
-    /* And the .shstrtab index. */
-    wri(hdr->e_shstrndx, findSection3(shstrtabName));
+    fileStats.bytesWritten += size;
+    while (size > 0) {
+        ssize_t n = write(fd, data, size);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) error("write");
+        data += n;
+        size -= n;
+    }
 }
 
 
-static void writeFile(std::string fileName, FileContents contents)
+static void readTarData(unsigned char * data, size_t size)
 {
-    int fd = open(fileName.c_str(), O_TRUNC | O_WRONLY);
-    if (fd == -1)
-        error("open");
-
-    size_t bytesWritten = 0;
-    ssize_t portion;
-    while ((portion = write(fd, contents->data() + bytesWritten, contents->size() - bytesWritten)) > 0)
-        bytesWritten += portion;
-
-    if (bytesWritten != contents->size())
-        error("write");
-
-    if (close(fd) != 0)
-        error("close");
+    if (readFull(0, data, size) != size) error("unexpected end of tar archive");
+    fileStats.bytesRead += size;
 }
 
 
-static unsigned int roundUp(unsigned int n, unsigned int m)
+/* Copy 'size' bytes from standard input to standard output, or
+   everything up to the end of the input if 'size' is the maximum. */
+static void passThrough(uint64_t size)
 {
-    return ((n - 1) / m + 1) * m;
+    bool toEnd = size == std::numeric_limits<uint64_t>::max();
+
+#ifdef HAVE_SPLICE
+    static bool unsupported = false;
+    while (!unsupported && size > 0) {
+        ssize_t n = splice(0, 0, 1, 0, std::min(size, (uint64_t) 1 << 30), SPLICE_F_MOVE);
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1 && (errno == EINVAL || errno == ENOSYS)) {
+            /* Neither side is a pipe. */
+            unsupported = true;
+            break;
+        }
+        if (n == -1) throw SysError("copying standard input to standard output");
+        if (n == 0) {
+            if (toEnd) return;
+            error("unexpected end of tar archive");
+        }
+        size -= n;
+        fileStats.bytesRead += n;
+        fileStats.bytesWritten += n;
+        fileStats.bytesCopied += n;
+    }
+#endif
+
+    std::vector<unsigned char> buf(std::min(size, (uint64_t) 1 << 20));
+    while (size > 0) {
+        size_t wanted = std::min(size, (uint64_t) buf.size());
+        size_t n = readFull(0, buf.data(), wanted);
+        writeAll(1, buf.data(), n);
+        fileStats.bytesRead += n;
+        size -= n;
+        if (n < wanted) {
+            if (toEnd) return;
+            error("unexpected end of tar archive");
+        }
+    }
 }
 
 
-template<ElfFileParams>
-void ElfFile<ElfFileParamNames>::shiftFile(unsigned int extraPages, Elf_Addr startPage)
+/* A numeric header field: octal, or GNU's base-256 encoding for values
+   that don't fit. */
+static uint64_t parseTarNumber(const unsigned char * field, size_t len)
 {
-    /* Move the entire contents of the file 'extraPages' pages
-       further. */
-    unsigned int oldSize = fileContents->size();
-    unsigned int shift = extraPages * getPageSize();
-    growFile(fileContents, fileContents->size() + extraPages * getPageSize());
-    memmove(contents + extraPages * getPageSize(), contents, oldSize);
-    memset(contents + sizeof(Elf_Ehdr), 0, shift - sizeof(Elf_Ehdr));
-
-    /* Adjust the ELF header. */
-    wri(hdr->e_phoff, sizeof(Elf_Ehdr));
-    wri(hdr->e_shoff, rdi(hdr->e_shoff) + shift);
-
-    /* Update the offsets in the section headers. */
-    for (int i = 1; i < rdi(hdr->e_shnum); ++i)
-        wri(shdrs[i].sh_offset, rdi(shdrs[i].sh_offset) + shift);
-
-    /* Update the offsets in the program headers. */
-    for (int i = 0; i < rdi(hdr->e_phnum); ++i) {
-        wri(phdrs[i].p_offset, rdi(phdrs[i].p_offset) + shift);
-        if (rdi(phdrs[i].p_align) != 0 &&
-            (rdi(phdrs[i].p_vaddr) - rdi(phdrs[i].p_offset)) % rdi(phdrs[i].p_align) != 0) {
-            debug("changing alignment of program header %d from %d to %d\n", i,
-                rdi(phdrs[i].p_align), getPageSize());
-            wri(phdrs[i].p_align, getPageSize());
-        }
+    uint64_t n = 0;
+    if (field[0] & 0x80) {
+        for (size_t i = 1; i < len; ++i) n = (n << 8) | field[i];
+        return n;
     }
-
-    /* Add a segment that maps the new program/section headers and
-       PT_INTERP segment into memory.  Otherwise glibc will choke. */
-    phdrs.resize(rdi(hdr->e_phnum) + 1);
-    wri(hdr->e_phnum, rdi(hdr->e_phnum) + 1);
-    Elf_Phdr & phdr = phdrs[rdi(hdr->e_phnum) - 1];
-    wri(phdr.p_type, PT_LOAD);
-    wri(phdr.p_offset, 0);
-    wri(phdr.p_vaddr, wri(phdr.p_paddr, startPage));
-    wri(phdr.p_filesz, wri(phdr.p_memsz, shift));
-    wri(phdr.p_flags, PF_R | PF_W);
-    wri(phdr.p_align, getPageSize());
+    size_t i = 0;
+    while (i < len && field[i] == ' ') ++i;
+    for ( ; i < len && field[i] >= '0' && field[i] <= '7'; ++i)
+        n = n * 8 + (field[i] - '0');
+    return n;
 }
 
 
-template<ElfFileParams>
-std::string ElfFile<ElfFileParamNames>::getSectionName(const Elf_Shdr & shdr)
+static uint64_t getTarSize(const unsigned char * header)
 {
-    return std::string(sectionNames.c_str() + rdi(shdr.sh_name));
+    return parseTarNumber(header + 124, 12);
 }
 
 
-template<ElfFileParams>
-Elf_Shdr & ElfFile<ElfFileParamNames>::findSection(const SectionName & sectionName)
+static void setTarSize(unsigned char * header, uint64_t size)
 {
-    Elf_Shdr * shdr = findSection2(sectionName);
-    if (!shdr) {
-        std::string extraMsg = "";
-        if (sectionName == ".interp" || sectionName == ".dynamic" || sectionName == ".dynstr")
-            extraMsg = ". The input file is most likely statically linked";
-        error("cannot find section '" + sectionName + "'" + extraMsg);
+    unsigned char * field = header + 124;
+    if (size < (uint64_t) 1 << 33) {
+        char buf[13];
+        snprintf(buf, sizeof(buf), "%011llo", (unsigned long long) size);
+        memcpy(field, buf, 12);
+    } else {
+        field[0] = 0x80;
+        for (int i = 11; i > 0; --i, size >>= 8) field[i] = size & 0xff;
     }
-    return *shdr;
 }
 
 
-template<ElfFileParams>
-Elf_Shdr * ElfFile<ElfFileParamNames>::findSection2(const SectionName & sectionName)
+/* The sum of the header bytes, with the checksum field as spaces.
+   Some old implementations summed signed characters. */
+static unsigned int tarChecksum(const unsigned char * header, bool isSigned = false)
 {
-    unsigned int i = findSection3(sectionName);
-    return i ? &shdrs[i] : 0;
+    unsigned int sum = 0;
+    for (size_t i = 0; i < tarBlockSize; ++i)
+        sum += i >= 148 && i < 156 ? ' ' : isSigned ? (signed char) header[i] : header[i];
+    return sum;
 }
 
 
-template<ElfFileParams>
-unsigned int ElfFile<ElfFileParamNames>::findSection3(const SectionName & sectionName)
+static void setTarChecksum(unsigned char * header)
 {
-    for (unsigned int i = 1; i < rdi(hdr->e_shnum); ++i)
-        if (getSectionName(shdrs[i]) == sectionName) return i;
-    return 0;
+    char buf[8];
+    snprintf(buf, sizeof(buf), "%06o", tarChecksum(header));
+    memcpy(header + 148, buf, 7);
+    header[155] = ' ';
 }
 
-template<ElfFileParams>
-bool ElfFile<ElfFileParamNames>::haveReplacedSection(const SectionName & sectionName)
+
+/* A pax extended header ('x') or GNU long name ('L', 'K') preceding a
+   member.  They're held back until the member has been patched, since
+   a pax header may record its size. */
+struct TarExtension
 {
-    ReplacedSections::iterator i = replacedSections.find(sectionName);
+    unsigned char header[tarBlockSize];
+    std::string data;
+};
 
-    if (i != replacedSections.end())
-        return true;
-    return false;
-}
 
-template<ElfFileParams>
-std::string & ElfFile<ElfFileParamNames>::replaceSection(const SectionName & sectionName,
-    unsigned int size)
+static std::vector<std::pair<std::string, std::string>> parsePaxRecords(const std::string & data)
 {
-    ReplacedSections::iterator i = replacedSections.find(sectionName);
-    std::string s;
-
-    if (i != replacedSections.end()) {
-        s = std::string(i->second);
-    } else {
-        Elf_Shdr & shdr = findSection(sectionName);
-        s = std::string((char *) contents + rdi(shdr.sh_offset), rdi(shdr.sh_size));
+    std::vector<std::pair<std::string, std::string>> records;
+    size_t pos = 0;
+    while (pos < data.size() && data[pos] != '\0') {
+        size_t space = data.find(' ', pos);
+        size_t len = space == std::string::npos ? 0 : strtoull(data.c_str() + pos, 0, 10);
+        size_t eq = space == std::string::npos ? std::string::npos : data.find('=', space);
+        if (!len || pos + len > data.size() || eq >= pos + len || data[pos + len - 1] != '\n')
+            error("invalid pax extended header");
+        records.push_back({data.substr(space + 1, eq - space - 1),
+            data.substr(eq + 1, pos + len - 1 - (eq + 1))});
+        pos += len;
     }
-
-    s.resize(size);
-    replacedSections[sectionName] = s;
-
-    return replacedSections[sectionName];
+    return records;
 }
 
 
-template<ElfFileParams>
-void ElfFile<ElfFileParamNames>::writeReplacedSections(Elf_Off & curOff,
-    Elf_Addr startAddr, Elf_Off startOffset)
+/* Serialize the records; each starts with its own length in decimal,
+   including the length itself. */
+static std::string unparsePaxRecords(const std::vector<std::pair<std::string, std::string>> & records)
 {
-    /* Overwrite the old section contents with 'X's.  Do this
-       *before* writing the new section contents (below) to prevent
-       clobbering previously written new section contents. */
-    for (auto & i : replacedSections) {
-        std::string sectionName = i.first;
-        Elf_Shdr & shdr = findSection(sectionName);
-        memset(contents + rdi(shdr.sh_offset), 'X', rdi(shdr.sh_size));
-    }
-
-    for (auto & i : replacedSections) {
-        std::string sectionName = i.first;
-        Elf_Shdr & shdr = findSection(sectionName);
-        debug("rewriting section '%s' from offset 0x%x (size %d) to offset 0x%x (size %d)\n",
-            sectionName.c_str(), rdi(shdr.sh_offset), rdi(shdr.sh_size), curOff, i.second.size());
-
-        memcpy(contents + curOff, (unsigned char *) i.second.c_str(),
-            i.second.size());
-
-        /* Update the section header for this section. */
-        wri(shdr.sh_offset, curOff);
-        wri(shdr.sh_addr, startAddr + (curOff - startOffset));
-        wri(shdr.sh_size, i.second.size());
-        wri(shdr.sh_addralign, sectionAlignment);
-
-        /* If this is the .interp section, then the PT_INTERP segment
-           must be sync'ed with it. */
-        if (sectionName == ".interp") {
-            for (unsigned int j = 0; j < phdrs.size(); ++j)
-                if (rdi(phdrs[j].p_type) == PT_INTERP) {
-                    phdrs[j].p_offset = shdr.sh_offset;
-                    phdrs[j].p_vaddr = phdrs[j].p_paddr = shdr.sh_addr;
-                    phdrs[j].p_filesz = phdrs[j].p_memsz = shdr.sh_size;
-                }
-        }
-
-        /* If this is the .dynamic section, then the PT_DYNAMIC segment
-           must be sync'ed with it. */
-        if (sectionName == ".dynamic") {
-            for (unsigned int j = 0; j < phdrs.size(); ++j)
-                if (rdi(phdrs[j].p_type) == PT_DYNAMIC) {
-                    phdrs[j].p_offset = shdr.sh_offset;
-                    phdrs[j].p_vaddr = phdrs[j].p_paddr = shdr.sh_addr;
-                    phdrs[j].p_filesz = phdrs[j].p_memsz = shdr.sh_size;
-                }
-        }
-
-        curOff += roundUp(i.second.size(), sectionAlignment);
+    std::string data;
+    for (auto & r : records) {
+        std::string body = " " + r.first + "=" + r.second + "\n";
+        size_t len = body.size() + 1;
+        while (std::to_string(len).size() + body.size() != len) ++len;
+        data += std::to_string(len) + body;
     }
-
-    replacedSections.clear();
+    return data;
 }
 
 
-template<ElfFileParams>
-void ElfFile<ElfFileParamNames>::rewriteSectionsLibrary()
+static std::string tarMemberName(const unsigned char * header, const std::vector<TarExtension> & extensions)
 {
-    /* For dynamic libraries, we just place the replacement sections
-       at the end of the file.  They're mapped into memory by a
-       PT_LOAD segment located directly after the last virtual address
-       page of other segments. */
-    Elf_Addr startPage = 0;
-    for (unsigned int i = 0; i < phdrs.size(); ++i) {
-        Elf_Addr thisPage = roundUp(rdi(phdrs[i].p_vaddr) + rdi(phdrs[i].p_memsz), getPageSize());
-        if (thisPage > startPage) startPage = thisPage;
+    std::string name;
+    for (auto & e : extensions) {
+        if (e.header[156] == 'L')
+            name = e.data.substr(0, e.data.find('\0'));
+        else if (e.header[156] == 'x')
+            for (auto & r : parsePaxRecords(e.data))
+                if (r.first == "path") name = r.second;
     }
+    if (!name.empty()) return name;
 
-    debug("last page is 0x%llx\n", (unsigned long long) startPage);
-
-    /* Because we're adding a new section header, we're necessarily increasing
-       the size of the program header table.  This can cause the first section
-       to overlap the program header table in memory; we need to shift the first
-       few segments to someplace else. */
-    /* Some sections may already be replaced so account for that */
-    unsigned int i = 1;
-    Elf_Addr pht_size = sizeof(Elf_Ehdr) + (phdrs.size() + 1)*sizeof(Elf_Phdr);
-    while( shdrs[i].sh_addr <= pht_size && i < rdi(hdr->e_shnum) ) {
-        if (not haveReplacedSection(getSectionName(shdrs[i])))
-            replaceSection(getSectionName(shdrs[i]), shdrs[i].sh_size);
-        i++;
-    }
+    name = std::string((const char *) header, strnlen((const char *) header, 100));
+    if (memcmp(header + 257, "ustar\0", 6) == 0 && header[345])
+        name = std::string((const char *) header + 345, strnlen((const char *) header + 345, 155)) + "/" + name;
+    return name;
+}
 
-    /* Compute the total space needed for the replaced sections */
-    off_t neededSpace = 0;
-    for (auto & i : replacedSections)
-        neededSpace += roundUp(i.second.size(), sectionAlignment);
-    debug("needed space is %d\n", neededSpace);
-
-    size_t startOffset = roundUp(fileContents->size(), getPageSize());
-
-    growFile(fileContents, startOffset + neededSpace);
-
-    /* Even though this file is of type ET_DYN, it could actually be
-       an executable.  For instance, Gold produces executables marked
-       ET_DYN as does LD when linking with pie. If we move PT_PHDR, it
-       has to stay in the first PT_LOAD segment or any subsequent ones
-       if they're continuous in memory due to linux kernel constraints
-       (see BUGS). Since the end of the file would be after bss, we can't 
-       move PHDR there, we therefore choose to leave PT_PHDR where it is but
-       move enough following sections such that we can add the extra PT_LOAD
-       section to it. This PT_LOAD segment ensures the sections at the end of
-       the file are mapped into memory for ld.so to process.
-       We can't use the approach in rewriteSectionsExecutable()
-       since DYN executables tend to start at virtual address 0, so
-       rewriteSectionsExecutable() won't work because it doesn't have
-       any virtual address space to grow downwards into. */
-    if (isExecutable) {
-        if (startOffset >= startPage) {
-            debug("shifting new PT_LOAD segment by %d bytes to work around a Linux kernel bug\n", startOffset - startPage);
-        }
-        startPage = startOffset;
-    }
 
-    /* Add a segment that maps the replaced sections into memory. */
-    phdrs.resize(rdi(hdr->e_phnum) + 1);
-    wri(hdr->e_phnum, rdi(hdr->e_phnum) + 1);
-    Elf_Phdr & phdr = phdrs[rdi(hdr->e_phnum) - 1];
-    wri(phdr.p_type, PT_LOAD);
-    wri(phdr.p_offset, startOffset);
-    wri(phdr.p_vaddr, wri(phdr.p_paddr, startPage));
-    wri(phdr.p_filesz, wri(phdr.p_memsz, neededSpace));
-    wri(phdr.p_flags, PF_R | PF_W);
-    wri(phdr.p_align, getPageSize());
-
-
-    /* Write out the replaced sections. */
-    Elf_Off curOff = startOffset;
-    writeReplacedSections(curOff, startPage, startOffset);
-    assert(curOff == startOffset + neededSpace);
-
-    /* Write out the updated program and section headers */
-    rewriteHeaders(hdr->e_phoff);
+/* The size of the member's data: a pax 'size' record overrides the
+   header field. */
+static uint64_t tarMemberSize(const unsigned char * header, const std::vector<TarExtension> & extensions)
+{
+    uint64_t size = getTarSize(header);
+    for (auto & e : extensions)
+        if (e.header[156] == 'x')
+            for (auto & r : parsePaxRecords(e.data))
+                if (r.first == "size") size = strtoull(r.second.c_str(), 0, 10);
+    return size;
 }
 
 
-template<ElfFileParams>
-void ElfFile<ElfFileParamNames>::rewriteSectionsExecutable()
+static void writeTarPadding(uint64_t size)
 {
-    /* Sort the sections by offset, otherwise we won't correctly find
-       all the sections before the last replaced section. */
-    sortShdrs();
-
+    static const unsigned char zeroes[tarBlockSize] = {};
+    if (size % tarBlockSize) writeAll(1, zeroes, tarBlockSize - size % tarBlockSize);
+}
 
-    /* What is the index of the last replaced section? */
-    unsigned int lastReplaced = 0;
-    for (unsigned int i = 1; i < rdi(hdr->e_shnum); ++i) {
-        std::string sectionName = getSectionName(shdrs[i]);
-        if (replacedSections.find(sectionName) != replacedSections.end()) {
-            debug("using replaced section '%s'\n", sectionName.c_str());
-            lastReplaced = i;
-        }
-    }
 
-    assert(lastReplaced != 0);
-
-    debug("last replaced is %d\n", lastReplaced);
-
-    /* Try to replace all sections before that, as far as possible.
-       Stop when we reach an irreplacable section (such as one of type
-       SHT_PROGBITS).  These cannot be moved in virtual address space
-       since that would invalidate absolute references to them. */
-    assert(lastReplaced + 1 < shdrs.size()); /* !!! I'm lazy. */
-    size_t startOffset = rdi(shdrs[lastReplaced + 1].sh_offset);
-    Elf_Addr startAddr = rdi(shdrs[lastReplaced + 1].sh_addr);
-    std::string prevSection;
-    for (unsigned int i = 1; i <= lastReplaced; ++i) {
-        Elf_Shdr & shdr(shdrs[i]);
-        std::string sectionName = getSectionName(shdr);
-        debug("looking at section '%s'\n", sectionName.c_str());
-        /* !!! Why do we stop after a .dynstr section? I can't
-           remember! */
-        if ((rdi(shdr.sh_type) == SHT_PROGBITS && sectionName != ".interp")
-            || prevSection == ".dynstr")
-        {
-            startOffset = rdi(shdr.sh_offset);
-            startAddr = rdi(shdr.sh_addr);
-            lastReplaced = i - 1;
-            break;
-        } else {
-            if (replacedSections.find(sectionName) == replacedSections.end()) {
-                debug("replacing section '%s' which is in the way\n", sectionName.c_str());
-                replaceSection(sectionName, rdi(shdr.sh_size));
+/* Write the held-back extensions of a member whose data is now
+   'newSize' bytes, and clear them. */
+static void writeTarExtensions(std::vector<TarExtension> & extensions, uint64_t newSize)
+{
+    for (auto & e : extensions) {
+        if (e.header[156] == 'x') {
+            auto records = parsePaxRecords(e.data);
+            bool hasSize = false;
+            for (auto & r : records)
+                if (r.first == "size") {
+                    r.second = std::to_string(newSize);
+                    hasSize = true;
+                }
+            if (hasSize) {
+                e.data = unparsePaxRecords(records);
+                setTarSize(e.header, e.data.size());
+                setTarChecksum(e.header);
             }
         }
-        prevSection = sectionName;
-    }
-
-    debug("first reserved offset/addr is 0x%x/0x%llx\n",
-        startOffset, (unsigned long long) startAddr);
-
-    assert(startAddr % getPageSize() == startOffset % getPageSize());
-    Elf_Addr firstPage = startAddr - startOffset;
-    debug("first page is 0x%llx\n", (unsigned long long) firstPage);
-
-    if (rdi(hdr->e_shoff) < startOffset) {
-        /* The section headers occur too early in the file and would be
-           overwritten by the replaced sections. Move them to the end of the file
-           before proceeding. */
-        off_t shoffNew = fileContents->size();
-        off_t shSize = rdi(hdr->e_shoff) + rdi(hdr->e_shnum) * rdi(hdr->e_shentsize);
-        growFile(fileContents, fileContents->size() + shSize);
-        wri(hdr->e_shoff, shoffNew);
-
-        /* Rewrite the section header table.  For neatness, keep the
-           sections sorted. */
-        assert(rdi(hdr->e_shnum) == shdrs.size());
-        sortShdrs();
-        for (unsigned int i = 1; i < rdi(hdr->e_shnum); ++i)
-            * ((Elf_Shdr *) (contents + rdi(hdr->e_shoff)) + i) = shdrs[i];
+        writeAll(1, e.header, tarBlockSize);
+        writeAll(1, (const unsigned char *) e.data.data(), e.data.size());
+        writeTarPadding(e.data.size());
     }
+    extensions.clear();
+}
 
 
-    /* Compute the total space needed for the replaced sections, the
-       ELF header, and the program headers. */
-    size_t neededSpace = sizeof(Elf_Ehdr) + phdrs.size() * sizeof(Elf_Phdr);
-    for (auto & i : replacedSections)
-        neededSpace += roundUp(i.second.size(), sectionAlignment);
+/* Patch one ELF member, of which the first block has been read.  If
+   it can't be patched, it's passed through unchanged. */
+static void patchTarMember(unsigned char * header, std::vector<TarExtension> & extensions,
+    const std::string & name, uint64_t size, const unsigned char * firstBlock)
+{
+    Stats archiveStats = fileStats;
+    fileStats.clear();
 
-    debug("needed space is %d\n", neededSpace);
+    {
+        Phase fileSpan(currentStats(), "file", name);
 
-    /* If we need more space at the start of the file, then grow the
-       file by the minimum number of pages and adjust internal
-       offsets. */
-    if (neededSpace > startOffset) {
+        debug("patching tar member '%s'\n", name.c_str());
 
-        /* We also need an additional program header, so adjust for that. */
-        neededSpace += sizeof(Elf_Phdr);
-        debug("needed space is %d\n", neededSpace);
+        FileContents original = std::make_shared<std::vector<unsigned char>>();
+        {
+            Phase phase(currentStats(), "read");
+            original->reserve(size);
+            original->assign(firstBlock, firstBlock + std::min(size, (uint64_t) tarBlockSize));
+            original->resize(size);
+            if (size > tarBlockSize)
+                readTarData(original->data() + tarBlockSize, size - tarBlockSize);
+            unsigned char padding[tarBlockSize];
+            readTarData(padding, roundUp(size, tarBlockSize) - std::max(size, (uint64_t) tarBlockSize));
+        }
+        fileStats.bytesRead = size;
 
-        unsigned int neededPages = roundUp(neededSpace - startOffset, getPageSize()) / getPageSize();
-        debug("needed pages is %d\n", neededPages);
-        if (neededPages * getPageSize() > firstPage)
-            error("virtual address space underrun!");
+        FileContents contents = std::make_shared<std::vector<unsigned char>>();
+        contents->reserve(size + 32 * 1024 * 1024);
+        contents->assign(original->begin(), original->end());
 
-        firstPage -= neededPages * getPageSize();
-        startOffset += neededPages * getPageSize();
+        try {
+            patchElfContents(contents, ops, currentStats());
+        } catch (std::exception & e) {
+            fprintf(stderr, "patchelf: %s: %s; not patching it\n", name.c_str(), e.what());
+            contents = original;
+        }
 
-        shiftFile(neededPages, firstPage);
+        Phase phase(currentStats(), "write");
+        Stats memberStats = fileStats;
+        writeTarExtensions(extensions, contents->size());
+        setTarSize(header, contents->size());
+        setTarChecksum(header);
+        writeAll(1, header, tarBlockSize);
+        writeAll(1, contents->data(), contents->size());
+        writeTarPadding(contents->size());
+        /* Only count the member's own data. */
+        fileStats.bytesWritten = memberStats.bytesWritten + contents->size();
     }
 
+    endFileStats(name);
+    fileStats = archiveStats;
+}
 
-    /* Clear out the free space. */
-    Elf_Off curOff = sizeof(Elf_Ehdr) + phdrs.size() * sizeof(Elf_Phdr);
-    debug("clearing first %d bytes\n", startOffset - curOff);
-    memset(contents + curOff, 0, startOffset - curOff);
-
-
-    /* Write out the replaced sections. */
-    writeReplacedSections(curOff, firstPage, 0);
-    assert(curOff == neededSpace);
 
+/* Returns the number of ELF members. */
+static unsigned int patchTar()
+{
+    unsigned int members = 0;
+    std::vector<TarExtension> extensions;
+    unsigned char header[tarBlockSize];
+
+    while (true) {
+        size_t n = readFull(0, header, tarBlockSize);
+        fileStats.bytesRead += n;
+        if (n == 0) break; /* no end-of-archive marker */
+        if (n != tarBlockSize) error("unexpected end of tar archive");
+
+        if (std::all_of(header, header + tarBlockSize, [](unsigned char c) { return c == 0; })) {
+            /* The end-of-archive marker and the padding after it. */
+            writeTarExtensions(extensions, 0);
+            writeAll(1, header, tarBlockSize);
+            passThrough(std::numeric_limits<uint64_t>::max());
+            break;
+        }
 
-    rewriteHeaders(firstPage + rdi(hdr->e_phoff));
-}
+        unsigned int checksum = parseTarNumber(header + 148, 8);
+        if (checksum != tarChecksum(header) && checksum != tarChecksum(header, true))
+            error("invalid tar header checksum");
+
+        char type = header[156];
+        uint64_t size = getTarSize(header);
+
+        if (type == 'x' || type == 'L' || type == 'K') {
+            TarExtension e;
+            memcpy(e.header, header, tarBlockSize);
+            e.data.resize(roundUp(size, tarBlockSize));
+            readTarData((unsigned char *) &e.data[0], e.data.size());
+            e.data.resize(size);
+            extensions.push_back(e);
+            continue;
+        }
 
+        std::string name = tarMemberName(header, extensions);
+        size = tarMemberSize(header, extensions);
 
-template<ElfFileParams>
-void ElfFile<ElfFileParamNames>::rewriteSections()
-{
-    if (replacedSections.empty()) return;
-
-    for (auto & i : replacedSections)
-        debug("replacing section '%s' with size %d\n",
-            i.first.c_str(), i.second.size());
-
-    if (rdi(hdr->e_type) == ET_DYN) {
-        debug("this is a dynamic library\n");
-        rewriteSectionsLibrary();
-    } else if (rdi(hdr->e_type) == ET_EXEC) {
-        debug("this is an executable\n");
-        rewriteSectionsExecutable();
-    } else error("unknown ELF type");
-}
+        bool regular = type == '0' || type == '\0' || type == '7';
+        if (!regular || size < sizeof(Elf32_Ehdr)) {
+            verbose("copying tar member '%s'\n", name.c_str());
+            writeTarExtensions(extensions, size);
+            writeAll(1, header, tarBlockSize);
+            passThrough(roundUp(size, tarBlockSize));
+            continue;
+        }
 
+        unsigned char firstBlock[tarBlockSize];
+        readTarData(firstBlock, tarBlockSize);
 
-template<ElfFileParams>
-void ElfFile<ElfFileParamNames>::rewriteHeaders(Elf_Addr phdrAddress)
-{
-    /* Rewrite the program header table. */
-
-    /* If there is a segment for the program header table, update it.
-       (According to the ELF spec, there can only be one.) */
-    for (unsigned int i = 0; i < phdrs.size(); ++i) {
-        if (rdi(phdrs[i].p_type) == PT_PHDR) {
-            phdrs[i].p_offset = hdr->e_phoff;
-            wri(phdrs[i].p_vaddr, wri(phdrs[i].p_paddr, phdrAddress));
-            wri(phdrs[i].p_filesz, wri(phdrs[i].p_memsz, phdrs.size() * sizeof(Elf_Phdr)));
-            break;
+        if (memcmp(firstBlock, ELFMAG, SELFMAG) != 0) {
+            verbose("copying tar member '%s'\n", name.c_str());
+            writeTarExtensions(extensions, size);
+            writeAll(1, header, tarBlockSize);
+            writeAll(1, firstBlock, tarBlockSize);
+            passThrough(roundUp(size, tarBlockSize) - tarBlockSize);
+            continue;
         }
-    }
 
-    sortPhdrs();
-
-    for (unsigned int i = 0; i < phdrs.size(); ++i)
-        * ((Elf_Phdr *) (contents + rdi(hdr->e_phoff)) + i) = phdrs[i];
-
-
-    /* Rewrite the section header table.  For neatness, keep the
-       sections sorted. */
-    assert(rdi(hdr->e_shnum) == shdrs.size());
-    sortShdrs();
-    for (unsigned int i = 1; i < rdi(hdr->e_shnum); ++i)
-        * ((Elf_Shdr *) (contents + rdi(hdr->e_shoff)) + i) = shdrs[i];
-
-
-    /* Update all those nasty virtual addresses in the .dynamic
-       section.  Note that not all executables have .dynamic sections
-       (e.g., those produced by klibc's klcc). */
-    Elf_Shdr * shdrDynamic = findSection2(".dynamic");
-    if (shdrDynamic) {
-        Elf_Dyn * dyn = (Elf_Dyn *) (contents + rdi(shdrDynamic->sh_offset));
-        unsigned int d_tag;
-        for ( ; (d_tag = rdi(dyn->d_tag)) != DT_NULL; dyn++)
-            if (d_tag == DT_STRTAB)
-                dyn->d_un.d_ptr = findSection(".dynstr").sh_addr;
-            else if (d_tag == DT_STRSZ)
-                dyn->d_un.d_val = findSection(".dynstr").sh_size;
-            else if (d_tag == DT_SYMTAB)
-                dyn->d_un.d_ptr = findSection(".dynsym").sh_addr;
-            else if (d_tag == DT_HASH)
-                dyn->d_un.d_ptr = findSection(".hash").sh_addr;
-            else if (d_tag == DT_GNU_HASH)
-                dyn->d_un.d_ptr = findSection(".gnu.hash").sh_addr;
-            else if (d_tag == DT_JMPREL) {
-                Elf_Shdr * shdr = findSection2(".rel.plt");
-                if (!shdr) shdr = findSection2(".rela.plt"); /* 64-bit Linux, x86-64 */
-                if (!shdr) shdr = findSection2(".rela.IA_64.pltoff"); /* 64-bit Linux, IA-64 */
-                if (!shdr) error("cannot find section corresponding to DT_JMPREL");
-                dyn->d_un.d_ptr = shdr->sh_addr;
-            }
-            else if (d_tag == DT_REL) { /* !!! hack! */
-                Elf_Shdr * shdr = findSection2(".rel.dyn");
-                /* no idea if this makes sense, but it was needed for some
-                   program */
-                if (!shdr) shdr = findSection2(".rel.got");
-                /* some programs have neither section, but this doesn't seem
-                   to be a problem */
-                if (!shdr) continue;
-                dyn->d_un.d_ptr = shdr->sh_addr;
-            }
-            else if (d_tag == DT_RELA) {
-                Elf_Shdr * shdr = findSection2(".rela.dyn");
-                /* some programs lack this section, but it doesn't seem to
-                   be a problem */
-                if (!shdr) continue;
-                dyn->d_un.d_ptr = shdr->sh_addr;
-            }
-            else if (d_tag == DT_VERNEED)
-                dyn->d_un.d_ptr = findSection(".gnu.version_r").sh_addr;
-            else if (d_tag == DT_VERSYM)
-                dyn->d_un.d_ptr = findSection(".gnu.version").sh_addr;
+        patchTarMember(header, extensions, name, size, firstBlock);
+        members++;
     }
 
-
-    /* Rewrite the .dynsym section.  It contains the indices of the
-       sections in which symbols appear, so these need to be
-       remapped. */
-    for (unsigned int i = 1; i < rdi(hdr->e_shnum); ++i) {
-        if (rdi(shdrs[i].sh_type) != SHT_SYMTAB && rdi(shdrs[i].sh_type) != SHT_DYNSYM) continue;
-        debug("rewriting symbol table section %d\n", i);
-        for (size_t entry = 0; (entry + 1) * sizeof(Elf_Sym) <= rdi(shdrs[i].sh_size); entry++) {
-            Elf_Sym * sym = (Elf_Sym *) (contents + rdi(shdrs[i].sh_offset) + entry * sizeof(Elf_Sym));
-            unsigned int shndx = rdi(sym->st_shndx);
-            if (shndx != SHN_UNDEF && shndx < SHN_LORESERVE) {
-                if (shndx >= sectionsByOldIndex.size()) {
-                    fprintf(stderr, "warning: entry %d in symbol table refers to a non-existent section, skipping\n", shndx);
-                    continue;
-                }
-                std::string section = sectionsByOldIndex.at(shndx);
-                assert(!section.empty());
-                unsigned int newIndex = findSection3(section); // inefficient
-                //debug("rewriting symbol %d: index = %d (%s) -> %d\n", entry, shndx, section.c_str(), newIndex);
-                wri(sym->st_shndx, newIndex);
-                /* Rewrite st_value.  FIXME: we should do this for all
-                   types, but most don't actually change. */
-                if (ELF32_ST_TYPE(rdi(sym->st_info)) == STT_SECTION)
-                    wri(sym->st_value, rdi(shdrs[newIndex].sh_addr));
-            }
-        }
+    if (statsMode != statsNone) {
+        totalStats.add(fileStats);
+        fileStats.clear();
     }
+
+    return members;
 }
 
 
+/* --zip: patch the ELF members of zip archives, such as Python
+   wheels, without unpacking them.  The central directory says where
+   the members are; only the ELF members are inflated (the first bytes
+   of the others, to check for the ELF magic), patched, and deflated
+   again.  Everything else, including ELF members that don't change,
+   is copied as it is, still compressed.  Zip64 archives aren't
+   supported, and manifests recording hashes of the members (such as
+   a wheel's RECORD) aren't updated. */
+
+#ifdef HAVE_ZLIB
 
-static void setSubstr(std::string & s, unsigned int pos, const std::string & t)
+static uint16_t zipGet16(const unsigned char * p)
 {
-    assert(pos + t.size() <= s.size());
-    copy(t.begin(), t.end(), s.begin() + pos);
+    return p[0] | p[1] << 8;
 }
 
 
-template<ElfFileParams>
-std::string ElfFile<ElfFileParamNames>::getInterpreter()
+static uint32_t zipGet32(const unsigned char * p)
 {
-    Elf_Shdr & shdr = findSection(".interp");
-    return std::string((char *) contents + rdi(shdr.sh_offset), rdi(shdr.sh_size));
+    return zipGet16(p) | (uint32_t) zipGet16(p + 2) << 16;
 }
 
-template<ElfFileParams>
-void ElfFile<ElfFileParamNames>::modifySoname(sonameMode op, const std::string & newSoname)
-{
-    if (rdi(hdr->e_type) != ET_DYN) {
-        debug("this is not a dynamic library\n");
-        return;
-    }
-
-    Elf_Shdr & shdrDynamic = findSection(".dynamic");
-    Elf_Shdr & shdrDynStr = findSection(".dynstr");
-    char * strTab = (char *) contents + rdi(shdrDynStr.sh_offset);
-
-    /* Walk through the dynamic section, look for the DT_SONAME entry. */
-    Elf_Dyn * dyn = (Elf_Dyn *) (contents + rdi(shdrDynamic.sh_offset));
-    Elf_Dyn * dynSoname = 0;
-    char * soname = 0;
-    for ( ; rdi(dyn->d_tag) != DT_NULL; dyn++) {
-        if (rdi(dyn->d_tag) == DT_SONAME) {
-            dynSoname = dyn;
-            soname = strTab + rdi(dyn->d_un.d_val);
-        }
-    }
-
-    if (op == printSoname) {
-        if (soname) {
-            if (std::string(soname ? soname : "") == "")
-                debug("DT_SONAME is empty\n");
-            else
-                printf("%s\n", soname);
-        } else {
-            debug("no DT_SONAME found\n");
-        }
-        return;
-    }
-
-    if (std::string(soname ? soname : "") == newSoname) {
-        debug("current and proposed new SONAMEs are equal keeping DT_SONAME entry\n");
-        return;
-    }
 
-    /* Zero out the previous SONAME */
-    unsigned int sonameSize = 0;
-    if (soname) {
-        sonameSize = strlen(soname);
-        memset(soname, 'X', sonameSize);
-    }
+static void zipPut32(unsigned char * p, uint32_t n)
+{
+    for (int i = 0; i < 4; ++i, n >>= 8) p[i] = n & 0xff;
+}
 
-    debug("new SONAME is '%s'\n", newSoname.c_str());
 
-    /* Grow the .dynstr section to make room for the new SONAME. */
-    debug("SONAME is too long, resizing...\n");
+static const uint32_t zipLocalSig = 0x04034b50, zipCentralSig = 0x02014b50,
+    zipEndSig = 0x06054b50, zipEnd64LocatorSig = 0x07064b50;
+static const size_t zipLocalSize = 30, zipCentralSize = 46, zipEndSize = 22;
+static const uint16_t zipEncrypted = 1, zipDataDescriptor = 8;
+static const uint16_t zipStored = 0, zipDeflated = 8;
 
-    std::string & newDynStr = replaceSection(".dynstr", rdi(shdrDynStr.sh_size) + newSoname.size() + 1);
-    setSubstr(newDynStr, rdi(shdrDynStr.sh_size), newSoname + '\0');
 
-    /* Update the DT_SONAME entry. */
-    if (dynSoname) {
-        dynSoname->d_un.d_val = shdrDynStr.sh_size;
-    } else {
-        /* There is no DT_SONAME entry in the .dynamic section, so we
-           have to grow the .dynamic section. */
-        std::string & newDynamic = replaceSection(".dynamic", rdi(shdrDynamic.sh_size) + sizeof(Elf_Dyn));
-
-        unsigned int idx = 0;
-        for (; rdi(((Elf_Dyn *) newDynamic.c_str())[idx].d_tag) != DT_NULL; idx++);
-        debug("DT_NULL index is %d\n", idx);
-
-        /* Shift all entries down by one. */
-        setSubstr(newDynamic, sizeof(Elf_Dyn), std::string(newDynamic, 0, sizeof(Elf_Dyn) * (idx + 1)));
-
-        /* Add the DT_SONAME entry at the top. */
-        Elf_Dyn newDyn;
-        wri(newDyn.d_tag, DT_SONAME);
-        newDyn.d_un.d_val = shdrDynStr.sh_size;
-        setSubstr(newDynamic, 0, std::string((char *)&newDyn, sizeof(Elf_Dyn)));
-    }
+struct ZipMember
+{
+    std::string name;
+    std::vector<unsigned char> central; /* the central directory header, with the name etc. */
+    uint64_t offset, end; /* of the local header, and of what follows the data */
+    bool patched = false;
+};
 
-    changed = true;
-}
 
-template<ElfFileParams>
-void ElfFile<ElfFileParamNames>::setInterpreter(const std::string & newInterpreter)
+/* Inflate raw deflate data, stopping after 'limit' bytes of output. */
+static std::vector<unsigned char> zipInflate(const unsigned char * data, size_t size, size_t limit)
 {
-    std::string & section = replaceSection(".interp", newInterpreter.size() + 1);
-    setSubstr(section, 0, newInterpreter + '\0');
-    changed = true;
+    std::vector<unsigned char> out(limit);
+    z_stream z = {};
+    if (inflateInit2(&z, -MAX_WBITS) != Z_OK) error("inflateInit2");
+    z.next_in = (Bytef *) data;
+    z.avail_in = size;
+    z.next_out = out.data();
+    z.avail_out = limit;
+    int res = inflate(&z, Z_FINISH);
+    inflateEnd(&z);
+    if (res != Z_STREAM_END && !(res == Z_BUF_ERROR && z.avail_out == 0))
+        error("corrupt compressed data");
+    out.resize(limit - z.avail_out);
+    return out;
 }
 
 
-static void concatToRPath(std::string & rpath, const std::string & path)
+static std::vector<unsigned char> zipDeflate(const unsigned char * data, size_t size)
 {
-    if (!rpath.empty()) rpath += ":";
-    rpath += path;
+    z_stream z = {};
+    if (deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        error("deflateInit2");
+    std::vector<unsigned char> out(deflateBound(&z, size));
+    z.next_in = (Bytef *) data;
+    z.avail_in = size;
+    z.next_out = out.data();
+    z.avail_out = out.size();
+    int res = deflate(&z, Z_FINISH);
+    deflateEnd(&z);
+    if (res != Z_STREAM_END) error("deflate");
+    out.resize(out.size() - z.avail_out);
+    return out;
 }
 
 
-template<ElfFileParams>
-void ElfFile<ElfFileParamNames>::modifyRPath(RPathOp op,
-    const std::vector<std::string> & allowedRpathPrefixes, std::string newRPath)
+/* Writes the archive sequentially, keeping track of the offset. */
+struct ZipWriter
 {
-    Elf_Shdr & shdrDynamic = findSection(".dynamic");
-
-    /* !!! We assume that the virtual address in the DT_STRTAB entry
-       of the dynamic section corresponds to the .dynstr section. */
-    Elf_Shdr & shdrDynStr = findSection(".dynstr");
-    char * strTab = (char *) contents + rdi(shdrDynStr.sh_offset);
-
-
-    /* Walk through the dynamic section, look for the RPATH/RUNPATH
-       entry.
-
-       According to the ld.so docs, DT_RPATH is obsolete, we should
-       use DT_RUNPATH.  DT_RUNPATH has two advantages: it can be
-       overriden by LD_LIBRARY_PATH, and it's scoped (the DT_RUNPATH
-       for an executable or library doesn't affect the search path for
-       libraries used by it).  DT_RPATH is ignored if DT_RUNPATH is
-       present.  The binutils 'ld' still generates only DT_RPATH,
-       unless you use its '--enable-new-dtag' option, in which case it
-       generates a DT_RPATH and DT_RUNPATH pointing at the same
-       string. */
-    std::vector<std::string> neededLibs;
-    Elf_Dyn * dyn = (Elf_Dyn *) (contents + rdi(shdrDynamic.sh_offset));
-    Elf_Dyn * dynRPath = 0, * dynRunPath = 0;
-    char * rpath = 0;
-    for ( ; rdi(dyn->d_tag) != DT_NULL; dyn++) {
-        if (rdi(dyn->d_tag) == DT_RPATH) {
-            dynRPath = dyn;
-            /* Only use DT_RPATH if there is no DT_RUNPATH. */
-            if (!dynRunPath)
-                rpath = strTab + rdi(dyn->d_un.d_val);
-        }
-        else if (rdi(dyn->d_tag) == DT_RUNPATH) {
-            dynRunPath = dyn;
-            rpath = strTab + rdi(dyn->d_un.d_val);
-        }
-        else if (rdi(dyn->d_tag) == DT_NEEDED)
-            neededLibs.push_back(std::string(strTab + rdi(dyn->d_un.d_val)));
-    }
-
-    if (op == rpPrint) {
-        printf("%s\n", rpath ? rpath : "");
-        return;
-    }
+    int fd;
+    uint64_t pos = 0;
 
-    if (op == rpShrink && !rpath) {
-        debug("no RPATH to shrink\n");
-        return;
+    void write(const unsigned char * data, size_t size)
+    {
+        writeAll(fd, data, size);
+        pos += size;
     }
+};
 
 
-    /* For each directory in the RPATH, check if it contains any
-       needed library. */
-    if (op == rpShrink) {
-        std::vector<bool> neededLibFound(neededLibs.size(), false);
-
-        newRPath = "";
+static void copyZipMember(const unsigned char * archive, const ZipMember & m, ZipWriter & out)
+{
+    out.write(archive + m.offset, m.end - m.offset);
+    fileStats.bytesCopied += m.end - m.offset;
+}
 
-        for (auto & dirName : splitColonDelimitedString(rpath)) {
 
-            /* Non-absolute entries are allowed (e.g., the special
-               "$ORIGIN" hack). */
-            if (dirName[0] != '/') {
-                concatToRPath(newRPath, dirName);
-                continue;
+/* Patch one member if it's an ELF file, or copy it.  Returns whether
+   it's an ELF file. */
+static bool patchZipMember(const unsigned char * archive, ZipMember & m, ZipWriter & out)
+{
+    unsigned char * central = m.central.data();
+    const unsigned char * local = archive + m.offset;
+    uint16_t flags = zipGet16(central + 8), method = zipGet16(central + 10);
+    uint32_t crc = zipGet32(central + 16), compressedSize = zipGet32(central + 20),
+        size = zipGet32(central + 24);
+    uint64_t dataOffset = m.offset + zipLocalSize + zipGet16(local + 26) + zipGet16(local + 28);
+    if (dataOffset + compressedSize > m.end) error(fmt("zip member '", m.name, "' is truncated"));
+    const unsigned char * data = archive + dataOffset;
+
+    uint64_t newOffset = out.pos;
+    zipPut32(central + 42, newOffset);
+
+    bool isElf = false;
+    if (!(flags & zipEncrypted) && size >= sizeof(Elf32_Ehdr)) {
+        if (method == zipStored)
+            isElf = memcmp(data, ELFMAG, SELFMAG) == 0;
+        else if (method == zipDeflated) {
+            try {
+                isElf = zipInflate(data, compressedSize, SELFMAG) == std::vector<unsigned char>(ELFMAG, ELFMAG + SELFMAG);
+            } catch (std::exception & e) {
             }
+        }
+    }
 
-            /* If --allowed-rpath-prefixes was given, reject directories
-               not starting with any of the (colon-delimited) prefixes. */
-            if (!allowedRpathPrefixes.empty() && !hasAllowedPrefix(dirName, allowedRpathPrefixes)) {
-                debug("removing directory '%s' from RPATH because of non-allowed prefix\n", dirName.c_str());
-                continue;
-            }
+    if (!isElf) {
+        verbose("copying zip member '%s'\n", m.name.c_str());
+        copyZipMember(archive, m, out);
+        return false;
+    }
 
-            /* For each library that we haven't found yet, see if it
-               exists in this directory. */
-            bool libFound = false;
-            for (unsigned int j = 0; j < neededLibs.size(); ++j)
-                if (!neededLibFound[j]) {
-                    std::string libName = dirName + "/" + neededLibs[j];
-                    try {
-                        if (getElfType(readFile(libName, sizeof(Elf32_Ehdr))).machine == rdi(hdr->e_machine)) {
-                            neededLibFound[j] = true;
-                            libFound = true;
-                        } else
-                            debug("ignoring library '%s' because its machine type differs\n", libName.c_str());
-                    } catch (SysError & e) {
-                        if (e.errNo != ENOENT) throw;
-                    }
+    Stats archiveStats = fileStats;
+    fileStats.clear();
+    bool changed = false;
+
+    {
+        Phase fileSpan(currentStats(), "file", m.name);
+
+        debug("patching zip member '%s'\n", m.name.c_str());
+
+        FileContents contents = std::make_shared<std::vector<unsigned char>>();
+        std::vector<unsigned char> newData;
+
+        try {
+            {
+                Phase phase(currentStats(), "read");
+                contents->reserve(size + 32 * 1024 * 1024);
+                if (method == zipStored)
+                    contents->assign(data, data + size);
+                else {
+                    auto inflated = zipInflate(data, compressedSize, size);
+                    contents->assign(inflated.begin(), inflated.end());
                 }
+                if (contents->size() != size || crc32(0, contents->data(), size) != crc)
+                    error("corrupt zip member");
+            }
+            fileStats.bytesRead = size;
 
-            if (!libFound)
-                debug("removing directory '%s' from RPATH\n", dirName.c_str());
-            else
-                concatToRPath(newRPath, dirName);
-        }
-    }
+            changed = patchElfContents(contents, ops, currentStats()).changed;
 
-    if (op == rpRemove) {
-        if (!rpath) {
-            debug("no RPATH to delete\n");
-            return;
+            if (changed) {
+                Phase phase(currentStats(), "deflate");
+                if (contents->size() >= 0xffffffff) error("zip64 archives are not supported");
+                if (method == zipDeflated)
+                    newData = zipDeflate(contents->data(), contents->size());
+            }
+        } catch (std::exception & e) {
+            fprintf(stderr, "patchelf: %s: %s; not patching it\n", m.name.c_str(), e.what());
+            changed = false;
         }
 
-        Elf_Dyn * dyn = (Elf_Dyn *) (contents + rdi(shdrDynamic.sh_offset));
-        Elf_Dyn * last = dyn;
-        for ( ; rdi(dyn->d_tag) != DT_NULL; dyn++) {
-            if (rdi(dyn->d_tag) == DT_RPATH) {
-                debug("removing DT_RPATH entry\n");
-                changed = true;
-            } else if (rdi(dyn->d_tag) == DT_RUNPATH) {
-                debug("removing DT_RUNPATH entry\n");
-                changed = true;
-            } else {
-                *last++ = *dyn;
+        if (changed) {
+            Phase phase(currentStats(), "write");
+            const unsigned char * newBytes = method == zipDeflated ? newData.data() : contents->data();
+            size_t newCompressedSize = method == zipDeflated ? newData.size() : contents->size();
+            uint32_t newCrc = crc32(0, contents->data(), contents->size());
+
+            /* The sizes and CRC are known now, so they go in the local
+               header rather than in a data descriptor after the data.
+               The fields of the central header are 2 bytes further
+               on. */
+            std::vector<unsigned char> header(local, archive + dataOffset);
+            for (auto h : {header.data(), central + 2}) {
+                uint16_t f = zipGet16(h + 6) & ~zipDataDescriptor;
+                h[6] = f & 0xff;
+                h[7] = f >> 8;
+                zipPut32(h + 14, newCrc);
+                zipPut32(h + 18, newCompressedSize);
+                zipPut32(h + 22, contents->size());
             }
+            out.write(header.data(), header.size());
+            out.write(newBytes, newCompressedSize);
+            m.patched = true;
+            /* Count the uncompressed size, as for other files. */
+            fileStats.bytesWritten = contents->size();
         }
-        memset(last, 0, sizeof(Elf_Dyn) * (dyn - last));
-        return;
     }
 
+    endFileStats(m.name);
+    fileStats = archiveStats;
 
-    if (std::string(rpath ? rpath : "") == newRPath) return;
+    if (!changed) copyZipMember(archive, m, out);
 
-    changed = true;
+    return true;
+}
 
-    /* Zero out the previous rpath to prevent retained dependencies in
-       Nix. */
-    unsigned int rpathSize = 0;
-    if (rpath) {
-        rpathSize = strlen(rpath);
-        memset(rpath, 'X', rpathSize);
-    }
 
-    debug("new rpath is '%s'\n", newRPath.c_str());
+/* Patch the archive 'fileName', in place or to --output.  Returns the
+   number of ELF members. */
+static unsigned int patchZip(const std::string & fileName)
+{
+    int fd = open(fileName.c_str(), O_RDONLY);
+    if (fd == -1) throw SysError(fmt("opening '", fileName, "'"));
+    struct stat st;
+    if (fstat(fd, &st) != 0) throw SysError(fmt("getting info about '", fileName, "'"));
 
-    if (!forceRPath && dynRPath && !dynRunPath) { /* convert DT_RPATH to DT_RUNPATH */
-        dynRPath->d_tag = DT_RUNPATH;
-        dynRunPath = dynRPath;
-        dynRPath = 0;
+    size_t size = st.st_size;
+    if (size < zipEndSize) error(fmt("'", fileName, "' is not a zip archive"));
+    void * map = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) throw SysError(fmt("mapping '", fileName, "'"));
+    std::shared_ptr<void> unmap(map, [size](void * p) { munmap(p, size); });
+    const unsigned char * archive = (const unsigned char *) map;
+    fileStats.bytesRead += size;
+
+    /* The end of central directory record, followed by a comment of
+       up to 64 KiB. */
+    size_t end = size - zipEndSize;
+    while (zipGet32(archive + end) != zipEndSig || end + zipEndSize + zipGet16(archive + end + 20) != size) {
+        if (end == 0 || size - end > zipEndSize + 0xffff)
+            error(fmt("'", fileName, "' is not a zip archive"));
+        end--;
     }
 
-    if (forceRPath && dynRPath && dynRunPath) { /* convert DT_RUNPATH to DT_RPATH */
-        dynRunPath->d_tag = DT_IGNORE;
+    uint16_t count = zipGet16(archive + end + 10);
+    uint32_t centralSize = zipGet32(archive + end + 12), centralOffset = zipGet32(archive + end + 16);
+    if ((end >= 20 && zipGet32(archive + end - 20) == zipEnd64LocatorSig) ||
+        count == 0xffff || centralOffset == 0xffffffff)
+        error(fmt("'", fileName, "': zip64 archives are not supported"));
+    if (zipGet16(archive + end + 4) || zipGet16(archive + end + 6) || zipGet16(archive + end + 8) != count)
+        error(fmt("'", fileName, "': multi-volume zip archives are not supported"));
+    if ((uint64_t) centralOffset + centralSize > end)
+        error(fmt("'", fileName, "': invalid zip central directory"));
+
+    std::vector<ZipMember> members(count);
+    size_t pos = centralOffset;
+    for (auto & m : members) {
+        const unsigned char * h = archive + pos;
+        if (pos + zipCentralSize > centralOffset + centralSize || zipGet32(h) != zipCentralSig)
+            error(fmt("'", fileName, "': invalid zip central directory"));
+        size_t len = zipCentralSize + zipGet16(h + 28) + zipGet16(h + 30) + zipGet16(h + 32);
+        if (pos + len > centralOffset + centralSize)
+            error(fmt("'", fileName, "': invalid zip central directory"));
+        m.central.assign(h, h + len);
+        m.name = std::string((const char *) h + zipCentralSize, zipGet16(h + 28));
+        m.offset = zipGet32(h + 42);
+        if (zipGet32(h + 20) == 0xffffffff || zipGet32(h + 24) == 0xffffffff || m.offset == 0xffffffff)
+            error(fmt("'", fileName, "': zip64 archives are not supported"));
+        if (m.offset + zipLocalSize > centralOffset || zipGet32(archive + m.offset) != zipLocalSig)
+            error(fmt("'", fileName, "': invalid local header for '", m.name, "'"));
+        pos += len;
     }
 
-    if (newRPath.size() <= rpathSize) {
-        strcpy(rpath, newRPath.c_str());
-        return;
+    /* Each member extends to the next one, so that data descriptors
+       are copied along. */
+    std::vector<ZipMember *> byOffset;
+    for (auto & m : members) byOffset.push_back(&m);
+    std::stable_sort(byOffset.begin(), byOffset.end(),
+        [](ZipMember * a, ZipMember * b) { return a->offset < b->offset; });
+    for (size_t i = 0; i < byOffset.size(); ++i) {
+        if (i + 1 < byOffset.size() && byOffset[i + 1]->offset == byOffset[i]->offset)
+            error(fmt("'", fileName, "': overlapping zip members"));
+        byOffset[i]->end = i + 1 < byOffset.size() ? byOffset[i + 1]->offset : centralOffset;
     }
 
-    /* Grow the .dynstr section to make room for the new RPATH. */
-    debug("rpath is too long, resizing...\n");
-
-    std::string & newDynStr = replaceSection(".dynstr",
-        rdi(shdrDynStr.sh_size) + newRPath.size() + 1);
-    setSubstr(newDynStr, rdi(shdrDynStr.sh_size), newRPath + '\0');
+    std::string outName = outputFileName.empty() ? fileName + ".tmp" : outputFileName;
+    ZipWriter out;
+    out.fd = outName == "-" ? 1 : open(outName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, st.st_mode & 07777);
+    if (out.fd == -1) throw SysError(fmt("creating '", outName, "'"));
 
-    /* Update the DT_RUNPATH and DT_RPATH entries. */
-    if (dynRunPath || dynRPath) {
-        if (dynRunPath) dynRunPath->d_un.d_val = shdrDynStr.sh_size;
-        if (dynRPath) dynRPath->d_un.d_val = shdrDynStr.sh_size;
+    unsigned int elfMembers = 0;
+    try {
+        /* Anything before the first member, e.g. a self-extractor. */
+        out.write(archive, byOffset.empty() ? centralOffset : byOffset[0]->offset);
+
+        for (auto m : byOffset)
+            if (patchZipMember(archive, *m, out)) elfMembers++;
+
+        uint64_t newCentralOffset = out.pos;
+        for (auto & m : members) out.write(m.central.data(), m.central.size());
+        uint64_t newCentralSize = out.pos - newCentralOffset;
+        if (newCentralOffset >= 0xffffffff) error("zip64 archives are not supported");
+
+        std::vector<unsigned char> endRecord(archive + end, archive + size);
+        zipPut32(endRecord.data() + 12, newCentralSize);
+        zipPut32(endRecord.data() + 16, newCentralOffset);
+        out.write(endRecord.data(), endRecord.size());
+
+        if (out.fd != 1 && close(out.fd) != 0) throw SysError(fmt("writing '", outName, "'"));
+    } catch (...) {
+        if (out.fd != 1) {
+            close(out.fd);
+            unlink(outName.c_str());
+        }
+        throw;
     }
 
-    else {
-        /* There is no DT_RUNPATH entry in the .dynamic section, so we
-           have to grow the .dynamic section. */
-        std::string & newDynamic = replaceSection(".dynamic",
-            rdi(shdrDynamic.sh_size) + sizeof(Elf_Dyn));
-
-        unsigned int idx = 0;
-        for ( ; rdi(((Elf_Dyn *) newDynamic.c_str())[idx].d_tag) != DT_NULL; idx++) ;
-        debug("DT_NULL index is %d\n", idx);
-
-        /* Shift all entries down by one. */
-        setSubstr(newDynamic, sizeof(Elf_Dyn),
-            std::string(newDynamic, 0, sizeof(Elf_Dyn) * (idx + 1)));
-
-        /* Add the DT_RUNPATH entry at the top. */
-        Elf_Dyn newDyn;
-        wri(newDyn.d_tag, forceRPath ? DT_RPATH : DT_RUNPATH);
-        newDyn.d_un.d_val = shdrDynStr.sh_size;
-        setSubstr(newDynamic, 0, std::string((char *) &newDyn, sizeof(Elf_Dyn)));
+    /* Leave the archive alone if no member changed. */
+    if (outputFileName.empty()) {
+        if (std::none_of(members.begin(), members.end(), [](const ZipMember & m) { return m.patched; }))
+            unlink(outName.c_str());
+        else if (rename(outName.c_str(), fileName.c_str()) != 0)
+            throw SysError(fmt("renaming '", outName, "' to '", fileName, "'"));
     }
-}
 
-
-template<ElfFileParams>
-void ElfFile<ElfFileParamNames>::removeNeeded(const std::set<std::string> & libs)
-{
-    if (libs.empty()) return;
-
-    Elf_Shdr & shdrDynamic = findSection(".dynamic");
-    Elf_Shdr & shdrDynStr = findSection(".dynstr");
-    char * strTab = (char *) contents + rdi(shdrDynStr.sh_offset);
-
-    Elf_Dyn * dyn = (Elf_Dyn *) (contents + rdi(shdrDynamic.sh_offset));
-    Elf_Dyn * last = dyn;
-    for ( ; rdi(dyn->d_tag) != DT_NULL; dyn++) {
-        if (rdi(dyn->d_tag) == DT_NEEDED) {
-            char * name = strTab + rdi(dyn->d_un.d_val);
-            if (libs.find(name) != libs.end()) {
-                debug("removing DT_NEEDED entry '%s'\n", name);
-                changed = true;
-            } else {
-                debug("keeping DT_NEEDED entry '%s'\n", name);
-                *last++ = *dyn;
-            }
-        } else
-            *last++ = *dyn;
+    if (statsMode != statsNone) {
+        totalStats.add(fileStats);
+        fileStats.clear();
     }
 
-    memset(last, 0, sizeof(Elf_Dyn) * (dyn - last));
+    return elfMembers;
 }
 
-template<ElfFileParams>
-void ElfFile<ElfFileParamNames>::replaceNeeded(const std::map<std::string, std::string> & libs)
-{
-    if (libs.empty()) return;
-
-    Elf_Shdr & shdrDynamic = findSection(".dynamic");
-    Elf_Shdr & shdrDynStr = findSection(".dynstr");
-    char * strTab = (char *) contents + rdi(shdrDynStr.sh_offset);
+#endif
 
-    Elf_Dyn * dyn = (Elf_Dyn *) (contents + rdi(shdrDynamic.sh_offset));
 
-    unsigned int verNeedNum = 0;
+/* --recursive: walk directory trees and patch every dynamically
+   linked ELF file in them.  Directories and files are handed out from
+   a shared stack to --jobs threads.  Symbolic links are not followed,
+   and a file with several hard links is only patched once.  Errors
+   are reported per file, and don't stop the walk. */
 
-    unsigned int dynStrAddedBytes = 0;
+template<class I>
+static I readElfInt(I i, bool littleEndian)
+{
+    I r = 0;
+    for (unsigned int n = 0; n < sizeof(I); ++n)
+        r |= ((I) *(((unsigned char *) &i) + n)) << ((littleEndian ? n : sizeof(I) - n - 1) * 8);
+    return r;
+}
 
-    for ( ; rdi(dyn->d_tag) != DT_NULL; dyn++) {
-        if (rdi(dyn->d_tag) == DT_NEEDED) {
-            char * name = strTab + rdi(dyn->d_un.d_val);
-            auto i = libs.find(name);
-            if (i != libs.end()) {
-                auto replacement = i->second;
 
-                debug("replacing DT_NEEDED entry '%s' with '%s'\n", name, replacement.c_str());
+/* Whether the file has a PT_DYNAMIC segment, i.e. is something
+   patchelf can edit.  Only reads the ELF and program headers. */
+template<class Ehdr, class Phdr>
+static bool hasDynamicSegment(int fd, bool littleEndian)
+{
+    Ehdr hdr;
+    if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) return false;
 
-                // technically, the string referred by d_val could be used otherwise, too (although unlikely)
-                // we'll therefore add a new string
-                debug("resizing .dynstr ...\n");
+    auto type = readElfInt(hdr.e_type, littleEndian);
+    if (type != ET_EXEC && type != ET_DYN) return false;
+    if (readElfInt(hdr.e_phentsize, littleEndian) != sizeof(Phdr)) return false;
 
-                std::string & newDynStr = replaceSection(".dynstr",
-                    rdi(shdrDynStr.sh_size) + replacement.size() + 1 + dynStrAddedBytes);
-                setSubstr(newDynStr, rdi(shdrDynStr.sh_size) + dynStrAddedBytes, replacement + '\0');
+    std::vector<Phdr> phdrs(readElfInt(hdr.e_phnum, littleEndian));
+    ssize_t size = phdrs.size() * sizeof(Phdr);
+    if (pread(fd, phdrs.data(), size, readElfInt(hdr.e_phoff, littleEndian)) != size) return false;
 
-                wri(dyn->d_un.d_val, rdi(shdrDynStr.sh_size) + dynStrAddedBytes);
+    for (auto & phdr : phdrs)
+        if (readElfInt(phdr.p_type, littleEndian) == PT_DYNAMIC) return true;
+    return false;
+}
 
-                dynStrAddedBytes += replacement.size() + 1;
 
-                changed = true;
-            } else {
-                debug("keeping DT_NEEDED entry '%s'\n", name);
-            }
-        }
-        if (rdi(dyn->d_tag) == DT_VERNEEDNUM) {
-            verNeedNum = rdi(dyn->d_un.d_val);
-        }
-    }
+/* Sniff the ELF identification with a single small read, so that
+   other files are skipped cheaply. */
+static bool isDynamicElf(int fd)
+{
+    unsigned char ident[EI_NIDENT];
+    if (pread(fd, ident, sizeof(ident), 0) != sizeof(ident)) return false;
+    if (memcmp(ident, ELFMAG, SELFMAG) != 0 || ident[EI_VERSION] != EV_CURRENT) return false;
+    if (ident[EI_DATA] != ELFDATA2LSB && ident[EI_DATA] != ELFDATA2MSB) return false;
+
+    bool littleEndian = ident[EI_DATA] == ELFDATA2LSB;
+    if (ident[EI_CLASS] == ELFCLASS32)
+        return hasDynamicSegment<Elf32_Ehdr, Elf32_Phdr>(fd, littleEndian);
+    if (ident[EI_CLASS] == ELFCLASS64)
+        return hasDynamicSegment<Elf64_Ehdr, Elf64_Phdr>(fd, littleEndian);
+    return false;
+}
 
-    // If a replaced library uses symbol versions, then there will also be
-    // references to it in the "version needed" table, and these also need to
-    // be replaced.
 
-    if (verNeedNum) {
-        Elf_Shdr & shdrVersionR = findSection(".gnu.version_r");
-        // The filename strings in the .gnu.version_r are different from the
-        // ones in .dynamic: instead of being in .dynstr, they're in some
-        // arbitrary section and we have to look in ->sh_link to figure out
-        // which one.
-        Elf_Shdr & shdrVersionRStrings = shdrs[rdi(shdrVersionR.sh_link)];
-        // this is where we find the actual filename strings
-        char * verStrTab = (char *) contents + rdi(shdrVersionRStrings.sh_offset);
-        // and we also need the name of the section containing the strings, so
-        // that we can pass it to replaceSection
-        std::string versionRStringsSName = getSectionName(shdrVersionRStrings);
+class TreeWalker
+{
+    struct Item
+    {
+        std::string path;
+        bool isDir;
+    };
 
-        debug("found .gnu.version_r with %i entries, strings in %s\n", verNeedNum, versionRStringsSName.c_str());
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    std::vector<Item> todo;
+    unsigned int busy = 0;
+    std::set<std::pair<dev_t, ino_t>> seen;
 
-        unsigned int verStrAddedBytes = 0;
+    void reportError(const std::string & path, const std::string & msg)
+    {
+        fprintf(stderr, "patchelf: %s: %s\n", path.c_str(), msg.c_str());
+        failed = true;
+    }
 
-        Elf_Verneed * need = (Elf_Verneed *) (contents + rdi(shdrVersionR.sh_offset));
-        while (verNeedNum > 0) {
-            char * file = verStrTab + rdi(need->vn_file);
-            auto i = libs.find(file);
-            if (i != libs.end()) {
-                auto replacement = i->second;
+    void listDir(const std::string & path)
+    {
+        DIR * dir = opendir(path.c_str());
+        if (!dir) throw SysError("opening directory");
+
+        std::vector<Item> items;
+        struct dirent * entry;
+        while ((entry = readdir(dir))) {
+            std::string name = entry->d_name;
+            if (name == "." || name == "..") continue;
+            unsigned char type = entry->d_type;
+            if (type == DT_UNKNOWN) {
+                struct stat st;
+                if (fstatat(dirfd(dir), name.c_str(), &st, AT_SYMLINK_NOFOLLOW) != 0) continue;
+                type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+            }
+            if (type == DT_DIR || type == DT_REG)
+                items.push_back({path + "/" + name, type == DT_DIR});
+        }
+        closedir(dir);
 
-                debug("replacing .gnu.version_r entry '%s' with '%s'\n", file, replacement.c_str());
-                debug("resizing string section %s ...\n", versionRStringsSName.c_str());
+        std::lock_guard<std::mutex> lock(mutex);
+        todo.insert(todo.end(), items.begin(), items.end());
+        wakeup.notify_all();
+    }
 
-                std::string & newVerDynStr = replaceSection(versionRStringsSName,
-                    rdi(shdrVersionRStrings.sh_size) + replacement.size() + 1 + verStrAddedBytes);
-                setSubstr(newVerDynStr, rdi(shdrVersionRStrings.sh_size) + verStrAddedBytes, replacement + '\0');
+    void visitFile(const std::string & path)
+    {
+        if (incrementalState.enabled() && incrementalState.upToDate(path))
+            return;
 
-                wri(need->vn_file, rdi(shdrVersionRStrings.sh_size) + verStrAddedBytes);
+        int fd = open(path.c_str(), O_RDONLY | O_NOFOLLOW);
+        if (fd == -1) throw SysError("opening file");
+        struct stat st;
+        bool isElf = fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && isDynamicElf(fd);
+        close(fd);
 
-                verStrAddedBytes += replacement.size() + 1;
+        if (!isElf) {
+            verbose("skipping '%s', not a dynamically linked ELF file\n", path.c_str());
+            return;
+        }
 
-                changed = true;
-            } else {
-                debug("keeping .gnu.version_r entry '%s'\n", file);
+        if (st.st_nlink > 1) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!seen.insert({st.st_dev, st.st_ino}).second) {
+                verbose("skipping '%s', already patched through another link\n", path.c_str());
+                return;
             }
-            // the Elf_Verneed structures form a linked list, so jump to next entry
-            need = (Elf_Verneed *) (((char *) need) + rdi(need->vn_next));
-            --verNeedNum;
         }
-    }
-}
 
-template<ElfFileParams>
-void ElfFile<ElfFileParamNames>::addNeeded(const std::set<std::string> & libs)
-{
-    if (libs.empty()) return;
-
-    Elf_Shdr & shdrDynamic = findSection(".dynamic");
-    Elf_Shdr & shdrDynStr = findSection(".dynstr");
-
-    /* add all new libs to the dynstr string table */
-    unsigned int length = 0;
-    for (auto & i : libs) length += i.size() + 1;
-
-    std::string & newDynStr = replaceSection(".dynstr",
-        rdi(shdrDynStr.sh_size) + length + 1);
-    std::set<Elf64_Xword> libStrings;
-    unsigned int pos = 0;
-    for (auto & i : libs) {
-        setSubstr(newDynStr, rdi(shdrDynStr.sh_size) + pos, i + '\0');
-        libStrings.insert(rdi(shdrDynStr.sh_size) + pos);
-        pos += i.size() + 1;
-    }
-
-    /* add all new needed entries to the dynamic section */
-    std::string & newDynamic = replaceSection(".dynamic",
-        rdi(shdrDynamic.sh_size) + sizeof(Elf_Dyn) * libs.size());
-
-    unsigned int idx = 0;
-    for ( ; rdi(((Elf_Dyn *) newDynamic.c_str())[idx].d_tag) != DT_NULL; idx++) ;
-    debug("DT_NULL index is %d\n", idx);
-
-    /* Shift all entries down by the number of new entries. */
-    setSubstr(newDynamic, sizeof(Elf_Dyn) * libs.size(),
-        std::string(newDynamic, 0, sizeof(Elf_Dyn) * (idx + 1)));
-
-    /* Add the DT_NEEDED entries at the top. */
-    unsigned int i = 0;
-    for (auto & j : libStrings) {
-        Elf_Dyn newDyn;
-        wri(newDyn.d_tag, DT_NEEDED);
-        wri(newDyn.d_un.d_val, j);
-        setSubstr(newDynamic, i * sizeof(Elf_Dyn), std::string((char *) &newDyn, sizeof(Elf_Dyn)));
-        i++;
+        patchFile(path);
+        files++;
     }
 
-    changed = true;
-}
-
-template<ElfFileParams>
-void ElfFile<ElfFileParamNames>::printNeededLibs()
-{
-    Elf_Shdr & shdrDynamic = findSection(".dynamic");
-    Elf_Shdr & shdrDynStr = findSection(".dynstr");
-    char *strTab = (char *)contents + rdi(shdrDynStr.sh_offset);
-
-    Elf_Dyn *dyn = (Elf_Dyn *) (contents + rdi(shdrDynamic.sh_offset));
+    void work()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            wakeup.wait(lock, [&]() { return !todo.empty() || !busy; });
+            if (todo.empty()) return; /* and nobody can add more */
+
+            Item item = todo.back();
+            todo.pop_back();
+            busy++;
+            lock.unlock();
+
+            try {
+                if (item.isDir)
+                    listDir(item.path);
+                else
+                    visitFile(item.path);
+            } catch (std::exception & e) {
+                reportError(item.path, e.what());
+            }
 
-    for (; rdi(dyn->d_tag) != DT_NULL; dyn++) {
-        if (rdi(dyn->d_tag) == DT_NEEDED) {
-            char *name = strTab + rdi(dyn->d_un.d_val);
-            printf("%s\n", name);
+            lock.lock();
+            if (!--busy) wakeup.notify_all();
         }
     }
-}
 
+public:
 
-template<ElfFileParams>
-void ElfFile<ElfFileParamNames>::noDefaultLib()
-{
-    Elf_Shdr & shdrDynamic = findSection(".dynamic");
+    std::atomic<unsigned int> files{0};
+    std::atomic<bool> failed{false};
 
-    Elf_Dyn * dyn = (Elf_Dyn *) (contents + rdi(shdrDynamic.sh_offset));
-    Elf_Dyn * dynFlags1 = 0;
-    for ( ; rdi(dyn->d_tag) != DT_NULL; dyn++) {
-        if (rdi(dyn->d_tag) == DT_FLAGS_1) {
-            dynFlags1 = dyn;
-            break;
-        }
-    }
-    if (dynFlags1) {
-        if (dynFlags1->d_un.d_val & DF_1_NODEFLIB)
-            return;
-        dynFlags1->d_un.d_val |= DF_1_NODEFLIB;
-    } else {
-        std::string & newDynamic = replaceSection(".dynamic",
-                rdi(shdrDynamic.sh_size) + sizeof(Elf_Dyn));
-
-        unsigned int idx = 0;
-        for ( ; rdi(((Elf_Dyn *) newDynamic.c_str())[idx].d_tag) != DT_NULL; idx++) ;
-        debug("DT_NULL index is %d\n", idx);
-
-        /* Shift all entries down by one. */
-        setSubstr(newDynamic, sizeof(Elf_Dyn),
-                std::string(newDynamic, 0, sizeof(Elf_Dyn) * (idx + 1)));
-
-        /* Add the DT_FLAGS_1 entry at the top. */
-        Elf_Dyn newDyn;
-        wri(newDyn.d_tag, DT_FLAGS_1);
-        newDyn.d_un.d_val = DF_1_NODEFLIB;
-        setSubstr(newDynamic, 0, std::string((char *) &newDyn, sizeof(Elf_Dyn)));
+    void run(const std::vector<std::string> & roots, unsigned int threads)
+    {
+        for (auto & root : roots)
+            todo.push_back({root, true});
+
+        std::vector<std::thread> workers;
+        for (unsigned int i = 1; i < threads; ++i)
+            workers.emplace_back(&TreeWalker::work, this);
+        work();
+        for (auto & worker : workers) worker.join();
     }
-
-    changed = true;
-}
+};
 
 
-static bool printInterpreter = false;
-static bool printSoname = false;
-static bool setSoname = false;
-static std::string newSoname;
-static std::string newInterpreter;
-static bool shrinkRPath = false;
-static std::vector<std::string> allowedRpathPrefixes;
-static bool removeRPath = false;
-static bool setRPath = false;
-static bool printRPath = false;
-static std::string newRPath;
-static std::set<std::string> neededLibsToRemove;
-static std::map<std::string, std::string> neededLibsToReplace;
-static std::set<std::string> neededLibsToAdd;
-static bool printNeeded = false;
-static bool noDefaultLib = false;
-
-template<class ElfFile>
-static void patchElf2(ElfFile && elfFile, std::string fileName)
+/* Returns the exit status. */
+static int patchElf()
 {
-    if (printInterpreter)
-        printf("%s\n", elfFile.getInterpreter().c_str());
-
-    if (printSoname)
-        elfFile.modifySoname(elfFile.printSoname, "");
-
-    if (setSoname)
-        elfFile.modifySoname(elfFile.replaceSoname, newSoname);
+    unsigned int files = fromStdin ? 1 : fileNames.size();
+    int status = 0;
 
-    if (newInterpreter != "")
-        elfFile.setInterpreter(newInterpreter);
-
-    if (printRPath)
-        elfFile.modifyRPath(elfFile.rpPrint, {}, "");
-
-    if (shrinkRPath)
-        elfFile.modifyRPath(elfFile.rpShrink, allowedRpathPrefixes, "");
-    else if (removeRPath)
-        elfFile.modifyRPath(elfFile.rpRemove, {}, "");
-    else if (setRPath)
-        elfFile.modifyRPath(elfFile.rpSet, {}, newRPath);
-
-    if (printNeeded) elfFile.printNeededLibs();
+    try {
+        if (tarMode)
+            files = patchTar();
+#ifdef HAVE_ZLIB
+        else if (zipMode) {
+            files = 0;
+            for (auto & fileName : fileNames)
+                files += patchZip(fileName);
+        }
+#endif
+        else if (fromStdin)
+            patchFile("(standard input)");
+        else
+            for (auto & fileName : fileNames)
+                patchFile(fileName);
+
+        if (!recursiveDirs.empty()) {
+            TreeWalker walker;
+            walker.run(recursiveDirs, jobs ? jobs : std::max(1u, std::thread::hardware_concurrency()));
+            files += walker.files;
+            if (walker.failed) status = 1;
+        }
+    } catch (...) {
+        /* Keep what was recorded for the files before the error. */
+        if (incrementalState.enabled()) incrementalState.save();
+        throw;
+    }
 
-    elfFile.removeNeeded(neededLibsToRemove);
-    elfFile.replaceNeeded(neededLibsToReplace);
-    elfFile.addNeeded(neededLibsToAdd);
+    if (incrementalState.enabled()) incrementalState.save();
 
-    if (noDefaultLib)
-        elfFile.noDefaultLib();
+    if (statsMode != statsNone)
+        printStats("", files, totalStats);
 
-    if (elfFile.isChanged()){
-        elfFile.rewriteSections();
-        writeFile(fileName, elfFile.fileContents);
-    }
+    return status;
 }
 
 
-static void patchElf()
+static const struct
 {
-    for (auto fileName : fileNames) {
-        if (!printInterpreter && !printRPath && !printSoname && !printNeeded)
-            debug("patching ELF file '%s'\n", fileName.c_str());
-
-        debug("Kernel page size is %u bytes\n", getPageSize());
+    const char * name;
+    bool flags1; /* DT_FLAGS_1 rather than DT_FLAGS */
+    Elf64_Xword value;
+} dynamicFlags[] = {
+    {"DF_ORIGIN", false, DF_ORIGIN},
+    {"DF_SYMBOLIC", false, DF_SYMBOLIC},
+    {"DF_TEXTREL", false, DF_TEXTREL},
+    {"DF_BIND_NOW", false, DF_BIND_NOW},
+    {"DF_STATIC_TLS", false, DF_STATIC_TLS},
+    {"DF_1_NOW", true, DF_1_NOW},
+    {"DF_1_GLOBAL", true, DF_1_GLOBAL},
+    {"DF_1_GROUP", true, DF_1_GROUP},
+    {"DF_1_NODELETE", true, DF_1_NODELETE},
+    {"DF_1_LOADFLTR", true, DF_1_LOADFLTR},
+    {"DF_1_INITFIRST", true, DF_1_INITFIRST},
+    {"DF_1_NOOPEN", true, DF_1_NOOPEN},
+    {"DF_1_ORIGIN", true, DF_1_ORIGIN},
+    {"DF_1_DIRECT", true, DF_1_DIRECT},
+    {"DF_1_INTERPOSE", true, DF_1_INTERPOSE},
+    {"DF_1_NODEFLIB", true, DF_1_NODEFLIB},
+    {"DF_1_NODUMP", true, DF_1_NODUMP},
+    {"DF_1_CONFALT", true, DF_1_CONFALT},
+    {"DF_1_ENDFILTEE", true, DF_1_ENDFILTEE},
+    {"DF_1_NODIRECT", true, DF_1_NODIRECT},
+    {"DF_1_GLOBAUDIT", true, DF_1_GLOBAUDIT},
+    {"DF_1_SINGLETON", true, DF_1_SINGLETON},
+    {"DF_1_PIE", true, DF_1_PIE},
+};
 
-        auto fileContents = readFile(fileName);
 
-        if (getElfType(fileContents).is32Bit)
-            patchElf2(ElfFile<Elf32_Ehdr, Elf32_Phdr, Elf32_Shdr, Elf32_Addr, Elf32_Off, Elf32_Dyn, Elf32_Sym, Elf32_Verneed>(fileContents), fileName);
-        else
-            patchElf2(ElfFile<Elf64_Ehdr, Elf64_Phdr, Elf64_Shdr, Elf64_Addr, Elf64_Off, Elf64_Dyn, Elf64_Sym, Elf64_Verneed>(fileContents), fileName);
+/* Parse a comma-separated list of DF_* / DF_1_* names and add them
+   to the given DT_FLAGS and DT_FLAGS_1 masks. */
+static void parseDynamicFlags(const std::string & names, Elf64_Xword & flags, Elf64_Xword & flags1)
+{
+    std::istringstream in(names);
+    std::string name;
+    while (std::getline(in, name, ',')) {
+        bool found = false;
+        for (auto & f : dynamicFlags)
+            if (name == f.name) {
+                (f.flags1 ? flags1 : flags) |= f.value;
+                found = true;
+            }
+        if (!found) error("unknown dynamic flag '" + name + "'");
     }
 }
 
@@ -1629,6 +1497,8 @@ void showHelp(const std::string & progName)
         fprintf(stderr, "syntax: %s\n\
   [--set-interpreter FILENAME]\n\
   [--page-size SIZE]\n\
+  [--segment-align]\t\tLay out new segments to preserve the alignment of existing PT_LOADs (e.g. for huge pages)\n\
+  [--gc]\t\t\tReuses the space of sections moved by earlier runs, and drops it from the end of the file\n\
   [--print-interpreter]\n\
   [--print-soname]\t\tPrints 'DT_SONAME' entry of .dynamic section. Raises an error if DT_SONAME doesn't exist\n\
   [--set-soname SONAME]\t\tSets 'DT_SONAME' entry to SONAME.\n\
@@ -1643,6 +1513,21 @@ void showHelp(const std::string & progName)
   [--replace-needed LIBRARY NEW_LIBRARY]\n\
   [--print-needed]\n\
   [--no-default-lib]\n\
+  [--set-flags FLAGS]\t\tSets DT_FLAGS/DT_FLAGS_1 bits, e.g. DF_BIND_NOW,DF_1_NOW\n\
+  [--clear-flags FLAGS]\t\tClears DT_FLAGS/DT_FLAGS_1 bits\n\
+  [--add-gnu-hash]\t\tAdds (or rebuilds) a GNU-style symbol hash table (.gnu.hash)\n\
+  [--compact-dynstr]\t\tRemoves the unused strings from .dynstr, and merges common suffixes\n\
+  [--stats[=json]]\t\tPrints per-phase timings and I/O statistics to stderr\n\
+  [--trace FILE]\t\tWrites a Chrome trace-event file with a span for each file and phase\n\
+  [--stdin]\t\t\tReads the file from standard input instead of FILENAME\n\
+  [--stdout]\t\t\tWrites the result to standard output instead of modifying the file\n\
+  [--output FILE | -o FILE]\tWrites the result to FILE ('-' is standard output) instead of modifying the file\n\
+  [--recursive DIR | -r DIR]\tPatches every dynamically linked ELF file under DIR\n\
+  [--jobs N | -j N]\t\tWith '--recursive', patches N files at a time (default: one per CPU)\n\
+  [--incremental STATEFILE]\tSkips files that were patched with the same options before, as recorded in STATEFILE\n\
+  [--incremental-verify]\tWith '--incremental', checks the start of recently patched files instead of patching them again\n\
+  [--tar]\t\t\tPatches the ELF members of a tar archive read from standard input, writing it to standard output\n\
+  [--zip]\t\t\tTreats FILENAME as a zip archive (e.g. a Python wheel), and patches its ELF members\n\
   [--debug]\n\
   [--version]\n\
   FILENAME\n", progName.c_str());
@@ -1656,48 +1541,60 @@ int mainWrapped(int argc, char * * argv)
         return 1;
     }
 
-    if (getenv("PATCHELF_DEBUG") != 0) debugMode = true;
+    /* PATCHELF_DEBUG=2 also prints the per-symbol and per-section
+       details; any other value is the same as --debug. */
+    std::string incrementalFileName;
+
+    const char * debugEnv = getenv("PATCHELF_DEBUG");
+    if (debugEnv) logLevel = std::max((int) logDebug, atoi(debugEnv));
 
     int i;
     for (i = 1; i < argc; ++i) {
         std::string arg(argv[i]);
         if (arg == "--set-interpreter" || arg == "--interpreter") {
             if (++i == argc) error("missing argument");
-            newInterpreter = argv[i];
+            ops.newInterpreter = argv[i];
         }
         else if (arg == "--page-size") {
             if (++i == argc) error("missing argument");
-            pageSize = atoi(argv[i]);
-            if (pageSize <= 0) error("invalid argument to --page-size");
+            int n = atoi(argv[i]);
+            if (n <= 0) error("invalid argument to --page-size");
+            ops.pageSize = n;
+        }
+        else if (arg == "--segment-align") {
+            ops.segmentAlign = true;
+        }
+        else if (arg == "--gc") {
+            ops.gc = true;
         }
         else if (arg == "--print-interpreter") {
-            printInterpreter = true;
+            ops.printInterpreter = true;
         }
         else if (arg == "--print-soname") {
-            printSoname = true;
+            ops.printSoname = true;
         }
         else if (arg == "--set-soname") {
             if (++i == argc) error("missing argument");
-            setSoname = true;
-            newSoname = argv[i];
+            ops.setSoname = true;
+            ops.newSoname = argv[i];
         }
         else if (arg == "--remove-rpath") {
-            removeRPath = true;
+            ops.removeRPath = true;
         }
         else if (arg == "--shrink-rpath") {
-            shrinkRPath = true;
+            ops.shrinkRPath = true;
         }
         else if (arg == "--allowed-rpath-prefixes") {
             if (++i == argc) error("missing argument");
-            allowedRpathPrefixes = splitColonDelimitedString(argv[i]);
+            ops.allowedRpathPrefixes = splitColonDelimitedString(argv[i]);
         }
         else if (arg == "--set-rpath") {
             if (++i == argc) error("missing argument");
-            setRPath = true;
-            newRPath = argv[i];
+            ops.setRPath = true;
+            ops.newRPath = argv[i];
         }
         else if (arg == "--print-rpath") {
-            printRPath = true;
+            ops.printRPath = true;
         }
         else if (arg == "--force-rpath") {
             /* Generally we prefer to emit DT_RUNPATH instead of
@@ -1711,29 +1608,92 @@ int mainWrapped(int argc, char * * argv)
                DT_RUNPATH is added.  With it, DT_RPATH isn't converted
                to DT_RUNPATH, and if neither is present, a DT_RPATH is
                added. */
-            forceRPath = true;
+            ops.forceRPath = true;
         }
         else if (arg == "--print-needed") {
-            printNeeded = true;
+            ops.printNeeded = true;
         }
         else if (arg == "--add-needed") {
             if (++i == argc) error("missing argument");
-            neededLibsToAdd.insert(argv[i]);
+            ops.neededLibsToAdd.insert(argv[i]);
         }
         else if (arg == "--remove-needed") {
             if (++i == argc) error("missing argument");
-            neededLibsToRemove.insert(argv[i]);
+            ops.neededLibsToRemove.insert(argv[i]);
         }
         else if (arg == "--replace-needed") {
             if (i+2 >= argc) error("missing argument(s)");
-            neededLibsToReplace[ argv[i+1] ] = argv[i+2];
+            ops.neededLibsToReplace[ argv[i+1] ] = argv[i+2];
             i += 2;
         }
         else if (arg == "--debug") {
-            debugMode = true;
+            logLevel = std::max(logLevel, (int) logDebug);
+#if !ENABLE_DEBUG_LOG
+            fprintf(stderr, "patchelf: debug output was disabled at compile time\n");
+#endif
         }
         else if (arg == "--no-default-lib") {
-            noDefaultLib = true;
+            ops.flags1ToSet |= DF_1_NODEFLIB;
+        }
+        else if (arg == "--set-flags") {
+            if (++i == argc) error("missing argument");
+            parseDynamicFlags(argv[i], ops.flagsToSet, ops.flags1ToSet);
+        }
+        else if (arg == "--clear-flags") {
+            if (++i == argc) error("missing argument");
+            parseDynamicFlags(argv[i], ops.flagsToClear, ops.flags1ToClear);
+        }
+        else if (arg == "--add-gnu-hash") {
+            ops.addGnuHash = true;
+        }
+        else if (arg == "--compact-dynstr") {
+            ops.compactDynStr = true;
+        }
+        else if (arg == "--stats" || arg == "--stats=text") {
+            statsMode = statsText;
+        }
+        else if (arg == "--stats=json") {
+            statsMode = statsJson;
+        }
+        else if (arg == "--stdin") {
+            fromStdin = true;
+        }
+        else if (arg == "--stdout") {
+            outputFileName = "-";
+        }
+        else if (arg == "--output" || arg == "-o") {
+            if (++i == argc) error("missing argument");
+            outputFileName = argv[i];
+        }
+        else if (arg == "--recursive" || arg == "-r") {
+            if (++i == argc) error("missing argument");
+            recursiveDirs.push_back(argv[i]);
+        }
+        else if (arg == "--jobs" || arg == "-j") {
+            if (++i == argc) error("missing argument");
+            int n = atoi(argv[i]);
+            if (n <= 0) error("invalid argument to --jobs");
+            jobs = n;
+        }
+        else if (arg == "--incremental") {
+            if (++i == argc) error("missing argument");
+            incrementalFileName = argv[i];
+        }
+        else if (arg == "--incremental-verify") {
+            incrementalState.verify = true;
+        }
+        else if (arg == "--tar") {
+            tarMode = true;
+        }
+        else if (arg == "--zip") {
+#ifndef HAVE_ZLIB
+            error("--zip is not supported: patchelf was built without zlib");
+#endif
+            zipMode = true;
+        }
+        else if (arg == "--trace") {
+            if (++i == argc) error("missing argument");
+            traceFile.open(argv[i]);
         }
         else if (arg == "--help" || arg == "-h" ) {
             showHelp(argv[0]);
@@ -1748,11 +1708,35 @@ int mainWrapped(int argc, char * * argv)
         }
     }
 
-    if (fileNames.empty()) error("missing filename");
+    if (tarMode && (fromStdin || !fileNames.empty() || !outputFileName.empty()))
+        error("--tar reads standard input and writes standard output, and can't be combined with file names, --stdin or --output");
+    if (tarMode && (ops.printInterpreter || ops.printSoname || ops.printRPath || ops.printNeeded))
+        error("--print-* options can't be combined with --tar");
+    if (zipMode && (fromStdin || tarMode || !recursiveDirs.empty() || !incrementalFileName.empty()))
+        error("--zip can't be combined with --stdin, --tar, --recursive or --incremental");
+    if (zipMode && (ops.printInterpreter || ops.printSoname || ops.printRPath || ops.printNeeded))
+        error("--print-* options can't be combined with --zip");
+    if (fromStdin && !fileNames.empty()) error("--stdin can't be combined with file names");
+    if (!fromStdin && !tarMode && fileNames.empty() && recursiveDirs.empty()) error("missing filename");
+    if (!recursiveDirs.empty() && (fromStdin || tarMode || !outputFileName.empty()))
+        error("--recursive can't be combined with --stdin, --tar or --output");
+    if (!recursiveDirs.empty() && (ops.printInterpreter || ops.printSoname || ops.printRPath || ops.printNeeded))
+        error("--print-* options can't be combined with --recursive");
+    if (!incrementalFileName.empty()) {
+        if (fromStdin || tarMode || !outputFileName.empty())
+            error("--incremental can't be combined with --stdin, --tar or --output");
+        if (ops.printInterpreter || ops.printSoname || ops.printRPath || ops.printNeeded)
+            error("--print-* options can't be combined with --incremental");
+        incrementalState.load(incrementalFileName);
+    }
+    if (!outputFileName.empty() && fileNames.size() > 1)
+        error("--output and --stdout can only be used with a single file");
+    if (outputFileName == "-" && (ops.printInterpreter || ops.printSoname || ops.printRPath || ops.printNeeded))
+        error("--print-* options can't be combined with --stdout");
 
-    patchElf();
+    ops.logLevel = logLevel;
 
-    return 0;
+    return patchElf();
 }
 
 int main(int argc, char * * argv)
@@ -0,0 +1,223 @@
+/*
+ *  libpatchelf: the engine of patchelf, for programs that edit ELF
+ *  files in memory without running patchelf for every file.
+ *  Copyright (C) 2004-2016  Eelco Dolstra <edolstra@gmail.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or (at
+ *  your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PATCHELF_H
+#define PATCHELF_H
+
+#include <string>
+#include <vector>
+#include <set>
+#include <map>
+#include <memory>
+#include <limits>
+#include <stdexcept>
+
+#include <cstring>
+#include <cerrno>
+#include <cstdint>
+
+
+/* Everything is in namespace patchelf, so as not to clash with the
+   names of the programs using the library. */
+namespace patchelf {
+
+
+/* The contents of an ELF file.  It is edited in place, and grown
+   within its capacity, since pointers into it must stay valid: keep
+   room reserved as readFile() does, or "maximum file size exceeded"
+   is thrown. */
+typedef std::shared_ptr<std::vector<unsigned char>> FileContents;
+
+
+/* Errors are thrown as std::runtime_error, or as a SysError if a
+   system call failed. */
+struct SysError : std::runtime_error
+{
+    int errNo;
+    SysError(const std::string & msg)
+        : std::runtime_error(msg + ": " + strerror(errno))
+        , errNo(errno)
+    { }
+};
+
+
+/* The operations to apply to a file.  They are applied in the order
+   in which they are listed here. */
+struct Operations
+{
+    bool addGnuHash = false;
+
+    bool printInterpreter = false;
+
+    bool printSoname = false;
+    bool setSoname = false;
+    std::string newSoname;
+
+    std::string newInterpreter; /* empty to leave it alone */
+
+    bool printRPath = false;
+    bool shrinkRPath = false;
+    std::vector<std::string> allowedRpathPrefixes; /* for shrinkRPath */
+    bool removeRPath = false;
+    bool setRPath = false;
+    std::string newRPath;
+    bool forceRPath = false; /* use DT_RPATH rather than DT_RUNPATH */
+
+    bool printNeeded = false;
+    std::set<std::string> neededLibsToRemove;
+    std::map<std::string, std::string> neededLibsToReplace;
+    std::set<std::string> neededLibsToAdd;
+
+    /* DT_FLAGS and DT_FLAGS_1 bits. */
+    uint64_t flagsToSet = 0, flagsToClear = 0;
+    uint64_t flags1ToSet = 0, flags1ToClear = 0;
+
+    /* Rebuild .dynstr with only the strings still in use, sharing
+       common suffixes, after the other edits. */
+    bool compactDynStr = false;
+
+    /* The page size for new segments; 0 for the configured default. */
+    unsigned int pageSize = 0;
+    bool segmentAlign = false;
+    /* Put replaced sections into the space left by old copies, and
+       cut a dead end off the file (dynamic libraries only). */
+    bool gc = false;
+
+    /* How many threads may rewrite a large symbol table; 0 for one
+       per CPU. */
+    unsigned int threads = 0;
+
+    /* Debug output on stderr: 0 for none, 1 for debug, 2 for verbose. */
+    int logLevel = 0;
+};
+
+
+struct Result
+{
+    bool changed = false;
+
+    /* By how many bytes the original contents were moved, for
+       writeOutputFile(). */
+    size_t fileShift = 0;
+
+    /* What the print* operations found.  An empty soname means there
+       is none. */
+    std::string interpreter, soname, rpath;
+    std::vector<std::string> needed;
+};
+
+
+/* Statistics for --stats: the time spent in each phase of processing
+   a file, and what was done to it. */
+struct Stats
+{
+    struct PhaseTime
+    {
+        std::string name;
+        double wallMs, cpuMs;
+    };
+
+    std::vector<PhaseTime> phases; /* in order of first use */
+    uint64_t bytesRead = 0, bytesWritten = 0, bytesCopied = 0;
+    int64_t bytesGrown = 0;
+    unsigned int sectionsReplaced = 0, segmentsAdded = 0;
+
+    /* If set, called for every phase and file span as it completes,
+       e.g. to write a trace; times are in milliseconds. */
+    void (* trace)(const std::string & name, const char * category, double startMs, double durationMs) = 0;
+
+    void addPhase(const std::string & name, double wallMs, double cpuMs)
+    {
+        for (auto & i : phases)
+            if (i.name == name) {
+                i.wallMs += wallMs;
+                i.cpuMs += cpuMs;
+                return;
+            }
+        phases.push_back({name, wallMs, cpuMs});
+    }
+
+    void add(const Stats & other)
+    {
+        for (auto & i : other.phases) addPhase(i.name, i.wallMs, i.cpuMs);
+        bytesRead += other.bytesRead;
+        bytesWritten += other.bytesWritten;
+        bytesCopied += other.bytesCopied;
+        bytesGrown += other.bytesGrown;
+        sectionsReplaced += other.sectionsReplaced;
+        segmentsAdded += other.segmentsAdded;
+    }
+
+    /* Reset everything but 'trace'. */
+    void clear()
+    {
+        auto t = trace;
+        *this = Stats();
+        trace = t;
+    }
+};
+
+
+/* The functions below use no global state: different files can be
+   patched concurrently from different threads.  'stats' is optional
+   everywhere. */
+
+/* Apply 'ops' to the ELF file in 'contents', in place. */
+Result patchElfContents(FileContents contents, const Operations & ops, Stats * stats = 0);
+
+/* Apply 'ops' to a copy of the 'size' bytes at 'data', and return the
+   result; the input is not modified. */
+FileContents patchElfBuffer(const unsigned char * data, size_t size, const Operations & ops,
+    Result * result = 0, Stats * stats = 0);
+
+/* Apply 'ops' to the file open for reading and writing on 'fd', and
+   write it back in place if it changed. */
+Result patchElfFd(int fd, const Operations & ops, Stats * stats = 0);
+
+
+/* Read a file, or at most its first 'cutOff' bytes, with room to
+   grow. */
+FileContents readFile(const std::string & fileName,
+    size_t cutOff = std::numeric_limits<size_t>::max());
+
+/* Read the file open on 'fd' from the start; 'fileName' is for
+   error messages. */
+FileContents readFd(int fd, const std::string & fileName,
+    size_t cutOff = std::numeric_limits<size_t>::max());
+
+/* Read all of standard input. */
+FileContents readStdin();
+
+/* Overwrite a file. */
+void writeFile(const std::string & fileName, FileContents contents, Stats * stats = 0);
+
+void writeStdout(FileContents contents, Stats * stats = 0);
+
+/* Overwrite the file open on 'fd' from the start, and truncate it. */
+void writeFd(int fd, FileContents contents, Stats * stats = 0);
+
+/* Write 'contents' to a new file, copying the blocks that are
+   unchanged from 'inputFileName' (if not empty) where possible;
+   'shift' is Result::fileShift. */
+void writeOutputFile(const std::string & fileName, FileContents contents,
+    const std::string & inputFileName, size_t shift, Stats * stats = 0);
+
+}
+
+#endif
@@ -0,0 +1,139 @@
+/*
+ *  Helpers shared by libpatchelf and the patchelf program: string
+ *  formatting, errors, debug output and the timing of phases.  Not
+ *  installed.
+ */
+
+#ifndef PATCHELF_UTIL_H
+#define PATCHELF_UTIL_H
+
+#include <string>
+#include <vector>
+#include <sstream>
+#include <stdexcept>
+
+#include <cerrno>
+#include <cstring>
+#include <cstdint>
+#include <ctime>
+
+#include "patchelf.h"
+
+
+namespace patchelf {
+
+
+inline void fmt2(std::ostringstream & out)
+{
+}
+
+
+template<typename T, typename... Args>
+void fmt2(std::ostringstream & out, T x, Args... args)
+{
+    out << x;
+    fmt2(out, args...);
+}
+
+
+template<typename... Args>
+std::string fmt(Args... args)
+{
+    std::ostringstream out;
+    fmt2(out, args...);
+    return out.str();
+}
+
+
+__attribute__((noreturn)) inline void error(std::string msg)
+{
+    if (errno)
+        throw SysError(msg);
+    else
+        throw std::runtime_error(msg);
+}
+
+
+inline std::vector<std::string> splitColonDelimitedString(const char * s)
+{
+    std::vector<std::string> parts;
+    const char * pos = s;
+    while (*pos) {
+        const char * end = strchr(pos, ':');
+        if (!end) end = strchr(pos, 0);
+
+        parts.push_back(std::string(pos, end - pos));
+        if (*end == ':') ++end;
+        pos = end;
+    }
+
+    return parts;
+}
+
+
+inline uint64_t roundUp(uint64_t n, uint64_t m)
+{
+    return ((n - 1) / m + 1) * m;
+}
+
+
+inline double clockMs(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+
+/* How much debug output to print (see debug() below). */
+enum { logNone, logDebug, logVerbose };
+
+void debugPrint(const char * format, ...);
+
+/* debug() prints with --debug or PATCHELF_DEBUG=1, verbose() only with
+   PATCHELF_DEBUG=2; use the latter in loops over symbols, sections or
+   entries.  The arguments are only evaluated if the message is
+   printed.  Configuring with --disable-debug-log compiles both out.
+   'logLevel' is a global in patchelf, and a member of ElfFile. */
+#ifndef ENABLE_DEBUG_LOG
+#define ENABLE_DEBUG_LOG 1
+#endif
+
+#if ENABLE_DEBUG_LOG
+#define debugAt(level, ...) \
+    do { if (logLevel >= (level)) debugPrint(__VA_ARGS__); } while (0)
+#else
+#define debugAt(level, ...) \
+    do { if (0) debugPrint(__VA_ARGS__); } while (0)
+#endif
+
+#define debug(...) debugAt(logDebug, __VA_ARGS__)
+#define verbose(...) debugAt(logVerbose, __VA_ARGS__)
+
+
+/* Times the enclosing scope as a phase in 'stats', and passes it to
+   its trace function.  Does nothing if 'stats' is null.  The time of
+   nested phases is subtracted from the enclosing one in the
+   statistics, so that every phase only counts its own work.  A phase
+   with a file name is the span for a whole file; it is only traced. */
+class Phase
+{
+    Stats * stats;
+    const char * name;
+    std::string fileName;
+    Phase * parent;
+    double wallStart, cpuStart;
+    double childWallMs = 0, childCpuMs = 0;
+
+    static thread_local Phase * current;
+
+public:
+
+    Phase(Stats * stats, const char * name, const std::string & fileName = "");
+
+    ~Phase();
+};
+
+}
+
+#endif
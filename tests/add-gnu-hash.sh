@@ -0,0 +1,37 @@
+#! /bin/sh -e
+SCRATCH=scratch/$(basename $0 .sh)
+
+rm -rf ${SCRATCH}
+mkdir -p ${SCRATCH}
+mkdir -p ${SCRATCH}/libsA
+mkdir -p ${SCRATCH}/libsB
+
+cp main ${SCRATCH}/
+cp libfoo.so ${SCRATCH}/libsA/
+cp libbar-sysv-hash.so ${SCRATCH}/libsB/libbar.so
+
+if readelf -d ${SCRATCH}/libsB/libbar.so | grep -q GNU_HASH; then
+    echo "libbar-sysv-hash.so already has a GNU hash table"
+    exit 1
+fi
+
+# Add a GNU hash table to libbar.so, and rebuild the one of libfoo.so.
+../src/patchelf --add-gnu-hash ${SCRATCH}/libsB/libbar.so
+../src/patchelf --add-gnu-hash ${SCRATCH}/libsA/libfoo.so
+
+for lib in ${SCRATCH}/libsB/libbar.so ${SCRATCH}/libsA/libfoo.so; do
+    if ! readelf -d $lib | grep -q GNU_HASH; then
+        echo "$lib has no DT_GNU_HASH entry"
+        exit 1
+    fi
+done
+
+../src/patchelf --force-rpath --set-rpath $(pwd)/${SCRATCH}/libsA:$(pwd)/${SCRATCH}/libsB ${SCRATCH}/main
+
+exitCode=0
+(cd ${SCRATCH} && ./main) || exitCode=$?
+
+if test "$exitCode" != 46; then
+    echo "bad exit code!"
+    exit 1
+fi
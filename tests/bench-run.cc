@@ -0,0 +1,176 @@
+/*
+ *  bench-run: run a command and append one JSON line describing its
+ *  resource usage to a results file.  Used by bench.sh.
+ *
+ *  Reported are the wall clock, user and system time, the peak
+ *  resident set size, and the I/O counters from /proc/PID/io (bytes
+ *  and system calls for reading and writing).  The I/O counters are
+ *  read while the child is a zombie, so they're complete but the
+ *  process hasn't been reaped yet.
+ */
+
+#include <string>
+#include <vector>
+#include <map>
+
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+
+static void usage(const char * progName)
+{
+    fprintf(stderr, "syntax: %s [-o RESULTS] [-l KEY=VALUE]... -- COMMAND [ARGS]...\n", progName);
+}
+
+
+static std::string jsonString(const std::string & s)
+{
+    std::string res = "\"";
+    for (char c : s) {
+        if (c == '"' || c == '\\') res += '\\';
+        if ((unsigned char) c < 0x20) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            res += buf;
+        } else
+            res += c;
+    }
+    return res + '"';
+}
+
+
+/* Read the rchar/wchar/syscr/syscw counters of a process.  Returns
+   an empty map if they're not available (e.g. no CONFIG_TASK_IO_ACCOUNTING). */
+static std::map<std::string, unsigned long long> readIoCounters(pid_t pid)
+{
+    std::map<std::string, unsigned long long> counters;
+    std::string path = "/proc/" + std::to_string(pid) + "/io";
+    FILE * f = fopen(path.c_str(), "r");
+    if (!f) return counters;
+    char name[64];
+    unsigned long long value;
+    while (fscanf(f, "%63[^:]: %llu\n", name, &value) == 2)
+        counters[name] = value;
+    fclose(f);
+    return counters;
+}
+
+
+static double msSince(const struct timespec & start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start.tv_sec) * 1e3 + (now.tv_nsec - start.tv_nsec) / 1e6;
+}
+
+
+static double ms(const struct timeval & tv)
+{
+    return tv.tv_sec * 1e3 + tv.tv_usec / 1e3;
+}
+
+
+int main(int argc, char * * argv)
+{
+    std::string resultsFile;
+    std::vector<std::pair<std::string, std::string>> labels;
+
+    int i;
+    for (i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "-o" && i + 1 < argc)
+            resultsFile = argv[++i];
+        else if (arg == "-l" && i + 1 < argc) {
+            std::string label = argv[++i];
+            size_t eq = label.find('=');
+            if (eq == std::string::npos) {
+                usage(argv[0]);
+                return 125;
+            }
+            labels.push_back({label.substr(0, eq), label.substr(eq + 1)});
+        } else if (arg == "--") {
+            ++i;
+            break;
+        } else {
+            usage(argv[0]);
+            return 125;
+        }
+    }
+
+    if (i == argc) {
+        usage(argv[0]);
+        return 125;
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        return 125;
+    }
+
+    if (pid == 0) {
+        /* The output of --print-* would only add noise. */
+        int fd = open("/dev/null", O_WRONLY);
+        if (fd != -1) dup2(fd, 1);
+        execvp(argv[i], argv + i);
+        perror(argv[i]);
+        _exit(127);
+    }
+
+    /* Wait for the child to exit, but leave it a zombie so that its
+       I/O counters can still be read. */
+    siginfo_t info;
+    while (waitid(P_PID, pid, &info, WEXITED | WNOWAIT) == -1)
+        if (errno != EINTR) {
+            perror("waitid");
+            return 125;
+        }
+    double wallMs = msSince(start);
+
+    auto counters = readIoCounters(pid);
+
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) == -1) {
+        perror("wait4");
+        return 125;
+    }
+
+    int exitCode = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+
+    std::string line = "{";
+    for (auto & l : labels)
+        line += jsonString(l.first) + ": " + jsonString(l.second) + ", ";
+    char buf[256];
+    snprintf(buf, sizeof(buf),
+        "\"exit\": %d, \"wall_ms\": %.3f, \"user_ms\": %.3f, \"sys_ms\": %.3f, \"maxrss_kb\": %ld",
+        exitCode, wallMs, ms(usage.ru_utime), ms(usage.ru_stime), usage.ru_maxrss);
+    line += buf;
+    for (auto name : {"rchar", "wchar", "syscr", "syscw"})
+        if (counters.count(name))
+            line += std::string(", \"") + name + "\": " + std::to_string(counters[name]);
+    line += "}\n";
+
+    if (resultsFile.empty())
+        fputs(line.c_str(), stdout);
+    else {
+        FILE * f = fopen(resultsFile.c_str(), "a");
+        if (!f || fputs(line.c_str(), f) == EOF || fclose(f) != 0) {
+            perror(resultsFile.c_str());
+            return 125;
+        }
+    }
+
+    return exitCode;
+}
@@ -0,0 +1,117 @@
+#! /bin/sh -e
+#
+# Time patchelf's common operations on generated inputs of several
+# sizes.  Run with `make bench' from the build directory.
+#
+# Each run appends one JSON object per line to $BENCH_RESULTS, with
+# the input, the operation, the wall/user/system time, the peak RSS,
+# the I/O counters and the number of PT_LOAD segments in the result.
+#
+# Knobs (environment variables):
+#   BENCH_RESULTS    results file (default bench-results.json)
+#   BENCH_RUNS       runs per input and operation (default 3)
+#   BENCH_LARGE      size of the large inputs, e.g. 4G; empty to skip
+#                    them (default 2G; they're sparse on disk, but
+#                    patchelf reads them into memory)
+#   BENCH_BASELINE   results of an earlier run to compare against
+#   BENCH_THRESHOLD  allowed slowdown in percent (default 20)
+
+SCRATCH=scratch/bench
+BENCH_RESULTS=${BENCH_RESULTS-bench-results.json}
+BENCH_RUNS=${BENCH_RUNS-3}
+BENCH_LARGE=${BENCH_LARGE-2G}
+BENCH_THRESHOLD=${BENCH_THRESHOLD-20}
+
+rm -rf ${SCRATCH}
+mkdir -p ${SCRATCH}
+rm -f ${BENCH_RESULTS}
+
+longPath=$(printf '/%0200d' 0 | tr 0 x)
+
+mediumArgs="--symbols 20000 --symtab 200000 --sections 1000 --needed 50 --verneed 20 --dynstr-size 1M"
+
+inputs="small medium"
+if [ -n "$BENCH_LARGE" ]; then inputs="$inputs large"; fi
+
+for input in $inputs; do
+    case $input in
+        small) args= ;;
+        medium) args=$mediumArgs ;;
+        large) args="$mediumArgs --size $BENCH_LARGE" ;;
+    esac
+
+    for type in exec dyn; do
+        name=$input-$type
+        # The libraries are position-independent executables, so that
+        # --set-interpreter applies to both.
+        ./gen-elf $args --type $type --interpreter /lib/ld.so --soname libbench.so \
+            --rpath /an/rpath/that/is/long/enough/for/the/in-place/case ${SCRATCH}/$name.orig
+
+        for op in parse print-needed print-rpath print-interpreter print-soname \
+            set-rpath-inplace set-rpath-grow add-needed replace-needed set-interpreter
+        do
+            case $op in
+                parse) opArgs= ;;
+                print-*) opArgs=--$op ;;
+                set-rpath-inplace) opArgs="--set-rpath /short" ;;
+                set-rpath-grow) opArgs="--set-rpath $longPath" ;;
+                add-needed) opArgs="--add-needed libextra.so" ;;
+                replace-needed) opArgs="--replace-needed libneeded0.so libreplaced.so" ;;
+                set-interpreter) opArgs="--set-interpreter $longPath" ;;
+            esac
+
+            run=1
+            while [ $run -le $BENCH_RUNS ]; do
+                cp --sparse=always ${SCRATCH}/$name.orig ${SCRATCH}/$name
+                sync ${SCRATCH}/$name 2> /dev/null || true
+                line=$(./bench-run -l input=$name -l op=$op -l run=$run -- \
+                    ../src/patchelf $opArgs ${SCRATCH}/$name)
+                loads=$(readelf -lW ${SCRATCH}/$name | grep -c '^ *LOAD' || true)
+                echo "${line%\}}, \"pt_load\": $loads}" >> ${BENCH_RESULTS}
+                echo "$name $op: $line"
+                run=$((run + 1))
+            done
+        done
+
+        rm -f ${SCRATCH}/$name ${SCRATCH}/$name.orig
+    done
+done
+
+# Compare the fastest run of each input and operation, and the bytes
+# written, against the baseline.
+if [ -n "$BENCH_BASELINE" ]; then
+    awk -v threshold=$BENCH_THRESHOLD '
+        function field(line, name,    s) {
+            if (!match(line, "\"" name "\": \"?[^,}\"]*")) return "";
+            s = substr(line, RSTART, RLENGTH);
+            sub(/^"[^"]*": "?/, "", s);
+            return s;
+        }
+        {
+            key = field($0, "input") " " field($0, "op");
+            wall = field($0, "wall_ms") + 0;
+            if (FILENAME == ARGV[1]) {
+                if (!(key in baseWall) || wall < baseWall[key]) baseWall[key] = wall;
+                baseWritten[key] = field($0, "wchar") + 0;
+            } else {
+                if (!(key in curWall) || wall < curWall[key]) curWall[key] = wall;
+                curWritten[key] = field($0, "wchar") + 0;
+            }
+        }
+        END {
+            failed = 0;
+            for (key in curWall) {
+                if (!(key in baseWall)) continue;
+                # Ignore differences below a millisecond: that is noise.
+                if (curWall[key] > baseWall[key] * (1 + threshold / 100) && curWall[key] - baseWall[key] > 1) {
+                    printf "regression: %s took %.3f ms, baseline %.3f ms\n", key, curWall[key], baseWall[key];
+                    failed = 1;
+                }
+                if (curWritten[key] > baseWritten[key] * (1 + threshold / 100) + 4096) {
+                    printf "regression: %s wrote %d bytes, baseline %d\n", key, curWritten[key], baseWritten[key];
+                    failed = 1;
+                }
+            }
+            exit failed;
+        }' "$BENCH_BASELINE" ${BENCH_RESULTS}
+fi
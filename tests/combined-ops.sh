@@ -0,0 +1,45 @@
+#! /bin/sh -e
+SCRATCH=scratch/$(basename $0 .sh)
+
+rm -rf ${SCRATCH}
+mkdir -p ${SCRATCH}/libsA ${SCRATCH}/libsB
+
+cp main ${SCRATCH}/
+cp libfoo.so ${SCRATCH}/libsA/
+cp libbar.so ${SCRATCH}/libsB/libbar2.so
+cp libsimple.so ${SCRATCH}/libsB/
+
+# Every edit of .dynamic and .dynstr at once, in one run.
+newRPath=$(pwd)/${SCRATCH}/libsB
+../src/patchelf --set-rpath $newRPath --replace-needed libbar.so libbar2.so \
+    --add-needed libsimple.so --set-soname libfoo-new.so --set-flags DF_BIND_NOW \
+    ${SCRATCH}/libsA/libfoo.so
+
+if [ "$(../src/patchelf --print-rpath ${SCRATCH}/libsA/libfoo.so)" != "$newRPath" ]; then
+    echo "wrong RPATH"
+    exit 1
+fi
+if [ "$(../src/patchelf --print-soname ${SCRATCH}/libsA/libfoo.so)" != libfoo-new.so ]; then
+    echo "wrong DT_SONAME"
+    exit 1
+fi
+needed=$(../src/patchelf --print-needed ${SCRATCH}/libsA/libfoo.so | tr '\n' ' ')
+if [ "$needed" != "libsimple.so libbar2.so libc.so.6 " ]; then
+    echo "wrong DT_NEEDED entries: $needed"
+    exit 1
+fi
+if ! readelf -d ${SCRATCH}/libsA/libfoo.so | grep '(FLAGS)' | grep -q BIND_NOW; then
+    echo "DF_BIND_NOW not set"
+    exit 1
+fi
+
+# The result still loads.
+../src/patchelf --set-rpath $(pwd)/${SCRATCH}/libsA ${SCRATCH}/main
+
+exitCode=0
+(cd ${SCRATCH} && ./main) || exitCode=$?
+
+if test "$exitCode" != 46; then
+    echo "bad exit code!"
+    exit 1
+fi
@@ -0,0 +1,63 @@
+#! /bin/sh -e
+SCRATCH=scratch/$(basename $0 .sh)
+
+rm -rf ${SCRATCH}
+mkdir -p ${SCRATCH}/libsA ${SCRATCH}/libsB
+
+cp main ${SCRATCH}/
+cp libfoo.so ${SCRATCH}/libsA/
+cp libbar.so ${SCRATCH}/libsB/
+
+dynStrSize() {
+    readelf -SW "$1" | sed -n 's/.* \.dynstr *STRTAB *[0-9a-f]* [0-9a-f]* \([0-9a-f]*\) .*/\1/p'
+}
+
+# A long RPATH, replaced below by a shorter one: what's left of it in
+# .dynstr is dead.
+longRPath=/some/rpath
+for i in 1 2 3 4 5 6 7 8; do
+    longRPath=$longRPath/that/is/long/enough/$i
+done
+../src/patchelf --set-rpath $longRPath ${SCRATCH}/libsA/libfoo.so
+cp ${SCRATCH}/libsA/libfoo.so ${SCRATCH}/before.so
+before=$(dynStrSize ${SCRATCH}/before.so)
+
+# The final edit and the compaction in one run.
+newRPath=$(pwd)/${SCRATCH}/libsB
+../src/patchelf --set-rpath $newRPath --compact-dynstr ${SCRATCH}/libsA/libfoo.so
+after=$(dynStrSize ${SCRATCH}/libsA/libfoo.so)
+
+if [ $((0x$after)) -ge $((0x$before)) ]; then
+    echo ".dynstr didn't shrink: $before -> $after"
+    exit 1
+fi
+if [ "$(readelf -lW ${SCRATCH}/libsA/libfoo.so | grep -c LOAD)" != "$(readelf -lW ${SCRATCH}/before.so | grep -c LOAD)" ]; then
+    echo "a segment was added"
+    exit 1
+fi
+if [ "$(../src/patchelf --print-rpath ${SCRATCH}/libsA/libfoo.so)" != "$newRPath" ]; then
+    echo "wrong RPATH"
+    exit 1
+fi
+if strings ${SCRATCH}/libsA/libfoo.so | grep -q /some/rpath; then
+    echo "dead strings left in .dynstr"
+    exit 1
+fi
+
+# The symbols and versions are unchanged.
+readelf -W --dyn-syms ${SCRATCH}/before.so > ${SCRATCH}/before.syms
+readelf -W --dyn-syms ${SCRATCH}/libsA/libfoo.so > ${SCRATCH}/after.syms
+cmp ${SCRATCH}/before.syms ${SCRATCH}/after.syms
+readelf -V ${SCRATCH}/before.so | grep -v Offset > ${SCRATCH}/before.versions
+readelf -V ${SCRATCH}/libsA/libfoo.so | grep -v Offset > ${SCRATCH}/after.versions
+cmp ${SCRATCH}/before.versions ${SCRATCH}/after.versions
+
+../src/patchelf --set-rpath $(pwd)/${SCRATCH}/libsA ${SCRATCH}/main
+
+exitCode=0
+(cd ${SCRATCH} && ./main) || exitCode=$?
+
+if test "$exitCode" != 46; then
+    echo "bad exit code!"
+    exit 1
+fi
@@ -0,0 +1,44 @@
+#! /bin/sh -e
+SCRATCH=scratch/$(basename $0 .sh)
+
+rm -rf ${SCRATCH}
+mkdir -p ${SCRATCH}
+
+cp simple ${SCRATCH}/
+cp libsimple.so ${SCRATCH}/
+
+flagsOf() {
+    readelf -d "$1" | grep "($2)" || true
+}
+
+# Set bits in both DT_FLAGS and DT_FLAGS_1 in one go.
+../src/patchelf --set-flags DF_BIND_NOW,DF_1_NOW --set-flags DF_1_NODELETE ${SCRATCH}/libsimple.so
+if ! flagsOf ${SCRATCH}/libsimple.so FLAGS | grep -q BIND_NOW; then
+    echo "DF_BIND_NOW not set"
+    exit 1
+fi
+if ! flagsOf ${SCRATCH}/libsimple.so FLAGS_1 | grep -q 'NOW NODELETE'; then
+    echo "DF_1_NOW or DF_1_NODELETE not set"
+    exit 1
+fi
+
+# Clear one of them again, and set the one --no-default-lib sets.
+../src/patchelf --clear-flags DF_1_NODELETE --no-default-lib ${SCRATCH}/libsimple.so
+flags1=$(flagsOf ${SCRATCH}/libsimple.so FLAGS_1)
+if echo "$flags1" | grep -q NODELETE || ! echo "$flags1" | grep -q NODEFLIB; then
+    echo "wrong DT_FLAGS_1: $flags1"
+    exit 1
+fi
+
+# Eager binding on an executable that already has DT_FLAGS_1.
+../src/patchelf --set-flags DF_BIND_NOW,DF_1_NOW ${SCRATCH}/simple
+if ! flagsOf ${SCRATCH}/simple FLAGS_1 | grep -q NOW; then
+    echo "DF_1_NOW not set on executable"
+    exit 1
+fi
+${SCRATCH}/simple
+
+if ../src/patchelf --set-flags DF_BOGUS ${SCRATCH}/simple 2> /dev/null; then
+    echo "unknown flag accepted"
+    exit 1
+fi
@@ -0,0 +1,32 @@
+#! /bin/sh -e
+SCRATCH=scratch/$(basename $0 .sh)
+
+# A non-PIE executable patched twice: the first run adds room at the
+# start of the file, and the second one puts the replaced sections,
+# including the writable .dynamic, into that room.
+
+rm -rf ${SCRATCH}
+mkdir -p ${SCRATCH}
+
+oldInterpreter=$(../src/patchelf --print-interpreter ./simple-no-pie)
+longInterpreter=$(dirname "$oldInterpreter")/../$(basename $(dirname "$oldInterpreter"))/$(basename "$oldInterpreter")
+longRPath=/$(printf 'x%.0s' $(seq 200))
+
+for second in "--add-needed libm.so.6" "--set-rpath $longRPath"; do
+    cp simple-no-pie ${SCRATCH}/simple
+    ../src/patchelf --set-interpreter "$longInterpreter" ${SCRATCH}/simple
+    ${SCRATCH}/simple
+    ../src/patchelf $second ${SCRATCH}/simple
+    ${SCRATCH}/simple
+
+    # Every PT_LOAD covering .dynamic must be writable.
+    dynamic=$(readelf -lW ${SCRATCH}/simple | awk '$1 == "DYNAMIC" { print $2 }')
+    readelf -lW ${SCRATCH}/simple | grep ' LOAD ' | while read type offset vaddr paddr filesz rest; do
+        if [ $((offset)) -le $((dynamic)) ] && [ $((dynamic)) -lt $((offset + filesz)) ]; then
+            case "$rest" in
+                *W*) ;;
+                *) echo "segment at $offset maps .dynamic but isn't writable"; exit 1 ;;
+            esac
+        fi
+    done
+done
@@ -0,0 +1,75 @@
+#! /bin/sh -e
+SCRATCH=scratch/$(basename $0 .sh)
+
+rm -rf ${SCRATCH}
+mkdir -p ${SCRATCH}/libsA ${SCRATCH}/libsB
+
+cp main ${SCRATCH}/
+cp libfoo.so ${SCRATCH}/libsA/
+cp libfoo.so ${SCRATCH}/plain.so
+cp libbar.so ${SCRATCH}/libsB/
+
+loads() {
+    readelf -lW "$1" | grep -c LOAD
+}
+
+# Every round needs a longer RPATH, so .dynstr moves each time.  The
+# old RPATHs are dropped from .dynstr by --compact-dynstr, and the old
+# copies of .dynstr from the file by --gc.
+rpath=$(pwd)/${SCRATCH}/libsB
+for i in 1 2 3 4 5 6 7 8; do
+    rpath=$rpath:/nonexistent/round/$i/of/growing/the/rpath
+    ../src/patchelf --gc --compact-dynstr --set-rpath $rpath ${SCRATCH}/libsA/libfoo.so
+    ../src/patchelf --set-rpath $rpath ${SCRATCH}/plain.so
+    if [ $i = 2 ]; then
+        firstSize=$(stat -c %s ${SCRATCH}/libsA/libfoo.so)
+        firstLoads=$(loads ${SCRATCH}/libsA/libfoo.so)
+    fi
+done
+
+size=$(stat -c %s ${SCRATCH}/libsA/libfoo.so)
+plainSize=$(stat -c %s ${SCRATCH}/plain.so)
+echo "size with --gc: $firstSize -> $size, without: $plainSize"
+
+# From the second round on, when .dynstr has settled at the end of the
+# file, only the RPATH itself grew (by 6 * 39 bytes).
+if [ $((size - firstSize)) -gt 300 ]; then
+    echo "the file kept growing with --gc"
+    exit 1
+fi
+if [ $size -ge $plainSize ]; then
+    echo "--gc didn't make the file smaller"
+    exit 1
+fi
+if [ "$(loads ${SCRATCH}/libsA/libfoo.so)" != "$firstLoads" ]; then
+    echo "segments were added"
+    exit 1
+fi
+if [ "$(../src/patchelf --print-rpath ${SCRATCH}/libsA/libfoo.so)" != "$rpath" ]; then
+    echo "wrong RPATH"
+    exit 1
+fi
+
+# Given on its own, --gc cuts off the dead end of the file, and leaves
+# a file without one alone.
+cp ${SCRATCH}/libsA/libfoo.so ${SCRATCH}/before.so
+../src/patchelf --gc ${SCRATCH}/libsA/libfoo.so
+cmp ${SCRATCH}/before.so ${SCRATCH}/libsA/libfoo.so
+
+../src/patchelf --set-rpath /short ${SCRATCH}/plain.so
+plainSize=$(stat -c %s ${SCRATCH}/plain.so)
+../src/patchelf --gc --set-rpath $rpath ${SCRATCH}/plain.so
+if [ $(stat -c %s ${SCRATCH}/plain.so) -ge $plainSize ]; then
+    echo "--gc didn't drop the dead end of the file"
+    exit 1
+fi
+
+../src/patchelf --set-rpath $(pwd)/${SCRATCH}/libsA ${SCRATCH}/main
+
+exitCode=0
+(cd ${SCRATCH} && ./main) || exitCode=$?
+
+if test "$exitCode" != 46; then
+    echo "bad exit code!"
+    exit 1
+fi
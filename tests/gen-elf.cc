@@ -0,0 +1,471 @@
+/*
+ *  gen-elf: write synthetic ELF files for testing and benchmarking
+ *  patchelf, without needing a toolchain for the target.
+ *
+ *  The generated files are structurally valid (headers, segments,
+ *  dynamic section, symbol and version tables) but contain no real
+ *  code, so they can't be run.  Each dimension that patchelf's cost
+ *  depends on can be set independently; see usage() below.
+ */
+
+#include <string>
+#include <vector>
+#include <stdexcept>
+
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "elf.h"
+
+
+struct Options
+{
+    bool is32Bit = false;
+    bool bigEndian = false;
+    bool executable = false;
+    unsigned int extraSections = 0;
+    unsigned int symbols = 16;
+    unsigned int symtabSymbols = 0;
+    unsigned int needed = 2;
+    size_t dynstrSize = 0;
+    unsigned int phdrs = 0;
+    size_t fileSize = 0;
+    unsigned int verneed = 0;
+    unsigned long long align = 4096;
+    std::string soname;
+    std::string interpreter;
+    std::string rpath;
+    std::string output;
+};
+
+
+static void usage(const char * progName)
+{
+    fprintf(stderr, "syntax: %s [options] OUTPUT\n\
+  [--class 32|64]\t\tELF class (default 64)\n\
+  [--data lsb|msb]\t\tByte order (default lsb)\n\
+  [--type exec|dyn]\t\tET_EXEC or ET_DYN (default dyn)\n\
+  [--sections N]\t\tNumber of extra (non-allocated) sections\n\
+  [--symbols N]\t\t\tNumber of dynamic symbols\n\
+  [--symtab N]\t\t\tNumber of symbols in .symtab (default none)\n\
+  [--needed N]\t\t\tNumber of DT_NEEDED entries (libneeded0.so, ...)\n\
+  [--dynstr-size SIZE]\t\tPad .dynstr to at least SIZE bytes\n\
+  [--phdrs N]\t\t\tPad the program header table to N entries\n\
+  [--size SIZE]\t\t\tPad the file to at least SIZE bytes (sparse)\n\
+  [--verneed N]\t\t\tNumber of version-needed records\n\
+  [--align N]\t\t\tPT_LOAD alignment (default 4096)\n\
+  [--soname SONAME]\n\
+  [--interpreter PATH]\t\t(default /lib/ld.so for executables)\n\
+  [--rpath RPATH]\n\
+SIZE may have a K, M or G suffix.\n", progName);
+}
+
+
+static unsigned long long parseSize(const char * s)
+{
+    char * end;
+    errno = 0;
+    unsigned long long n = strtoull(s, &end, 0);
+    if (errno || end == s) throw std::runtime_error(std::string("invalid size '") + s + "'");
+    switch (*end) {
+        case 'G': n <<= 10; /* fall through */
+        case 'M': n <<= 10; /* fall through */
+        case 'K': n <<= 10; end++; break;
+    }
+    if (*end) throw std::runtime_error(std::string("invalid size '") + s + "'");
+    return n;
+}
+
+
+static size_t roundUp(size_t n, size_t m)
+{
+    return (n + m - 1) / m * m;
+}
+
+
+static uint32_t sysvHash(const char * name)
+{
+    uint32_t h = 0, g;
+    for (; *name; name++) {
+        h = (h << 4) + (unsigned char) *name;
+        if ((g = h & 0xf0000000)) h ^= g >> 24;
+        h &= ~g;
+    }
+    return h;
+}
+
+
+template<class Elf_Ehdr, class Elf_Phdr, class Elf_Shdr, class Elf_Addr,
+    class Elf_Dyn, class Elf_Sym, class Elf_Verneed, class Elf_Vernaux>
+class Generator
+{
+    const Options & opts;
+
+    std::vector<unsigned char> out;
+
+    /* Section headers and names, in file order. */
+    std::vector<Elf_Shdr> shdrs;
+    std::string shstrtab;
+
+    /* Store an integer in the target byte order. */
+    template<class I>
+    void wr(I & field, unsigned long long value)
+    {
+        I v = (I) value;
+        unsigned char * p = (unsigned char *) &field;
+        for (unsigned int n = 0; n < sizeof(I); ++n)
+            p[opts.bigEndian ? sizeof(I) - n - 1 : n] = (unsigned char) (v >> (n * 8));
+    }
+
+    template<class T>
+    T * at(size_t offset)
+    {
+        return (T *) (out.data() + offset);
+    }
+
+    size_t append(size_t size, size_t alignment)
+    {
+        size_t offset = roundUp(out.size(), alignment);
+        out.resize(offset + size, 0);
+        return offset;
+    }
+
+    unsigned int addSection(const std::string & name, unsigned int type,
+        unsigned long long flags, Elf_Addr addr, size_t offset, size_t size,
+        unsigned int link, unsigned int info, size_t alignment, size_t entSize)
+    {
+        Elf_Shdr shdr;
+        memset(&shdr, 0, sizeof(shdr));
+        wr(shdr.sh_name, shstrtab.size());
+        wr(shdr.sh_type, type);
+        wr(shdr.sh_flags, flags);
+        wr(shdr.sh_addr, addr);
+        wr(shdr.sh_offset, offset);
+        wr(shdr.sh_size, size);
+        wr(shdr.sh_link, link);
+        wr(shdr.sh_info, info);
+        wr(shdr.sh_addralign, alignment);
+        wr(shdr.sh_entsize, entSize);
+        shstrtab += name + '\0';
+        shdrs.push_back(shdr);
+        return shdrs.size() - 1;
+    }
+
+public:
+
+    Generator(const Options & opts) : opts(opts) { }
+
+    void generate()
+    {
+        bool exec = opts.executable;
+        Elf_Addr base = exec ? (opts.is32Bit ? 0x08048000 : 0x400000) : 0;
+        if (base % opts.align) base = roundUp(base, opts.align);
+
+        /* Program headers: PT_PHDR, [PT_INTERP], 2 x PT_LOAD,
+           PT_DYNAMIC, padded with PT_NULL. */
+        std::string interpreter = opts.interpreter;
+        if (interpreter.empty() && exec) interpreter = "/lib/ld.so";
+        unsigned int phnum = 4 + !interpreter.empty();
+        if (opts.phdrs > phnum) phnum = opts.phdrs;
+
+        out.resize(sizeof(Elf_Ehdr) + phnum * sizeof(Elf_Phdr), 0);
+        shdrs.resize(1);
+        memset(&shdrs[0], 0, sizeof(Elf_Shdr));
+        shstrtab = std::string(1, '\0');
+
+        /* Lay out the strings of .dynstr. */
+        std::string dynstr(1, '\0');
+        auto addString = [&](const std::string & s) {
+            size_t pos = dynstr.size();
+            dynstr += s + '\0';
+            return pos;
+        };
+        std::vector<size_t> neededNames, symNames, versionNames;
+        for (unsigned int i = 0; i < opts.needed; ++i)
+            neededNames.push_back(addString("libneeded" + std::to_string(i) + ".so"));
+        for (unsigned int i = 0; i < opts.symbols; ++i)
+            symNames.push_back(addString("symbol" + std::to_string(i)));
+        for (unsigned int i = 0; i < opts.verneed; ++i)
+            versionNames.push_back(addString("VERS_" + std::to_string(i)));
+        size_t sonameStr = opts.soname.empty() ? 0 : addString(opts.soname);
+        size_t rpathStr = opts.rpath.empty() ? 0 : addString(opts.rpath);
+        while (dynstr.size() < opts.dynstrSize)
+            addString(std::string(std::min<size_t>(63, opts.dynstrSize - dynstr.size()), 'x'));
+
+        unsigned int nsyms = opts.symbols + 1;
+
+        /* The read-only/executable segment: headers, .interp, .hash,
+           .dynsym, .dynstr, .gnu.version, .gnu.version_r and .text. */
+        unsigned int interpIndex = 0;
+        size_t interpOff = 0;
+        if (!interpreter.empty()) {
+            interpOff = append(interpreter.size() + 1, 1);
+            memcpy(at<char>(interpOff), interpreter.c_str(), interpreter.size() + 1);
+            interpIndex = addSection(".interp", SHT_PROGBITS, SHF_ALLOC, base + interpOff,
+                interpOff, interpreter.size() + 1, 0, 0, 1, 0);
+        }
+
+        unsigned int nbucket = nsyms / 2 + 1;
+        size_t hashOff = append((2 + nbucket + nsyms) * 4, 4);
+        /* .hash links to .dynsym, which links to .dynstr; they
+           are added in that order. */
+        addSection(".hash", SHT_HASH, SHF_ALLOC, base + hashOff,
+            hashOff, (2 + nbucket + nsyms) * 4, shdrs.size() + 1, 0, 4, 4);
+
+        size_t dynsymOff = append(nsyms * sizeof(Elf_Sym), sizeof(Elf_Addr));
+        unsigned int dynsymIndex = addSection(".dynsym", SHT_DYNSYM, SHF_ALLOC, base + dynsymOff,
+            dynsymOff, nsyms * sizeof(Elf_Sym), shdrs.size() + 1, 1, sizeof(Elf_Addr), sizeof(Elf_Sym));
+
+        size_t dynstrOff = append(dynstr.size(), 1);
+        memcpy(at<char>(dynstrOff), dynstr.data(), dynstr.size());
+        unsigned int dynstrIndex = addSection(".dynstr", SHT_STRTAB, SHF_ALLOC, base + dynstrOff,
+            dynstrOff, dynstr.size(), 0, 0, 1, 0);
+
+        size_t versymOff = append(nsyms * 2, 2);
+        addSection(".gnu.version", SHT_GNU_versym, SHF_ALLOC, base + versymOff,
+            versymOff, nsyms * 2, dynsymIndex, 0, 2, 2);
+
+        size_t verneedSize = opts.verneed * (sizeof(Elf_Verneed) + sizeof(Elf_Vernaux));
+        size_t verneedOff = append(verneedSize, sizeof(Elf_Addr));
+        if (opts.verneed)
+            addSection(".gnu.version_r", SHT_GNU_verneed, SHF_ALLOC, base + verneedOff,
+                verneedOff, verneedSize, dynstrIndex, opts.verneed, sizeof(Elf_Addr), 0);
+
+        size_t textOff = append(16 * (opts.symbols + 1), 16);
+        unsigned int textIndex = addSection(".text", SHT_PROGBITS, SHF_ALLOC | SHF_EXECINSTR, base + textOff,
+            textOff, 16 * (opts.symbols + 1), 0, 0, 16, 0);
+        size_t textEnd = out.size();
+
+        /* The writable segment, on the next page: .dynamic. */
+        std::vector<std::pair<unsigned long long, unsigned long long>> dyns;
+        for (auto & name : neededNames) dyns.push_back({DT_NEEDED, name});
+        if (!opts.soname.empty()) dyns.push_back({DT_SONAME, sonameStr});
+        if (!opts.rpath.empty()) dyns.push_back({DT_RUNPATH, rpathStr});
+        dyns.push_back({DT_HASH, base + hashOff});
+        dyns.push_back({DT_STRTAB, base + dynstrOff});
+        dyns.push_back({DT_SYMTAB, base + dynsymOff});
+        dyns.push_back({DT_STRSZ, dynstr.size()});
+        dyns.push_back({DT_SYMENT, sizeof(Elf_Sym)});
+        dyns.push_back({DT_VERSYM, base + versymOff});
+        if (opts.verneed) {
+            dyns.push_back({DT_VERNEED, base + verneedOff});
+            dyns.push_back({DT_VERNEEDNUM, opts.verneed});
+        }
+        dyns.push_back({DT_NULL, 0});
+
+        size_t dynamicOff = append(dyns.size() * sizeof(Elf_Dyn), 4096);
+        addSection(".dynamic", SHT_DYNAMIC, SHF_ALLOC | SHF_WRITE, base + dynamicOff,
+            dynamicOff, dyns.size() * sizeof(Elf_Dyn), dynstrIndex, 0, sizeof(Elf_Addr), sizeof(Elf_Dyn));
+        size_t dataEnd = out.size();
+
+        for (unsigned int i = 0; i < dyns.size(); ++i) {
+            Elf_Dyn * dyn = at<Elf_Dyn>(dynamicOff) + i;
+            wr(dyn->d_tag, dyns[i].first);
+            wr(dyn->d_un.d_val, dyns[i].second);
+        }
+
+        /* Non-allocated sections: the extra ones, .symtab/.strtab,
+           the padding and .shstrtab. */
+        for (unsigned int i = 0; i < opts.extraSections; ++i) {
+            size_t off = append(16, 1);
+            addSection(".extra." + std::to_string(i), SHT_PROGBITS, 0, 0, off, 16, 0, 0, 1, 0);
+        }
+
+        if (opts.symtabSymbols) {
+            /* Section symbols for the allocated sections, then the
+               rest as global functions in .text. */
+            std::string strtab(1, '\0');
+            unsigned int nlocals = 1 + textIndex;
+            unsigned int n = std::max(opts.symtabSymbols, nlocals);
+            size_t symtabOff = append(n * sizeof(Elf_Sym), sizeof(Elf_Addr));
+            for (unsigned int i = 1; i < n; ++i) {
+                Elf_Sym * sym = at<Elf_Sym>(symtabOff) + i;
+                if (i < nlocals) {
+                    wr(sym->st_info, ELF32_ST_INFO(STB_LOCAL, STT_SECTION));
+                    wr(sym->st_shndx, i);
+                    Elf_Shdr & shdr = shdrs[i];
+                    sym->st_value = shdr.sh_addr;
+                } else {
+                    wr(sym->st_name, strtab.size());
+                    strtab += "local_symbol" + std::to_string(i) + '\0';
+                    wr(sym->st_info, ELF32_ST_INFO(STB_GLOBAL, STT_FUNC));
+                    wr(sym->st_shndx, textIndex);
+                    wr(sym->st_value, base + textOff + 16 * (i % (opts.symbols + 1)));
+                }
+            }
+            unsigned int strtabIndex = shdrs.size() + 1;
+            addSection(".symtab", SHT_SYMTAB, 0, 0, symtabOff, n * sizeof(Elf_Sym),
+                strtabIndex, nlocals, sizeof(Elf_Addr), sizeof(Elf_Sym));
+            size_t strtabOff = append(strtab.size(), 1);
+            memcpy(at<char>(strtabOff), strtab.data(), strtab.size());
+            addSection(".strtab", SHT_STRTAB, 0, 0, strtabOff, strtab.size(), 0, 0, 1, 0);
+        }
+
+        /* The padding is written as a hole (see write()); only
+           .shstrtab and the section headers come after it. */
+        size_t padOff = out.size(), padSize = 0;
+        if (opts.fileSize > out.size()) {
+            padSize = opts.fileSize - out.size();
+            addSection(".padding", SHT_PROGBITS, 0, 0, padOff, padSize, 0, 0, 1, 0);
+        }
+
+        unsigned int shstrtabIndex = addSection(".shstrtab", SHT_STRTAB, 0, 0, 0, 0, 0, 0, 1, 0);
+        size_t shstrtabOff = append(shstrtab.size(), 1);
+        memcpy(at<char>(shstrtabOff), shstrtab.data(), shstrtab.size());
+        wr(shdrs[shstrtabIndex].sh_offset, padSize + shstrtabOff);
+        wr(shdrs[shstrtabIndex].sh_size, shstrtab.size());
+
+        size_t shoff = append(shdrs.size() * sizeof(Elf_Shdr), sizeof(Elf_Addr));
+
+        /* Fill in the symbol, hash and version tables. */
+        std::vector<uint32_t> buckets(nbucket, 0), chain(nsyms, 0);
+        uint16_t * versyms = at<uint16_t>(versymOff);
+        for (unsigned int i = 1; i < nsyms; ++i) {
+            Elf_Sym * sym = at<Elf_Sym>(dynsymOff) + i;
+            wr(sym->st_name, symNames[i - 1]);
+            wr(sym->st_info, ELF32_ST_INFO(STB_GLOBAL, STT_FUNC));
+            wr(sym->st_shndx, textIndex);
+            wr(sym->st_value, base + textOff + 16 * i);
+            wr(sym->st_size, 16);
+            wr(versyms[i], 1);
+            unsigned int b = sysvHash(dynstr.c_str() + symNames[i - 1]) % nbucket;
+            chain[i] = buckets[b];
+            buckets[b] = i;
+        }
+        uint32_t * hash = at<uint32_t>(hashOff);
+        wr(hash[0], nbucket);
+        wr(hash[1], nsyms);
+        for (unsigned int i = 0; i < nbucket; ++i) wr(hash[2 + i], buckets[i]);
+        for (unsigned int i = 0; i < nsyms; ++i) wr(hash[2 + nbucket + i], chain[i]);
+
+        for (unsigned int i = 0; i < opts.verneed; ++i) {
+            Elf_Verneed * need = (Elf_Verneed *) (at<unsigned char>(verneedOff)
+                + i * (sizeof(Elf_Verneed) + sizeof(Elf_Vernaux)));
+            Elf_Vernaux * aux = (Elf_Vernaux *) (need + 1);
+            wr(need->vn_version, 1);
+            wr(need->vn_cnt, 1);
+            wr(need->vn_file, opts.needed ? neededNames[i % opts.needed] : 0);
+            wr(need->vn_aux, sizeof(Elf_Verneed));
+            wr(need->vn_next, i + 1 < opts.verneed ? sizeof(Elf_Verneed) + sizeof(Elf_Vernaux) : 0);
+            wr(aux->vna_hash, sysvHash(dynstr.c_str() + versionNames[i]));
+            wr(aux->vna_other, i + 2);
+            wr(aux->vna_name, versionNames[i]);
+        }
+
+        for (unsigned int i = 0; i < shdrs.size(); ++i)
+            *(at<Elf_Shdr>(shoff) + i) = shdrs[i];
+
+        /* Program headers. */
+        Elf_Phdr * phdr = at<Elf_Phdr>(sizeof(Elf_Ehdr));
+        auto addSegment = [&](unsigned int type, unsigned int flags, size_t offset, size_t size,
+            size_t memSize, unsigned long long alignment)
+        {
+            wr(phdr->p_type, type);
+            wr(phdr->p_flags, flags);
+            wr(phdr->p_offset, offset);
+            wr(phdr->p_vaddr, base + offset);
+            wr(phdr->p_paddr, base + offset);
+            wr(phdr->p_filesz, size);
+            wr(phdr->p_memsz, memSize);
+            wr(phdr->p_align, alignment);
+            phdr++;
+        };
+        addSegment(PT_PHDR, PF_R, sizeof(Elf_Ehdr), phnum * sizeof(Elf_Phdr), phnum * sizeof(Elf_Phdr), sizeof(Elf_Addr));
+        if (interpIndex)
+            addSegment(PT_INTERP, PF_R, interpOff, interpreter.size() + 1, interpreter.size() + 1, 1);
+        addSegment(PT_LOAD, PF_R | PF_X, 0, textEnd, textEnd, opts.align);
+        addSegment(PT_LOAD, PF_R | PF_W, dynamicOff, dataEnd - dynamicOff, dataEnd - dynamicOff + 64, opts.align);
+        addSegment(PT_DYNAMIC, PF_R | PF_W, dynamicOff, dyns.size() * sizeof(Elf_Dyn), dyns.size() * sizeof(Elf_Dyn), sizeof(Elf_Addr));
+
+        /* The ELF header. */
+        Elf_Ehdr * hdr = at<Elf_Ehdr>(0);
+        memcpy(hdr->e_ident, ELFMAG, SELFMAG);
+        hdr->e_ident[EI_CLASS] = opts.is32Bit ? ELFCLASS32 : ELFCLASS64;
+        hdr->e_ident[EI_DATA] = opts.bigEndian ? ELFDATA2MSB : ELFDATA2LSB;
+        hdr->e_ident[EI_VERSION] = EV_CURRENT;
+        wr(hdr->e_type, exec ? ET_EXEC : ET_DYN);
+        wr(hdr->e_machine, opts.is32Bit
+            ? (opts.bigEndian ? EM_PPC : EM_386)
+            : (opts.bigEndian ? EM_PPC64 : EM_X86_64));
+        wr(hdr->e_version, EV_CURRENT);
+        wr(hdr->e_entry, exec ? base + textOff : 0);
+        wr(hdr->e_phoff, sizeof(Elf_Ehdr));
+        wr(hdr->e_shoff, padSize + shoff);
+        wr(hdr->e_ehsize, sizeof(Elf_Ehdr));
+        wr(hdr->e_phentsize, sizeof(Elf_Phdr));
+        wr(hdr->e_phnum, phnum);
+        wr(hdr->e_shentsize, sizeof(Elf_Shdr));
+        wr(hdr->e_shnum, shdrs.size());
+        wr(hdr->e_shstrndx, shstrtabIndex);
+
+        write(padOff, padSize);
+    }
+
+    /* Write the file, with a hole of 'padSize' bytes at 'padOff'. */
+    void write(size_t padOff, size_t padSize)
+    {
+        int fd = open(opts.output.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0777);
+        if (fd == -1) throw std::runtime_error("opening '" + opts.output + "': " + strerror(errno));
+        if (pwrite(fd, out.data(), padOff, 0) != (ssize_t) padOff ||
+            pwrite(fd, out.data() + padOff, out.size() - padOff, padOff + padSize) != (ssize_t) (out.size() - padOff))
+            throw std::runtime_error("writing '" + opts.output + "': " + strerror(errno));
+        if (close(fd) != 0)
+            throw std::runtime_error("closing '" + opts.output + "': " + strerror(errno));
+    }
+};
+
+
+int main(int argc, char * * argv)
+{
+    Options opts;
+
+    try {
+        for (int i = 1; i < argc; ++i) {
+            std::string arg(argv[i]);
+            auto next = [&]() {
+                if (++i == argc) throw std::runtime_error("missing argument to " + arg);
+                return std::string(argv[i]);
+            };
+            if (arg == "--class") opts.is32Bit = next() == "32";
+            else if (arg == "--data") opts.bigEndian = next() == "msb";
+            else if (arg == "--type") opts.executable = next() == "exec";
+            else if (arg == "--sections") opts.extraSections = parseSize(next().c_str());
+            else if (arg == "--symbols") opts.symbols = parseSize(next().c_str());
+            else if (arg == "--symtab") opts.symtabSymbols = parseSize(next().c_str());
+            else if (arg == "--needed") opts.needed = parseSize(next().c_str());
+            else if (arg == "--dynstr-size") opts.dynstrSize = parseSize(next().c_str());
+            else if (arg == "--phdrs") opts.phdrs = parseSize(next().c_str());
+            else if (arg == "--size") opts.fileSize = parseSize(next().c_str());
+            else if (arg == "--verneed") opts.verneed = parseSize(next().c_str());
+            else if (arg == "--align") opts.align = parseSize(next().c_str());
+            else if (arg == "--soname") opts.soname = next();
+            else if (arg == "--interpreter") opts.interpreter = next();
+            else if (arg == "--rpath") opts.rpath = next();
+            else if (arg == "--help" || arg == "-h") { usage(argv[0]); return 0; }
+            else if (opts.output.empty() && arg[0] != '-') opts.output = arg;
+            else throw std::runtime_error("unknown argument '" + arg + "'");
+        }
+
+        if (opts.output.empty()) {
+            usage(argv[0]);
+            return 1;
+        }
+
+        if (opts.is32Bit)
+            Generator<Elf32_Ehdr, Elf32_Phdr, Elf32_Shdr, Elf32_Addr, Elf32_Dyn, Elf32_Sym, Elf32_Verneed, Elf32_Vernaux>(opts).generate();
+        else
+            Generator<Elf64_Ehdr, Elf64_Phdr, Elf64_Shdr, Elf64_Addr, Elf64_Dyn, Elf64_Sym, Elf64_Verneed, Elf64_Vernaux>(opts).generate();
+    } catch (std::exception & e) {
+        fprintf(stderr, "gen-elf: %s\n", e.what());
+        return 1;
+    }
+
+    return 0;
+}
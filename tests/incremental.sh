@@ -0,0 +1,59 @@
+#! /bin/sh -e
+SCRATCH=scratch/$(basename $0 .sh)
+
+rm -rf ${SCRATCH}
+mkdir -p ${SCRATCH}
+
+cp libfoo.so libbar.so ${SCRATCH}/
+state=${SCRATCH}/state
+
+# --stats prints a record for every file that was patched, not for
+# the skipped ones.
+patchedFiles() {
+    grep -c '^{"file": ' ${SCRATCH}/stderr || true
+}
+
+../src/patchelf --stats=json --incremental $state --set-rpath /first ${SCRATCH}/libfoo.so ${SCRATCH}/libbar.so 2> ${SCRATCH}/stderr
+if [ "$(patchedFiles)" != 2 ]; then
+    echo "files not patched the first time"
+    exit 1
+fi
+
+# The files were just written, but the state is only saved once their
+# timestamps can tell a later change apart, so a stat() is enough.
+../src/patchelf --stats=json --incremental $state --set-rpath /first ${SCRATCH}/libfoo.so ${SCRATCH}/libbar.so 2> ${SCRATCH}/stderr
+if [ "$(patchedFiles)" != 0 ]; then
+    echo "unchanged files patched again"
+    exit 1
+fi
+
+# An ambiguous entry is patched again, unless the start of the file is
+# checked instead.
+sed 's/^\([0-9]* [0-9]* [0-9]* [0-9]* \([0-9]*\)\) [0-9]* /\1 \2 /' $state > $state.racy
+mv $state.racy $state
+../src/patchelf --stats=json --incremental $state --incremental-verify --set-rpath /first ${SCRATCH}/libfoo.so ${SCRATCH}/libbar.so 2> ${SCRATCH}/stderr
+if [ "$(patchedFiles)" != 0 ]; then
+    echo "unchanged files patched again with --incremental-verify"
+    exit 1
+fi
+sed 's/^\([0-9]* [0-9]* [0-9]* [0-9]* \([0-9]*\)\) [0-9]* /\1 \2 /' $state > $state.racy
+mv $state.racy $state
+../src/patchelf --stats=json --incremental $state --set-rpath /first ${SCRATCH}/libfoo.so ${SCRATCH}/libbar.so 2> ${SCRATCH}/stderr
+if [ "$(patchedFiles)" != 2 ]; then
+    echo "ambiguous files not patched again"
+    exit 1
+fi
+
+# Other operations, or a modified file, are patched.
+../src/patchelf --stats=json --incremental $state --set-rpath /second ${SCRATCH}/libfoo.so 2> ${SCRATCH}/stderr
+if [ "$(../src/patchelf --print-rpath ${SCRATCH}/libfoo.so)" != /second ]; then
+    echo "different operations skipped"
+    exit 1
+fi
+
+cat libbar.so > ${SCRATCH}/libbar.so
+../src/patchelf --stats=json --incremental $state --incremental-verify --set-rpath /first ${SCRATCH}/libbar.so 2> ${SCRATCH}/stderr
+if [ "$(../src/patchelf --print-rpath ${SCRATCH}/libbar.so)" != /first ]; then
+    echo "modified file skipped"
+    exit 1
+fi
@@ -0,0 +1,231 @@
+/*
+ *  libpatchelf-c-test: exercise the C interface of the library on a
+ *  shared library.  Used by libpatchelf-c.sh.
+ *
+ *  Patches OUT-fd.so (a copy of LIBRARY made by the caller) in place
+ *  through a file descriptor, patches LIBRARY in memory and writes it
+ *  to OUT-mem.so, checks the errors, and patches the library from
+ *  several threads at once, each with its own handle.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <elf.h>
+#include <sys/stat.h>
+
+#include "patchelf-c.h"
+
+
+static int failed = 0;
+
+static void check(int ok, const char * what)
+{
+    if (!ok) {
+        fprintf(stderr, "libpatchelf-c-test: %s (%s)\n", what, patchelf_error_message());
+        failed = 1;
+    }
+}
+
+
+static unsigned char * input;
+static size_t inputSize;
+
+
+/* Patch a copy of 'data' in memory, and return the first error. */
+static patchelf_status patchCopy(const unsigned char * data, size_t size)
+{
+    patchelf_handle * h;
+    patchelf_status res = patchelf_open_mem(data, size, &h);
+    if (res != PATCHELF_OK) return res;
+    if ((res = patchelf_set_rpath(h, "/a/rather/long/rpath/that/does/not/fit/in/place")) == PATCHELF_OK)
+        res = patchelf_commit(h);
+    patchelf_close(h);
+    return res;
+}
+
+
+static void * patchInThread(void * arg)
+{
+    long n = (long) arg;
+    char rpath[64];
+    int i;
+    for (i = 0; i < 20; ++i) {
+        patchelf_handle * h;
+        const char * res;
+        snprintf(rpath, sizeof(rpath), "/thread/%ld/%d", n, i);
+        if (patchelf_open_mem(input, inputSize, &h) != PATCHELF_OK) return (void *) 1;
+        if (patchelf_set_rpath(h, rpath) != PATCHELF_OK ||
+            patchelf_commit(h) != PATCHELF_OK ||
+            patchelf_get_rpath(h, &res) != PATCHELF_OK ||
+            strcmp(res, rpath) != 0)
+        {
+            patchelf_close(h);
+            return (void *) 1;
+        }
+        patchelf_close(h);
+    }
+    return 0;
+}
+
+
+int main(int argc, char * * argv)
+{
+    patchelf_handle * h;
+    const char * s;
+    const char * const * names;
+    const void * data;
+    size_t count, size;
+    char path[4096];
+    struct stat st;
+    pthread_t threads[8];
+    long i;
+    int fd;
+
+    if (argc != 3) {
+        fprintf(stderr, "syntax: %s LIBRARY OUT\n", argv[0]);
+        return 125;
+    }
+
+    fd = open(argv[1], O_RDONLY);
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        perror(argv[1]);
+        return 1;
+    }
+    inputSize = st.st_size;
+    input = malloc(inputSize);
+    if (!input || read(fd, input, inputSize) != (ssize_t) inputSize) {
+        perror(argv[1]);
+        return 1;
+    }
+    close(fd);
+
+    /* A file descriptor, patched in place. */
+    snprintf(path, sizeof(path), "%s-fd.so", argv[2]);
+    fd = open(path, O_RDWR);
+    if (fd == -1) {
+        perror(path);
+        return 1;
+    }
+    check(patchelf_open_fd(fd, &h) == PATCHELF_OK, "opening the descriptor");
+    check(patchelf_set_rpath(h, "/fd") == PATCHELF_OK, "setting the RPATH");
+    check(patchelf_commit_to_fd(h, fd) == PATCHELF_OK, "writing to the descriptor");
+    patchelf_close(h);
+    close(fd);
+
+    /* Memory, with a query before and after each commit. */
+    check(patchelf_open_mem(input, inputSize, &h) == PATCHELF_OK, "opening the buffer");
+    check(patchelf_get_needed(h, &names, &count) == PATCHELF_OK, "getting DT_NEEDED");
+    check(count > 0 && strcmp(names[0], "libbar.so") == 0, "wrong DT_NEEDED entries");
+    check(patchelf_replace_needed(h, "libbar.so", "libbaz.so") == PATCHELF_OK, "replacing DT_NEEDED");
+    check(patchelf_get_needed(h, &names, &count) == PATCHELF_OK && strcmp(names[0], "libbar.so") == 0,
+        "edit applied before the commit");
+    check(patchelf_commit(h) == PATCHELF_OK, "committing");
+    check(patchelf_get_needed(h, &names, &count) == PATCHELF_OK && strcmp(names[0], "libbaz.so") == 0,
+        "DT_NEEDED not replaced");
+    check(patchelf_set_soname(h, "libmem.so") == PATCHELF_OK, "setting the soname");
+    check(patchelf_commit(h) == PATCHELF_OK, "committing");
+    check(patchelf_get_soname(h, &s) == PATCHELF_OK && strcmp(s, "libmem.so") == 0, "wrong soname");
+
+    snprintf(path, sizeof(path), "%s-mem.so", argv[2]);
+    check(patchelf_get_data(h, &data, &size) == PATCHELF_OK, "getting the data");
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0777);
+    if (fd == -1 || write(fd, data, size) != (ssize_t) size || close(fd) == -1) {
+        perror(path);
+        return 1;
+    }
+
+    /* A failed write: the descriptor is read-only. */
+    fd = open(path, O_RDONLY);
+    check(patchelf_set_rpath(h, "/ro") == PATCHELF_OK, "setting the RPATH");
+    check(patchelf_commit_to_fd(h, fd) == PATCHELF_ERR_IO, "no error for a read-only descriptor");
+    close(fd);
+    patchelf_close(h);
+
+    /* Errors. */
+    h = 0;
+    check(patchelf_open_mem("garbage", 7, &h) == PATCHELF_ERR_FORMAT && !h, "no error for a file that isn't ELF");
+    check(*patchelf_error_message() != 0, "no error message");
+    check(patchelf_set_rpath(0, "/x") == PATCHELF_ERR_INVALID_ARGUMENT, "no error for a null handle");
+    check(patchelf_open_fd(-1, &h) == PATCHELF_ERR_INVALID_ARGUMENT, "no error for a bad descriptor");
+
+    /* Corrupt files give an error, rather than crashing. */
+    if (inputSize > sizeof(Elf64_Ehdr) && input[EI_CLASS] == ELFCLASS64) {
+        unsigned char * bad = malloc(inputSize);
+        Elf64_Ehdr * ehdr = (Elf64_Ehdr *) bad;
+        Elf64_Shdr * shdrs = (Elf64_Shdr *) (bad + ((Elf64_Ehdr *) input)->e_shoff);
+
+        memcpy(bad, input, inputSize);
+        ehdr->e_shstrndx = ehdr->e_shnum + 10;
+        check(patchelf_open_mem(bad, inputSize, &h) == PATCHELF_ERR_FORMAT, "no error for a bad e_shstrndx");
+
+        memcpy(bad, input, inputSize);
+        shdrs[ehdr->e_shstrndx].sh_size = inputSize;
+        check(patchelf_open_mem(bad, inputSize, &h) == PATCHELF_ERR_FORMAT, "no error for a bad .shstrtab size");
+
+        memcpy(bad, input, inputSize);
+        shdrs[1].sh_name = 0x7fffffff;
+        check(patchelf_open_mem(bad, inputSize, &h) == PATCHELF_ERR_FORMAT, "no error for a bad section name");
+
+        memcpy(bad, input, inputSize);
+        ehdr->e_shentsize = 32;
+        check(patchCopy(bad, inputSize) == PATCHELF_ERR_FORMAT, "no error for a bad e_shentsize");
+
+        memcpy(bad, input, inputSize);
+        ehdr->e_shoff = (Elf64_Off) -16;
+        check(patchCopy(bad, inputSize) == PATCHELF_ERR_FORMAT, "no error for a bad e_shoff");
+
+        memcpy(bad, input, inputSize);
+        ehdr->e_phoff = (Elf64_Off) -16;
+        check(patchCopy(bad, inputSize) == PATCHELF_ERR_FORMAT, "no error for a bad e_phoff");
+
+        memcpy(bad, input, inputSize);
+        ((Elf64_Phdr *) (bad + ehdr->e_phoff))->p_filesz = (Elf64_Xword) -16;
+        check(patchCopy(bad, inputSize) == PATCHELF_ERR_FORMAT, "no error for a bad p_filesz");
+
+        /* The contents of .dynamic and .dynstr are read for --set-rpath. */
+        for (i = 1; i < ehdr->e_shnum; ++i) {
+            if (shdrs[i].sh_type != SHT_DYNAMIC) continue;
+            unsigned int dyn = i, str = shdrs[i].sh_link;
+
+            memcpy(bad, input, inputSize);
+            shdrs[dyn].sh_offset = (Elf64_Off) -16;
+            check(patchCopy(bad, inputSize) == PATCHELF_ERR_FORMAT, "no error for a bad .dynamic offset");
+
+            memcpy(bad, input, inputSize);
+            shdrs[str].sh_size = inputSize;
+            check(patchCopy(bad, inputSize) == PATCHELF_ERR_FORMAT, "no error for a bad .dynstr size");
+
+            memcpy(bad, input, inputSize);
+            shdrs[dyn].sh_link = ehdr->e_shnum;
+            check(patchCopy(bad, inputSize) == PATCHELF_ERR_FORMAT, "no error for a bad .dynamic link");
+        }
+
+        /* Whatever section points outside the file, there's no crash. */
+        for (i = 1; i < ehdr->e_shnum; ++i) {
+            memcpy(bad, input, inputSize);
+            shdrs[i].sh_offset = inputSize - 1;
+            patchCopy(bad, inputSize);
+            shdrs[i].sh_offset = 1;
+            shdrs[i].sh_size = (Elf64_Xword) -1;
+            patchCopy(bad, inputSize);
+        }
+
+        free(bad);
+    }
+
+    /* Several threads, each with its own handles. */
+    for (i = 0; i < 8; ++i)
+        pthread_create(&threads[i], 0, patchInThread, (void *) i);
+    for (i = 0; i < 8; ++i) {
+        void * res;
+        pthread_join(threads[i], &res);
+        check(res == 0, "wrong result from concurrent patching");
+    }
+
+    return failed;
+}
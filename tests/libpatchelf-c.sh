@@ -0,0 +1,22 @@
+#! /bin/sh -e
+SCRATCH=scratch/$(basename $0 .sh)
+
+rm -rf ${SCRATCH}
+mkdir -p ${SCRATCH}
+
+cp libfoo.so ${SCRATCH}/out-fd.so
+
+./libpatchelf-c-test libfoo.so ${SCRATCH}/out
+
+if [ "$(../src/patchelf --print-rpath ${SCRATCH}/out-fd.so)" != /fd ]; then
+    echo "wrong RPATH in the file patched through a descriptor"
+    exit 1
+fi
+if [ "$(../src/patchelf --print-soname ${SCRATCH}/out-mem.so)" != libmem.so ]; then
+    echo "wrong soname in the buffer written out"
+    exit 1
+fi
+if ! ../src/patchelf --print-needed ${SCRATCH}/out-mem.so | grep -q '^libbaz.so$'; then
+    echo "DT_NEEDED not replaced in the buffer written out"
+    exit 1
+fi
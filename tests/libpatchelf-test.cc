@@ -0,0 +1,129 @@
+/*
+ *  libpatchelf-test: exercise the library API on a shared library.
+ *  Used by libpatchelf.sh.
+ *
+ *  Patches a copy of LIBRARY in memory and writes it to OUT-buffer.so,
+ *  patches OUT-fd.so (a copy made by the caller) in place through a
+ *  file descriptor, and patches the library from several threads at
+ *  once, checking each result with the print operations.  If BIG (a
+ *  file with a large symbol table) is given, checks that rewriting its
+ *  symbols on several threads gives the same result as on one.
+ */
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+
+#include <cstdio>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "patchelf.h"
+
+using namespace patchelf;
+
+
+static bool failed = false;
+
+static void check(bool ok, const std::string & what)
+{
+    if (!ok) {
+        fprintf(stderr, "libpatchelf-test: %s\n", what.c_str());
+        failed = true;
+    }
+}
+
+
+static std::string rpathOf(FileContents contents)
+{
+    Operations ops;
+    ops.printRPath = true;
+    return patchElfContents(contents, ops).rpath;
+}
+
+
+int main(int argc, char * * argv)
+{
+    if (argc != 3 && argc != 4) {
+        fprintf(stderr, "syntax: %s LIBRARY OUT [BIG]\n", argv[0]);
+        return 125;
+    }
+    std::string library = argv[1], out = argv[2];
+
+    try {
+        FileContents input = readFile(library);
+        std::vector<unsigned char> original(*input);
+
+        /* A buffer: the input is left alone. */
+        Operations ops;
+        ops.setRPath = true;
+        ops.newRPath = "/buffer";
+        Result result;
+        FileContents patched = patchElfBuffer(input->data(), input->size(), ops, &result);
+        check(result.changed, "buffer not changed");
+        check(*input == original, "input buffer modified");
+        check(rpathOf(patched) == "/buffer", "wrong RPATH in the buffer");
+        writeOutputFile(out + "-buffer.so", patched, "", 0);
+
+        /* The queries. */
+        Operations queries;
+        queries.printNeeded = true;
+        queries.printSoname = true;
+        result = patchElfContents(patched, queries);
+        check(!result.changed, "queries changed the file");
+        check(!result.needed.empty() && result.needed[0] == "libbar.so", "wrong DT_NEEDED entries");
+
+        /* A file descriptor, patched in place. */
+        int fd = open((out + "-fd.so").c_str(), O_RDWR);
+        if (fd == -1) throw SysError("opening the copy");
+        ops.newRPath = "/fd";
+        result = patchElfFd(fd, ops);
+        check(result.changed, "file not changed");
+        close(fd);
+
+        /* Several threads, each with its own operations and buffers. */
+        std::vector<std::thread> threads;
+        std::atomic<unsigned int> good{0};
+        for (unsigned int i = 0; i < 8; ++i)
+            threads.emplace_back([&, i]() {
+                Operations ops;
+                ops.setRPath = true;
+                ops.newRPath = "/thread/" + std::to_string(i) + std::string(i * 10, 'x');
+                for (unsigned int j = 0; j < 20; ++j) {
+                    FileContents res = patchElfBuffer(original.data(), original.size(), ops);
+                    if (rpathOf(res) == ops.newRPath) good++;
+                }
+            });
+        for (auto & t : threads) t.join();
+        check(good == 8 * 20, "wrong results from concurrent patching");
+
+        /* Errors are exceptions. */
+        bool thrown = false;
+        try {
+            std::vector<unsigned char> garbage(4096, 'x');
+            patchElfBuffer(garbage.data(), garbage.size(), ops);
+        } catch (std::runtime_error & e) {
+            thrown = true;
+        }
+        check(thrown, "no exception for a file that isn't ELF");
+
+        /* A large symbol table, split between threads. */
+        if (argc == 4) {
+            FileContents big = readFile(argv[3]);
+            ops.newRPath = std::string(4096, 'x');
+            ops.threads = 1;
+            FileContents serial = patchElfBuffer(big->data(), big->size(), ops);
+            ops.threads = 4;
+            FileContents parallel = patchElfBuffer(big->data(), big->size(), ops);
+            check(*serial != *big, "large file not changed");
+            check(*serial == *parallel, "different results from one and several threads");
+        }
+    } catch (std::exception & e) {
+        fprintf(stderr, "libpatchelf-test: %s\n", e.what());
+        return 1;
+    }
+
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,23 @@
+#! /bin/sh -e
+SCRATCH=scratch/$(basename $0 .sh)
+
+rm -rf ${SCRATCH}
+mkdir -p ${SCRATCH}
+
+cp libfoo.so ${SCRATCH}/
+cp libfoo.so ${SCRATCH}/out-fd.so
+
+# A library whose .symtab is large enough to be split between threads.
+./gen-elf --symtab 1200000 --sections 100 ${SCRATCH}/big.so
+
+./libpatchelf-test ${SCRATCH}/libfoo.so ${SCRATCH}/out ${SCRATCH}/big.so
+
+cmp libfoo.so ${SCRATCH}/libfoo.so
+if [ "$(../src/patchelf --print-rpath ${SCRATCH}/out-buffer.so)" != /buffer ]; then
+    echo "wrong RPATH in the buffer written out"
+    exit 1
+fi
+if [ "$(../src/patchelf --print-rpath ${SCRATCH}/out-fd.so)" != /fd ]; then
+    echo "wrong RPATH in the file patched through a descriptor"
+    exit 1
+fi
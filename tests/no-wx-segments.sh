@@ -0,0 +1,24 @@
+#! /bin/sh -e
+SCRATCH=scratch/$(basename $0 .sh)
+
+# Growing .dynamic and .dynstr of a non-PIE executable, twice, must not
+# leave a segment that is both writable and executable, even when the
+# text segment starts at the beginning of the file and the replaced
+# sections don't fit in front of it.
+
+rm -rf ${SCRATCH}
+mkdir -p ${SCRATCH}
+
+for prog in simple-no-pie simple-text-first; do
+    cp $prog ${SCRATCH}/simple
+    for rpath in /$(printf 'y%.0s' $(seq 2700)) /$(printf 'z%.0s' $(seq 4000)); do
+        ../src/patchelf --add-needed libm.so.6 --set-rpath $rpath ${SCRATCH}/simple
+        ${SCRATCH}/simple
+
+        if readelf -lW ${SCRATCH}/simple | grep ' LOAD ' | grep -q 'RWE'; then
+            echo "$prog has a writable and executable segment:"
+            readelf -lW ${SCRATCH}/simple
+            exit 1
+        fi
+    done
+done
@@ -0,0 +1,59 @@
+#! /bin/sh -e
+SCRATCH=scratch/$(basename $0 .sh)
+
+rm -rf ${SCRATCH}
+mkdir -p ${SCRATCH}
+
+cp main ${SCRATCH}/
+cp libfoo.so ${SCRATCH}/
+cp libbar.so ${SCRATCH}/
+cp ${SCRATCH}/main ${SCRATCH}/main.orig
+
+# Write to a new file; the input must be left alone.
+../src/patchelf --force-rpath --set-rpath "$(pwd)/${SCRATCH}" -o ${SCRATCH}/main-patched ${SCRATCH}/main
+cmp ${SCRATCH}/main ${SCRATCH}/main.orig
+if [ ! -x ${SCRATCH}/main-patched ]; then
+    echo "permissions of the input not copied"
+    exit 1
+fi
+exitCode=0
+${SCRATCH}/main-patched || exitCode=$?
+if [ $exitCode != 46 ]; then
+    echo "bad exit code from the patched program: $exitCode"
+    exit 1
+fi
+
+# The executable layout moves the whole file (shiftFile()).
+oldInterpreter=$(../src/patchelf --print-interpreter ${SCRATCH}/main)
+newInterpreter=$(pwd)/${SCRATCH}/iiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiii
+ln -s "$oldInterpreter" "$newInterpreter"
+../src/patchelf --set-interpreter "$newInterpreter" --output ${SCRATCH}/main-interp ${SCRATCH}/main-patched
+exitCode=0
+${SCRATCH}/main-interp || exitCode=$?
+if [ $exitCode != 46 ]; then
+    echo "bad exit code after --set-interpreter: $exitCode"
+    exit 1
+fi
+
+# Without edits, the output is a copy.
+../src/patchelf -o ${SCRATCH}/libfoo-copy.so ${SCRATCH}/libfoo.so
+cmp ${SCRATCH}/libfoo.so ${SCRATCH}/libfoo-copy.so
+
+# "-o -" is standard output.
+../src/patchelf -o - ${SCRATCH}/libfoo.so > ${SCRATCH}/libfoo-stdout.so
+cmp ${SCRATCH}/libfoo.so ${SCRATCH}/libfoo-stdout.so
+
+# A larger file, where most of the blocks can be copied; every byte
+# outside the headers and the added segments must be preserved.
+./gen-elf --symbols 1000 --size 8M ${SCRATCH}/big.so
+../src/patchelf --set-rpath "$newInterpreter" -o ${SCRATCH}/big-patched.so ${SCRATCH}/big.so
+if [ "$(../src/patchelf --print-rpath ${SCRATCH}/big-patched.so)" != "$newInterpreter" ]; then
+    echo "wrong RPATH in the output"
+    exit 1
+fi
+cmp -n 8000000 -i 65536 ${SCRATCH}/big.so ${SCRATCH}/big-patched.so
+
+if ../src/patchelf -o ${SCRATCH}/out ${SCRATCH}/libfoo.so ${SCRATCH}/libbar.so 2> /dev/null; then
+    echo "--output with two files succeeded"
+    exit 1
+fi
@@ -0,0 +1,54 @@
+#! /bin/sh -e
+SCRATCH=scratch/$(basename $0 .sh)
+
+rm -rf ${SCRATCH}
+mkdir -p ${SCRATCH}/tree/lib/sub ${SCRATCH}/tree/bin ${SCRATCH}/outside
+
+cp main ${SCRATCH}/tree/bin/
+cp libfoo.so ${SCRATCH}/tree/lib/
+cp libbar.so ${SCRATCH}/tree/lib/sub/
+ln ${SCRATCH}/tree/lib/sub/libbar.so ${SCRATCH}/tree/lib/libbar-link.so
+cp foo.o ${SCRATCH}/tree/lib/
+echo "not an ELF file" > ${SCRATCH}/tree/README
+cp libfoo.so ${SCRATCH}/outside/
+ln -s ../outside ${SCRATCH}/tree/link-to-outside
+
+newRPath=/some/rpath/that/is/long/enough/to/need/a/new/section
+
+# Object files, text files and symbolic links are skipped silently;
+# the hard-linked library is only patched once.
+../src/patchelf --set-rpath $newRPath --recursive ${SCRATCH}/tree --jobs 4 --stats=json 2> ${SCRATCH}/stderr
+
+for i in bin/main lib/libfoo.so lib/sub/libbar.so lib/libbar-link.so; do
+    rpath=$(../src/patchelf --print-rpath ${SCRATCH}/tree/$i)
+    if [ "$rpath" != "$newRPath" ]; then
+        echo "wrong RPATH in $i: $rpath"
+        exit 1
+    fi
+done
+
+patched=$(grep -c '^{"file": ' ${SCRATCH}/stderr || true)
+if [ "$patched" != 3 ]; then
+    echo "patched $patched files instead of 3"
+    exit 1
+fi
+
+cmp foo.o ${SCRATCH}/tree/lib/foo.o
+cmp libfoo.so ${SCRATCH}/outside/libfoo.so
+
+# An error in one file is reported, but the others are still patched.
+cp libbar.so ${SCRATCH}/tree/lib/sub/libbaz.so
+chmod a-w ${SCRATCH}/tree/lib/libfoo.so
+exitCode=0
+../src/patchelf --set-rpath /other --recursive ${SCRATCH}/tree 2> ${SCRATCH}/stderr || exitCode=$?
+chmod u+w ${SCRATCH}/tree/lib/libfoo.so
+if [ "$(id -u)" != 0 ]; then
+    if [ $exitCode = 0 ] || ! grep -q "libfoo.so" ${SCRATCH}/stderr; then
+        echo "error in one file not reported"
+        exit 1
+    fi
+fi
+if [ "$(../src/patchelf --print-rpath ${SCRATCH}/tree/lib/sub/libbaz.so)" != /other ]; then
+    echo "other files not patched after an error"
+    exit 1
+fi
@@ -0,0 +1,54 @@
+#! /bin/sh -e
+SCRATCH=scratch/$(basename $0 .sh)
+
+rm -rf ${SCRATCH}
+mkdir -p ${SCRATCH}
+mkdir -p ${SCRATCH}/libsA
+mkdir -p ${SCRATCH}/libsB
+
+cp main ${SCRATCH}/
+cp libfoo.so ${SCRATCH}/libsA/
+cp libbar.so ${SCRATCH}/libsB/
+
+../src/patchelf --set-rpath $(pwd)/${SCRATCH}/libsA:$(pwd)/${SCRATCH}/libsB ${SCRATCH}/main
+
+countLoads() {
+    readelf -l -W "$1" | grep -c '^ *LOAD'
+}
+
+# Grow the RPATH of libfoo.so a few times.  Only the first round
+# should add PT_LOAD segments (one for the read-only .dynstr and one
+# for the writable .dynamic); the following ones should extend the
+# read-only one.
+origLoads=$(countLoads ${SCRATCH}/libsA/libfoo.so)
+rpath=/oops
+for i in 1 2 3; do
+    rpath=$rpath:/some/very/long/path/that/does/not/exist/$i
+    ../src/patchelf --set-rpath $rpath:$(pwd)/${SCRATCH}/libsB ${SCRATCH}/libsA/libfoo.so
+    if test $i = 1; then firstLoads=$(countLoads ${SCRATCH}/libsA/libfoo.so); fi
+done
+newLoads=$(countLoads ${SCRATCH}/libsA/libfoo.so)
+
+if test "$firstLoads" -gt "$((origLoads + 2))"; then
+    echo "first round added more than two PT_LOADs ($origLoads -> $firstLoads)"
+    exit 1
+fi
+
+if test "$newLoads" != "$firstLoads"; then
+    echo "repeated patching added PT_LOAD segments ($firstLoads -> $newLoads)"
+    exit 1
+fi
+
+# The relocated .dynstr must not end up in a writable segment.
+if readelf -l -W ${SCRATCH}/libsA/libfoo.so | grep '^ *LOAD' | tail -n 1 | grep -q 'RW'; then
+    echo "relocated .dynstr is mapped writable"
+    exit 1
+fi
+
+exitCode=0
+(cd ${SCRATCH} && ./main) || exitCode=$?
+
+if test "$exitCode" != 46; then
+    echo "bad exit code!"
+    exit 1
+fi
@@ -0,0 +1,32 @@
+#! /bin/sh -e
+SCRATCH=scratch/$(basename $0 .sh)
+
+# Two runs on a PIE: the first moves .interp and the other sections
+# before .dynstr to the end of the file, and the second adds enough
+# to need another segment, so the sections that would now be under
+# the program header table must be found although the section headers
+# are no longer in address order.
+
+rm -rf ${SCRATCH}
+mkdir -p ${SCRATCH}/libsA ${SCRATCH}/libsB
+
+cp main ${SCRATCH}/
+cp libfoo.so ${SCRATCH}/libsA/
+cp libbar.so libsimple.so ${SCRATCH}/libsB/
+
+longRPath=$(pwd)/${SCRATCH}/libsA:$(pwd)/${SCRATCH}/libsB:/$(printf 'x%.0s' $(seq 300))
+../src/patchelf --set-rpath $longRPath ${SCRATCH}/main
+../src/patchelf --add-needed libbar.so --add-needed libsimple.so \
+    --add-needed libm.so.6 --add-needed libc.so.6 ${SCRATCH}/main
+
+if test "$(uname)" = FreeBSD; then
+    export LD_LIBRARY_PATH=$(pwd)/${SCRATCH}/libsB
+fi
+
+exitCode=0
+(cd ${SCRATCH} && ./main) || exitCode=$?
+
+if test "$exitCode" != 46; then
+    echo "bad exit code!"
+    exit 1
+fi
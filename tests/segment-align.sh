@@ -0,0 +1,30 @@
+#! /bin/sh -e
+SCRATCH=scratch/$(basename $0 .sh)
+
+rm -rf ${SCRATCH}
+mkdir -p ${SCRATCH}
+
+# This binary has PT_LOAD segments aligned to 2 MiB.
+cp ${srcdir}/no-rpath-prebuild/no-rpath-amd64 ${SCRATCH}/no-rpath
+
+../src/patchelf --page-size 4096 --segment-align \
+    --set-interpreter /a/very/long/path/to/some/dynamic/loader/that/needs/more/space/ld.so \
+    --set-rpath /foo:/bar ${SCRATCH}/no-rpath
+
+readelf -l -W ${SCRATCH}/no-rpath | grep '^ *LOAD' | while read type offset vaddr paddr filesz memsz flags; do
+    align=$(echo $flags | sed 's/.* //')
+    if test "$((align))" != "$((0x200000))"; then
+        echo "segment at $vaddr lost its alignment ($align)"
+        exit 1
+    fi
+    if test "$(( (vaddr - offset) % align ))" != 0; then
+        echo "segment at $vaddr is not congruent modulo $align"
+        exit 1
+    fi
+done
+
+newRPath=$(../src/patchelf --print-rpath ${SCRATCH}/no-rpath)
+if test "$newRPath" != /foo:/bar; then
+    echo "wrong RPATH: $newRPath"
+    exit 1
+fi
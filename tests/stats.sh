@@ -0,0 +1,47 @@
+#! /bin/sh -e
+SCRATCH=scratch/$(basename $0 .sh)
+
+rm -rf ${SCRATCH}
+mkdir -p ${SCRATCH}
+
+cp libsimple.so ${SCRATCH}/
+cp simple ${SCRATCH}/
+
+longPath=$(printf '/%0100d' 0 | tr 0 x)
+
+../src/patchelf --stats=json --set-rpath "$longPath" ${SCRATCH}/libsimple.so ${SCRATCH}/simple \
+    2> ${SCRATCH}/stats.json
+
+# One line per file and one for the total.
+if [ "$(grep -c '"file": ' ${SCRATCH}/stats.json)" != 2 ] ||
+   ! grep -q '^{"files": 2, ' ${SCRATCH}/stats.json; then
+    cat ${SCRATCH}/stats.json
+    echo "wrong number of records"
+    exit 1
+fi
+
+for phase in read parse set-rpath layout rewrite-headers write; do
+    if ! grep -q "\"$phase\": {\"wall_ms\": " ${SCRATCH}/stats.json; then
+        echo "phase $phase missing"
+        exit 1
+    fi
+done
+
+size=$(stat -c %s ${SCRATCH}/libsimple.so)
+if ! grep "libsimple.so" ${SCRATCH}/stats.json | grep -q "\"bytes_written\": $size, "; then
+    echo "wrong number of bytes written"
+    exit 1
+fi
+
+if grep -q '"sections_replaced": 0' ${SCRATCH}/stats.json; then
+    echo "replaced sections not counted"
+    exit 1
+fi
+
+# The plain text version.
+../src/patchelf --stats --print-rpath ${SCRATCH}/libsimple.so 2> ${SCRATCH}/stats.txt
+if ! grep -q '^  print-rpath ' ${SCRATCH}/stats.txt; then
+    cat ${SCRATCH}/stats.txt
+    echo "print-rpath phase missing"
+    exit 1
+fi
@@ -0,0 +1,51 @@
+#! /bin/sh -e
+SCRATCH=scratch/$(basename $0 .sh)
+
+rm -rf ${SCRATCH}
+mkdir -p ${SCRATCH}
+
+cp main ${SCRATCH}/
+cp libfoo.so ${SCRATCH}/
+cp libbar.so ${SCRATCH}/
+
+longPath=$(printf '/%0100d' 0 | tr 0 x)
+
+# As a filter: the input comes from a pipe, not a file.
+cat ${SCRATCH}/libfoo.so | ../src/patchelf --stdin --stdout --set-rpath "$longPath" > ${SCRATCH}/libfoo-patched.so
+if [ "$(../src/patchelf --print-rpath ${SCRATCH}/libfoo-patched.so)" != "$longPath" ]; then
+    echo "wrong RPATH in filtered output"
+    exit 1
+fi
+
+# Printing from standard input.
+if [ "$(../src/patchelf --stdin --print-rpath < ${SCRATCH}/libfoo-patched.so)" != "$longPath" ]; then
+    echo "wrong RPATH printed from standard input"
+    exit 1
+fi
+
+# Without edits, the file is passed through unchanged.
+../src/patchelf --stdin --stdout < ${SCRATCH}/libfoo.so > ${SCRATCH}/libfoo-copy.so
+cmp ${SCRATCH}/libfoo.so ${SCRATCH}/libfoo-copy.so
+
+# --stdout with a file name leaves the file alone.  The result must
+# still run.
+cp ${SCRATCH}/main ${SCRATCH}/main.orig
+../src/patchelf --stdout --force-rpath --set-rpath "$(pwd)/${SCRATCH}" ${SCRATCH}/main > ${SCRATCH}/main-patched
+cmp ${SCRATCH}/main ${SCRATCH}/main.orig
+chmod +x ${SCRATCH}/main-patched
+exitCode=0
+${SCRATCH}/main-patched || exitCode=$?
+if [ $exitCode != 46 ]; then
+    echo "bad exit code from the patched program: $exitCode"
+    exit 1
+fi
+
+# Nowhere to write the result to.
+if ../src/patchelf --stdin --set-rpath /foo < ${SCRATCH}/libfoo.so 2> /dev/null; then
+    echo "--stdin without --stdout succeeded"
+    exit 1
+fi
+if ../src/patchelf --stdout --print-rpath ${SCRATCH}/libfoo.so > /dev/null 2>&1; then
+    echo "--stdout with --print-rpath succeeded"
+    exit 1
+fi
@@ -0,0 +1,90 @@
+#! /bin/sh -e
+SCRATCH=scratch/$(basename $0 .sh)
+
+rm -rf ${SCRATCH}
+mkdir -p ${SCRATCH}
+
+longPath=$(printf '/%0100d' 0 | tr 0 x)
+
+# The symbols of .symtab, with their section by name rather than
+# index; a section symbol's value must be its section's address.
+symbols() {
+    readelf -SW $1 | sed -n 's/^ *\[ *\([0-9]*\)\] \([^ ]*\) *[A-Z_]* *\([0-9a-f]*\) .*/\1 \2 \3/p' > $1.sections
+    readelf -sW $1 | sed -n '/Symbol table .\.symtab/,$p' | awk '
+        FNR == NR { name[$1] = $2; addr[$1] = $3; next }
+        $1 ~ /:$/ && $7 ~ /^[0-9]+$/ {
+            if ($4 == "SECTION" && $2 != addr[$7]) print "bad value for section symbol", $1
+            print $2, $4, name[$7], $8
+        }' $1.sections -
+}
+
+# Run the common operations on every class, byte order and file type.
+for class in 32 64; do
+    for data in lsb msb; do
+        for type in exec dyn; do
+            f=${SCRATCH}/$class-$data-$type
+            ./gen-elf --class $class --data $data --type $type --needed 3 \
+                --symbols 100 --symtab 50 --verneed 2 --sections 5 --soname libsynthetic.so $f
+            echo "testing $f"
+            symbols $f > $f.symbols-before
+
+            if [ "$(../src/patchelf --print-needed $f | wc -l)" != 3 ]; then
+                echo "wrong DT_NEEDED entries"
+                exit 1
+            fi
+
+            ../src/patchelf --set-rpath "$longPath" $f
+            ../src/patchelf --replace-needed libneeded0.so libreplaced.so $f
+            ../src/patchelf --add-needed libextra.so $f
+            if [ "$(../src/patchelf --print-rpath $f)" != "$longPath" ]; then
+                echo "wrong RPATH after --set-rpath"
+                exit 1
+            fi
+            needed=$(../src/patchelf --print-needed $f | tr '\n' ' ')
+            if [ "$needed" != "libextra.so libreplaced.so libneeded1.so libneeded2.so " ]; then
+                echo "wrong DT_NEEDED entries after editing: $needed"
+                exit 1
+            fi
+
+            if [ $type = exec ]; then
+                ../src/patchelf --set-interpreter "$longPath" $f
+                if [ "$(../src/patchelf --print-interpreter $f)" != "$longPath" ]; then
+                    echo "wrong interpreter"
+                    exit 1
+                fi
+            else
+                ../src/patchelf --set-soname "$longPath" $f
+                if [ "$(../src/patchelf --print-soname $f)" != "$longPath" ]; then
+                    echo "wrong soname"
+                    exit 1
+                fi
+            fi
+
+            # The symbols only changed where their section moved.
+            symbols $f > $f.symbols-after
+            if grep "bad value" $f.symbols-after; then
+                exit 1
+            fi
+            if [ "$(grep -v SECTION $f.symbols-before)" != "$(grep -v SECTION $f.symbols-after)" ]; then
+                echo "symbols changed"
+                exit 1
+            fi
+
+            # The result must still be a well-formed file.
+            if readelf -a $f 2>&1 >/dev/null | grep -i -E 'error|warning'; then
+                exit 1
+            fi
+        done
+    done
+done
+
+# A sparse file larger than 4 GiB, to exercise 64-bit offsets.  This
+# needs as much memory as the file is large, so it's opt-in.
+if [ -n "$PATCHELF_LARGE_TESTS" ]; then
+    ./gen-elf --size 5G ${SCRATCH}/huge
+    ../src/patchelf --set-rpath "$longPath" ${SCRATCH}/huge
+    if [ "$(../src/patchelf --print-rpath ${SCRATCH}/huge)" != "$longPath" ]; then
+        echo "wrong RPATH in large file"
+        exit 1
+    fi
+fi
@@ -0,0 +1,54 @@
+#! /bin/sh -e
+SCRATCH=scratch/$(basename $0 .sh)
+
+rm -rf ${SCRATCH}
+mkdir -p ${SCRATCH}/in/lib ${SCRATCH}/out1 ${SCRATCH}/out2
+
+cp main libfoo.so libbar.so ${SCRATCH}/in/
+longName=$(printf 'lib%0120d.so' 0)
+cp libbar.so ${SCRATCH}/in/lib/$longName
+echo "not an ELF file" > ${SCRATCH}/in/README
+# Starts with the ELF magic, but can't be parsed.
+head -c 1000 libfoo.so > ${SCRATCH}/in/truncated.so
+ln -s libfoo.so ${SCRATCH}/in/libfoo-link.so
+
+(cd ${SCRATCH}/in && tar --format=pax -cf ../in.tar .)
+
+newRPath=/some/rpath/that/is/long/enough/to/need/a/new/section
+
+# Through a pipe (splice), and between regular files (read/write).
+cat ${SCRATCH}/in.tar | ../src/patchelf --tar --set-rpath $newRPath | cat > ${SCRATCH}/out1.tar
+../src/patchelf --tar --set-rpath $newRPath < ${SCRATCH}/in.tar > ${SCRATCH}/out2.tar 2> ${SCRATCH}/stderr
+cmp ${SCRATCH}/out1.tar ${SCRATCH}/out2.tar
+
+if ! grep -q "truncated.so" ${SCRATCH}/stderr; then
+    echo "no warning about the unpatchable member"
+    exit 1
+fi
+
+tar -tf ${SCRATCH}/out1.tar > /dev/null
+(cd ${SCRATCH}/out1 && tar -xf ../out1.tar)
+
+for i in main libfoo.so libbar.so lib/$longName; do
+    rpath=$(../src/patchelf --print-rpath ${SCRATCH}/out1/$i)
+    if [ "$rpath" != "$newRPath" ]; then
+        echo "wrong RPATH in $i: $rpath"
+        exit 1
+    fi
+done
+
+cmp ${SCRATCH}/in/README ${SCRATCH}/out1/README
+cmp ${SCRATCH}/in/truncated.so ${SCRATCH}/out1/truncated.so
+if [ "$(readlink ${SCRATCH}/out1/libfoo-link.so)" != libfoo.so ]; then
+    echo "symbolic link not preserved"
+    exit 1
+fi
+
+# Without edits, the archive is unchanged.
+../src/patchelf --tar < ${SCRATCH}/in.tar > ${SCRATCH}/same.tar
+cmp ${SCRATCH}/in.tar ${SCRATCH}/same.tar
+
+if ../src/patchelf --tar --set-rpath /x ${SCRATCH}/in/main < /dev/null > /dev/null 2>&1; then
+    echo "--tar with a file name succeeded"
+    exit 1
+fi
@@ -0,0 +1,38 @@
+#! /bin/sh -e
+SCRATCH=scratch/$(basename $0 .sh)
+
+rm -rf ${SCRATCH}
+mkdir -p ${SCRATCH}
+
+cp libsimple.so ${SCRATCH}/
+cp simple ${SCRATCH}/
+
+longPath=$(printf '/%0100d' 0 | tr 0 x)
+
+../src/patchelf --trace ${SCRATCH}/trace.json --set-rpath "$longPath" \
+    ${SCRATCH}/libsimple.so ${SCRATCH}/simple
+
+# A span for each file, and one for each phase within it.
+for file in libsimple.so simple; do
+    if ! grep -q "{\"name\": \"${SCRATCH}/$file\", \"cat\": \"file\", \"ph\": \"X\"" ${SCRATCH}/trace.json; then
+        cat ${SCRATCH}/trace.json
+        echo "span for $file missing"
+        exit 1
+    fi
+done
+for phase in read parse set-rpath layout rewrite-headers write; do
+    if [ "$(grep -c "{\"name\": \"$phase\", \"cat\": \"phase\", " ${SCRATCH}/trace.json)" != 2 ]; then
+        echo "spans for phase $phase missing"
+        exit 1
+    fi
+done
+
+# The file must be complete even if patchelf fails.
+if ../src/patchelf --trace ${SCRATCH}/trace.json --print-rpath ${SCRATCH}/missing 2> /dev/null; then
+    echo "patchelf succeeded on a missing file"
+    exit 1
+fi
+if [ "$(tail -n 1 ${SCRATCH}/trace.json)" != "]}" ]; then
+    echo "trace not terminated"
+    exit 1
+fi
@@ -0,0 +1,70 @@
+#! /bin/sh -e
+SCRATCH=scratch/$(basename $0 .sh)
+
+if ! command -v zip > /dev/null || ! command -v unzip > /dev/null; then
+    echo "zip and unzip are needed for this test"
+    exit 77
+fi
+if ../src/patchelf --zip 2>&1 | grep -q "built without zlib"; then
+    exit 77
+fi
+
+rm -rf ${SCRATCH}
+mkdir -p ${SCRATCH}/in/lib ${SCRATCH}/out
+
+cp main libfoo.so ${SCRATCH}/in/
+cp libbar.so ${SCRATCH}/in/lib/
+echo "not an ELF file" > ${SCRATCH}/in/README
+# Starts with the ELF magic, but can't be parsed.
+head -c 1000 libfoo.so > ${SCRATCH}/in/truncated.so
+
+(cd ${SCRATCH}/in && zip -qr ../in.zip main libfoo.so lib README truncated.so)
+# Stored rather than deflated.
+(cd ${SCRATCH}/in && cp libfoo.so stored.so && zip -q0 ../in.zip stored.so)
+
+newRPath=/some/rpath/that/is/long/enough/to/need/a/new/section
+
+../src/patchelf --zip --set-rpath $newRPath --output ${SCRATCH}/out.zip ${SCRATCH}/in.zip 2> ${SCRATCH}/stderr
+
+if ! grep -q "truncated.so" ${SCRATCH}/stderr; then
+    echo "no warning about the unpatchable member"
+    exit 1
+fi
+
+unzip -tq ${SCRATCH}/out.zip
+(cd ${SCRATCH}/out && unzip -q ../out.zip)
+
+for i in main libfoo.so lib/libbar.so stored.so; do
+    rpath=$(../src/patchelf --print-rpath ${SCRATCH}/out/$i)
+    if [ "$rpath" != "$newRPath" ]; then
+        echo "wrong RPATH in $i: $rpath"
+        exit 1
+    fi
+done
+
+cmp ${SCRATCH}/in/README ${SCRATCH}/out/README
+cmp ${SCRATCH}/in/truncated.so ${SCRATCH}/out/truncated.so
+
+# The members that aren't patched are copied, not recompressed.
+unzip -v ${SCRATCH}/in.zip | grep -E 'README|truncated' > ${SCRATCH}/in.list
+unzip -v ${SCRATCH}/out.zip | grep -E 'README|truncated' > ${SCRATCH}/out.list
+cmp ${SCRATCH}/in.list ${SCRATCH}/out.list
+
+# In place; without edits, the archive is unchanged.
+cp ${SCRATCH}/in.zip ${SCRATCH}/same.zip
+../src/patchelf --zip ${SCRATCH}/same.zip
+cmp ${SCRATCH}/in.zip ${SCRATCH}/same.zip
+
+cp ${SCRATCH}/in.zip ${SCRATCH}/inplace.zip
+../src/patchelf --zip --set-rpath $newRPath ${SCRATCH}/inplace.zip 2> /dev/null
+cmp ${SCRATCH}/out.zip ${SCRATCH}/inplace.zip
+
+# Written to a pipe, so with a data descriptor after the data.
+cat libbar.so | zip -q -fz- - - | cat > ${SCRATCH}/streamed.zip
+../src/patchelf --zip --set-rpath $newRPath ${SCRATCH}/streamed.zip
+unzip -tq ${SCRATCH}/streamed.zip
+unzip -p ${SCRATCH}/streamed.zip - > ${SCRATCH}/streamed.so
+if [ "$(../src/patchelf --print-rpath ${SCRATCH}/streamed.so)" != "$newRPath" ]; then
+    echo "wrong RPATH in the streamed member"
+    exit 1
+fi